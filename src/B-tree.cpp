@@ -112,7 +112,7 @@ IntegerVector p2sum(IntegerVector pwr2) {
   return psum;
 }
 
-
+// [[Rcpp::export(.gamma1_direct)]]
 NumericVector gamma1_direct(IntegerVector y, NumericVector z) {
   // utility: direct computation of the sum gamm1
   // for the purpose of testing and benchmarks
@@ -0,0 +1,239 @@
+/*
+   Ecluster.c: hierarchical clustering by minimum energy distance
+
+   Szekely, G. J. and Rizzo, M. L. (2005) Hierarchical Clustering
+   via Joint Between-Within Distances: Extending Ward's Minimum
+   Variance Method, Journal of Classification 22(2) 151-183.
+
+   The e-distances of the clusters are updated by the Lance-Williams
+   recursion of Ward's method on the dissimilarities |x_i - x_j|^alpha
+   (hclust method "ward.D"):
+       d(k, i+j) = [(n_i + n_k) d(k, i) + (n_j + n_k) d(k, j)
+                    - n_k d(i, j)] / (n_i + n_j + n_k)
+   in place, in one packed lower triangle (utilities.h).  The method is
+   reducible, so the merges are found by the nearest neighbor chain
+   algorithm in O(n^2) time: the chain grows by the nearest neighbor of
+   its last cluster until two clusters are reciprocal nearest
+   neighbors, which are merged.  The merges are then sorted by height
+   and numbered as by hclust (merge, height, order).
+
+   energy_hclust  .Call: merge, height and order of the hclust object
+*/
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rmath.h>
+#include "utilities.h"
+
+SEXP energy_hclust(SEXP dst, SEXP size, SEXP alpha);
+
+static void nn_chain(packed_matrix *D, int *ma, int *mb, double *height);
+static void order_steps(const double *height, int m, int *ix, int *tmp);
+
+
+static void nn_chain(packed_matrix *D, int *ma, int *mb, double *height)
+{
+    /*
+       the n-1 merges of clusters ma[s], mb[s] (ma[s] < mb[s]) at
+       height[s] in the order found; the merged cluster replaces ma[s]
+       D is overwritten
+    */
+    int    i, k, a, b, prev, top = 0, s = 0, n = D->n;
+    int    *chain, *next, *last, *size, head = 0;
+    double d, dab, best, na, nb, nk;
+
+    chain = Calloc(n, int);
+    next = Calloc(n + 1, int);   /* the active clusters, in index order */
+    last = Calloc(n + 1, int);
+    size = Calloc(n, int);
+    for (i=0; i<n; i++) {
+        next[i] = i + 1;
+        last[i] = i - 1;
+        size[i] = 1;
+    }
+
+    while (s < n - 1) {
+        if (top == 0)
+            chain[top++] = head;
+        a = chain[top - 1];
+        /* nearest neighbor of a, preferring the previous element */
+        prev = (top > 1) ? chain[top - 2] : -1;
+        b = prev;
+        best = (prev >= 0) ? PACKED_ELT(D, a, prev) : R_PosInf;
+        for (k=head; k<n; k=next[k]) {
+            if (k == a) continue;
+            d = PACKED_ELT(D, a, k);
+            if (d < best) {
+                best = d;
+                b = k;
+            }
+        }
+        if (b != prev) {
+            chain[top++] = b;
+            continue;
+        }
+
+        /* a and b are reciprocal nearest neighbors: merge b into a */
+        top -= 2;
+        if (b < a) {
+            k = a;
+            a = b;
+            b = k;
+        }
+        dab = best;
+        ma[s] = a;
+        mb[s] = b;
+        height[s] = dab;
+        s++;
+        na = (double) size[a];
+        nb = (double) size[b];
+        for (k=head; k<n; k=next[k]) {
+            if (k == a || k == b) continue;
+            nk = (double) size[k];
+            d = (na + nk) * PACKED_ELT(D, k, a) + (nb + nk) * PACKED_ELT(D, k, b)
+                - nk * dab;
+            d /= (na + nb + nk);
+            if (k > a)
+                D->x[PACKED_OFFSET(k) + a] = d;
+            else
+                D->x[PACKED_OFFSET(a) + k] = d;
+        }
+        size[a] += size[b];
+        /* remove b from the active clusters (b > a >= head) */
+        next[last[b]] = next[b];
+        last[next[b]] = last[b];
+    }
+
+    Free(chain);
+    Free(next);
+    Free(last);
+    Free(size);
+}
+
+static void order_steps(const double *height, int m, int *ix, int *tmp)
+{
+    /*
+       ix = order(height) for ix on entry 0:(m-1), stable merge sort,
+       so that merges of equal height keep the order found
+    */
+    int    w, i, j, k, lo, mid, hi;
+    for (w=1; w<m; w*=2) {
+        for (lo=0; lo<m-w; lo+=2*w) {
+            mid = lo + w;
+            hi = (lo + 2*w < m) ? lo + 2*w : m;
+            i = lo;
+            j = mid;
+            k = lo;
+            while (i < mid && j < hi)
+                tmp[k++] = (height[ix[j]] < height[ix[i]]) ? ix[j++] : ix[i++];
+            while (i < mid)
+                tmp[k++] = ix[i++];
+            while (j < hi)
+                tmp[k++] = ix[j++];
+            for (k=lo; k<hi; k++)
+                ix[k] = tmp[k];
+        }
+    }
+}
+
+
+SEXP energy_hclust(SEXP dst, SEXP size, SEXP alpha)
+{
+    /*
+       dst    dist object (lower triangle by columns) of n observations
+       alpha  exponent on distance
+       returns list(merge, height, order) as hclust(method = "ward.D")
+       on dst^alpha
+    */
+    int    i, j, s, t, l, r, n = asInteger(size), m = n - 1, top;
+    int    *ma, *mb, *ix, *tmp, *node, *M, *O, *stack;
+    double a = asReal(alpha), *px = REAL(dst), *h, *H, *Di;
+    packed_matrix *D;
+    SEXP   merge, height, order, ans, nms;
+
+    D = alloc_packed(n);
+    for (i=0; i<n; i++) {
+        Di = D->x + PACKED_OFFSET(i);
+        for (j=0; j<i; j++)
+            Di[j] = px[(size_t) n*j - (size_t) j*(j+1)/2 + i - j - 1];
+        Di[i] = 0.0;
+    }
+    if (a != 1.0)
+        packed_index_distance(D, a);
+
+    ma = Calloc(m, int);
+    mb = Calloc(m, int);
+    h = Calloc(m, double);
+    nn_chain(D, ma, mb, h);
+    free_packed(D);
+
+    ix = Calloc(m, int);
+    tmp = Calloc(n, int);
+    for (s=0; s<m; s++)
+        ix[s] = s;
+    order_steps(h, m, ix, tmp);
+
+    PROTECT(merge = allocMatrix(INTSXP, m, 2));
+    PROTECT(height = allocVector(REALSXP, m));
+    PROTECT(order = allocVector(INTSXP, n));
+    M = INTEGER(merge);
+    H = REAL(height);
+    O = INTEGER(order);
+
+    /*
+       hclust numbering: observation i is -i, the cluster of step s is
+       s (1-based); a singleton is listed first, two singletons or two
+       clusters in increasing order
+    */
+    node = tmp;
+    for (i=0; i<n; i++)
+        node[i] = -(i + 1);
+    for (s=0; s<m; s++) {
+        t = ix[s];
+        l = node[ma[t]];
+        r = node[mb[t]];
+        if ((l < 0 && r < 0 && l < r) || (l > 0 && r < 0) ||
+            (l > 0 && r > 0 && l > r)) {
+            i = l;
+            l = r;
+            r = i;
+        }
+        M[s] = l;
+        M[s + m] = r;
+        H[s] = h[t];
+        node[ma[t]] = s + 1;
+    }
+
+    /* order: the leaves from left to right, depth first */
+    stack = tmp;
+    top = 0;
+    j = 0;
+    stack[top++] = m;
+    while (top > 0) {
+        s = stack[--top];
+        if (s < 0) {
+            O[j++] = -s;
+        } else {
+            stack[top++] = M[s - 1 + m];
+            stack[top++] = M[s - 1];
+        }
+    }
+
+    Free(ma);
+    Free(mb);
+    Free(h);
+    Free(ix);
+    Free(tmp);
+
+    PROTECT(ans = allocVector(VECSXP, 3));
+    PROTECT(nms = allocVector(STRSXP, 3));
+    SET_VECTOR_ELT(ans, 0, merge);
+    SET_VECTOR_ELT(ans, 1, height);
+    SET_VECTOR_ELT(ans, 2, order);
+    SET_STRING_ELT(nms, 0, mkChar("merge"));
+    SET_STRING_ELT(nms, 1, mkChar("height"));
+    SET_STRING_ELT(nms, 2, mkChar("order"));
+    setAttrib(ans, R_NamesSymbol, nms);
+    UNPROTECT(5);
+    return ans;
+}
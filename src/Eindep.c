@@ -6,210 +6,405 @@
    Author:   Maria Rizzo <mrizzo at bgsu.edu>
    Created:  June 15, 2004  (development)
    Last Modified:  April 5, 2008
+   energy 1.7-9: indepEtest replicates computed by perm_replicates
+                 (permutation.c); squared distances in packed lower
+                 triangular storage (utilities.h)
+   energy 1.7-9: C3 and C4 are computed in O(n^2 Q) time instead of
+                 O(n^3) and O(n^4) from the integral representation
+
+                 sqrt(s) = 1/(2 sqrt(pi)) int_0^inf (1 - exp(-ts)) t^(-3/2) dt
+
+                 which separates sqrt(s + u) into products of the Laplace
+                 transforms of the rows of D2x and D2y.  The integral is
+                 evaluated by the trapezoid rule in log(t) on Q nodes
+                 (a few hundred), which converges geometrically.  The
+                 transforms do not change under permutation, so a
+                 replicate of C3 costs O(nQ) and C4 is computed once.
+                 The replicate C3 now pairs rows x_k and y_perm(k); the
+                 previous version used a permutation invariant sum.
+   energy 1.7-9: the replicate Cz reads D2y(perm[i], perm[j]) through
+                 packed_perm_sum (utilities.c), by blocks of rows.
+   energy 1.7-9: the .C routines indepE and indepEtest are replaced by
+                 the .Call entry point energy_indep, which reads the R
+                 matrices in place (no copy or transposition of x, y).
 */
 
 #include <R.h>
+#include <Rinternals.h>
 #include <Rmath.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "permutation.h"
+#include "utilities.h"
+
+/* trapezoid rule in log(t): step and truncation of the tails,
+   relative error about exp(-pi^2 / LAPLACE_H) + exp(-LAPLACE_TAIL/2) */
+#define LAPLACE_H      0.25
+#define LAPLACE_TAIL   76.0
+/* smallest positive s resolved, relative to the largest */
+#define LAPLACE_RANGE  1.0e-30
+/* rows at nodes with t max(D) below this use the series for expm1 */
+#define LAPLACE_SERIES 1.0e-4
+/* exp(-u) is zero in double precision for u above this */
+#define LAPLACE_ZERO   746.0
 
-void   indepE(double *x, double *y, int *byrow, int *dims, double *Istat);
-void   indepEtest(double *x, double *y, int *byrow, int *dims,
-                double *Istat, double *reps, double *pval);
+typedef struct {
+    double dmin, dmax;         /* smallest positive and largest entry */
+    double *m;                 /* 5 by n: per row, the number of positive
+                                  entries and the sums of D, D^2, D^3, D^4 */
+} laplace_moments;
 
-void   squared_distance(double *x, double **D, int n, int d);
+SEXP   energy_indep(SEXP x, SEXP y, SEXP dims);
 
-extern double **alloc_matrix(int r, int c);
-extern int    **alloc_int_matrix(int r, int c);
-extern void   free_matrix(double **matrix, int r, int c);
-extern void   free_int_matrix(int **matrix, int r, int c);
-extern void   permute(int *J, int n);
-extern void   roworder(double *x, int *byrow, int r, int c);
-extern void   Euclidean_distance(double *x, double **D, int n, int d);
+typedef struct {
+    int    n, Q;
+    double *w;                 /* quadrature weights */
+    double *Ex, *Fx, *Fy;      /* Q by n, see laplace_init */
+} indep_laplace;
 
-void indepE(double *x, double *y, int *byrow, int *dims, double *Istat)
+typedef struct {
+    packed_matrix *D2x, *D2y;
+    indep_laplace *L;
+    double C4, v;
+} indep_perm_data;
+
+static void   indep_sums(packed_matrix *D2x, packed_matrix *D2y,
+                         indep_laplace *L, double *Cx, double *Cy,
+                         double *Cz, double *C3, double *C4);
+static double indep_row(int i, const double *row, void *ctx);
+static double indep_replicate(const int *perm, void *data, double *work);
+static void   laplace_init(indep_laplace *L, packed_matrix *D2x,
+                           packed_matrix *D2y);
+static void   laplace_free(indep_laplace *L);
+static void   laplace_rows(packed_matrix *D, laplace_moments *M, double t,
+                           double *E, double *F);
+static void   row_moments(packed_matrix *D, laplace_moments *M);
+static double laplace_S3(indep_laplace *L, const int *perm);
+static double laplace_S4(indep_laplace *L);
+
+SEXP energy_indep(SEXP x, SEXP y, SEXP dims)
 {
     /*
-        E statistic for multiv. indep. of X in R^p and Y in R^q
-        statistic returned is I_n^2 [nI_n^2 has a limit dist under indep]
+        E statistic for multiv. indep. of X in R^p and Y in R^q and, if
+        B > 0, the approx permutation E test
+        statistic is I_n^2 [nI_n^2 has a limit dist under indep]
+        x, y  : the data, R matrices or vectors (column order), read
+                in place
         dims[0] = n (sample size)
         dims[1] = p (dimension of X)
         dims[2] = q (dimension of Y)
-        Istat : the statistic I_n (normalized)
+        dims[3] = B (number of replicates)
+        returns list(stat, reps, pval), stat the statistic I_n^2
      */
-    int    i, j, k, m, n, p, q;
-    double Cx, Cy, Cz, C3, C4, n2, n3, n4, v;
-    double **D2x, **D2y;
-
-    n = dims[0];
-    p = dims[1];
-    q = dims[2];
-
-    if (*byrow == FALSE) {
-        /* avoid this step: use as.double(t(x)) in R */
-        roworder(x, byrow, n, p);
-        *byrow = FALSE;  /* false for y */
-        roworder(y, byrow, n, q);
+    int    n, p, q, B;
+    double Cx, Cy, Cz, C3, C4, v, Istat;
+    packed_matrix *D2x, *D2y;
+    indep_laplace L;
+    indep_perm_data pd;
+    perm_stop stop;
+    SEXP   ans, stat, reps, pval, nms;
+
+    n = INTEGER(dims)[0];
+    p = INTEGER(dims)[1];
+    q = INTEGER(dims)[2];
+    B = INTEGER(dims)[3];
+    if (B < 0) B = 0;
+    if (!sample_finite(REAL(x), XLENGTH(x)) ||
+        !sample_finite(REAL(y), XLENGTH(y)))
+        error("Data contains missing or infinite values");
+
+    PROTECT(reps = allocVector(REALSXP, B));
+    PROTECT(pval = ScalarReal(1.0));
+    D2x = alloc_packed(n);
+    D2y = alloc_packed(n);
+    packed_sample_distance(REAL(x), p, 0, 2.0, D2x);
+    packed_sample_distance(REAL(y), q, 0, 2.0, D2y);
+
+    indep_sums(D2x, D2y, &L, &Cx, &Cy, &Cz, &C3, &C4);
+    v = Cx + Cy - C4;
+    Istat = (2.0 * C3 - Cz - C4) / v;
+
+    /* compute the replicates */
+    if (B > 0) {
+        pd.D2x = D2x;
+        pd.D2y = D2y;
+        pd.L = &L;
+        pd.C4 = C4;
+        pd.v = v;
+        stop.observed = Istat;
+        stop.strict = FALSE;
+        stop.plus1 = FALSE;
+        perm_replicates_stop(n, B, indep_replicate, &pd,
+                             (int) packed_perm_worksize(n), REAL(reps),
+                             &stop);
+        /* M / B as before, h / L if stopped early by the h rule */
+        REAL(pval)[0] = perm_pvalue(&stop, B);
     }
 
-    D2x = alloc_matrix(n, n);
-    D2y = alloc_matrix(n, n);
-    Euclidean_distance(x, D2x, n, p);
-    Euclidean_distance(y, D2y, n, q);
+    laplace_free(&L);
+    free_packed(D2x);
+    free_packed(D2y);
 
-    Cx = Cy = Cz = C3 = C4 = 0.0;
-    n2 = ((double) n) * n;
-    n3 = n2 * n;
-    n4 = n2 * n2;
+    PROTECT(stat = ScalarReal(Istat));
+    PROTECT(ans = allocVector(VECSXP, 3));
+    PROTECT(nms = allocVector(STRSXP, 3));
+    SET_VECTOR_ELT(ans, 0, stat);
+    SET_VECTOR_ELT(ans, 1, reps);
+    SET_VECTOR_ELT(ans, 2, pval);
+    SET_STRING_ELT(nms, 0, mkChar("stat"));
+    SET_STRING_ELT(nms, 1, mkChar("reps"));
+    SET_STRING_ELT(nms, 2, mkChar("pval"));
+    setAttrib(ans, R_NamesSymbol, nms);
+    UNPROTECT(5);
+    return ans;
+}
+
+
+static void indep_sums(packed_matrix *D2x, packed_matrix *D2y,
+                       indep_laplace *L, double *Cx, double *Cy,
+                       double *Cz, double *C3, double *C4)
+{
+    /*
+        the means Cx, Cy, Cz, C3, C4 of the I_n statistic
+        from packed squared distance matrices D2x, D2y
+        Cx, Cy, Cz are exact; C3 and C4 are computed from the Laplace
+        transforms L (allocated here, free with laplace_free)
+    */
+    int    i, j, n = D2x->n;
+    double *Dxi, *Dyi, sx, sy, sz, n2;
 
-    /* compute observed test statistic */
-    for (i=0; i<n; i++) {
+    n2 = ((double) n) * n;
+    sx = sy = sz = 0.0;
+    for (i=1; i<n; i++) {
+        Dxi = D2x->x + PACKED_OFFSET(i);
+        Dyi = D2y->x + PACKED_OFFSET(i);
         for (j=0; j<i; j++) {
-            Cx += (D2x[i][j]);
-            Cy += (D2y[i][j]);
-            Cz += sqrt(D2x[i][j]*D2x[i][j] + D2y[i][j]*D2y[i][j]);
+            sx += sqrt(Dxi[j]);
+            sy += sqrt(Dyi[j]);
+            sz += sqrt(Dxi[j] + Dyi[j]);
         }
     }
-    Cx = 2.0 * Cx / n2;
-    Cy = 2.0 * Cy / n2;
-    Cz = 2.0 * Cz / n2;
+    *Cx = 2.0 * sx / n2;
+    *Cy = 2.0 * sy / n2;
+    *Cz = 2.0 * sz / n2;
 
-    for (i=0; i<n; i++) {
-        for (j=0; j<n; j++) {
-            for (k=0; k<n; k++) {
-                C3 += sqrt(D2x[k][i]*D2x[k][i] + D2y[k][j]*D2y[k][j]);
-                for (m=0; m<n; m++)
-                    C4 += sqrt(D2x[i][k]*D2x[i][k] + D2y[j][m]*D2y[j][m]);
-            }
-        }
-    }
-    C3 /= n3;
-    C4 /= n4;
-    v = Cx + Cy - C4;
-    *Istat = (2.0 * C3 - Cz - C4) / v;
-    free_matrix(D2x, n, n);
-    free_matrix(D2y, n, n);
-    return;
+    laplace_init(L, D2x, D2y);
+    *C3 = laplace_S3(L, NULL) / (n2 * n);
+    *C4 = laplace_S4(L) / (n2 * n2);
 }
 
 
-void indepEtest(double *x, double *y, int *byrow, int *dims,
-                double *Istat, double *reps, double *pval) {
+static void laplace_init(indep_laplace *L, packed_matrix *D2x,
+                         packed_matrix *D2y)
+{
     /*
-        approx permutation E test for multiv. indep. of X in R^p and Y in R^q
-        statistic is I_n^2, where nI_n^2 -> Q
-        dims[0] = n (sample size)
-        dims[1] = p (dimension of X)
-        dims[2] = q (dimension of Y)
-        dims[3] = B (number of replicates, dimension of reps)
-        Istat : the statistic I_n (normalized)
-     */
-    int    b, i, j, k, m, n, p, q, B, M;
-    int    *perm;
-    double Cx, Cy, Cz, C3, C4, n2, n3, n4, v;
-    double **D2x, **D2y;
-
-    n = dims[0];
-    p = dims[1];
-    q = dims[2];
-    B = dims[3];
-
-    if (*byrow == FALSE) {
-        /* avoid this step: use as.double(t(x)) in R */
-        roworder(x, byrow, n, p);
-        *byrow = FALSE;  /* false for y */
-        roworder(y, byrow, n, q);
+        quadrature nodes t_q = exp(s_q), weights w_q, and for row k
+        of the squared distance matrices, at each node:
+            Ex[q*n + k] = sum_i exp(-t_q D2x(k, i))
+            Fx[q*n + k] = sum_i (1 - exp(-t_q D2x(k, i))) = n - Ex
+        (both are kept: Fx is accurate when t_q is small), and Fy
+        for D2y (the sums only need Ex, Fx and Fy)
+        The range of the nodes is set by the smallest positive and
+        the largest sum of entries D2x(k, i) + D2y(l, j).
+    */
+    int    q, Q, n = D2x->n;
+    double smin, smax, slo, shi, h;
+    double *t;
+    laplace_moments Mx, My;
+
+    row_moments(D2x, &Mx);
+    row_moments(D2y, &My);
+    smax = Mx.dmax + My.dmax;
+    smin = (Mx.dmin < My.dmin) ? Mx.dmin : My.dmin;
+    L->n = n;
+    L->Q = 0;
+    L->w = L->Ex = L->Fx = L->Fy = NULL;
+    if (smax <= 0.0) {
+        /* all distances are zero */
+        Free(Mx.m);
+        Free(My.m);
+        return;
     }
+    if (smin < LAPLACE_RANGE * smax)
+        smin = LAPLACE_RANGE * smax;
 
-    D2x = alloc_matrix(n, n);
-    D2y = alloc_matrix(n, n);
-    squared_distance(x, D2x, n, p);
-    squared_distance(y, D2y, n, q);
+    /* the integrand in s = log(t) decays like exp(s/2) sqrt(smax)
+       on the left and like exp(-s/2) on the right */
+    slo = -log(smax) - LAPLACE_TAIL;
+    shi = -log(smin) + LAPLACE_TAIL;
+    h = LAPLACE_H;
+    Q = (int) ceil((shi - slo) / h) + 1;
+    L->Q = Q;
+    L->w = Calloc(Q, double);
+    t = Calloc(Q, double);
+    for (q=0; q<Q; q++) {
+        t[q] = exp(slo + q * h);
+        L->w[q] = h / (2.0 * sqrt(M_PI) * sqrt(t[q]));
+    }
+    L->Ex = Calloc((size_t) Q * n, double);
+    L->Fx = Calloc((size_t) Q * n, double);
+    L->Fy = Calloc((size_t) Q * n, double);
 
-    Cx = Cy = Cz = C3 = C4 = 0.0;
-    n2 = ((double) n) * n;
-    n3 = n2 * n;
-    n4 = n2 * n2;
+    /* each node is independent: rows of Ex, Fx, Fy per thread */
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) num_threads(num_threads())
+#endif
+    for (q=0; q<Q; q++) {
+        laplace_rows(D2x, &Mx, t[q], L->Ex + (size_t) q*n,
+                     L->Fx + (size_t) q*n);
+        laplace_rows(D2y, &My, t[q], NULL, L->Fy + (size_t) q*n);
+    }
+    Free(t);
+    Free(Mx.m);
+    Free(My.m);
+}
 
-    /* compute observed test statistic */
-    for (i=0; i<n; i++) {
+static void row_moments(packed_matrix *D, laplace_moments *M)
+{
+    /* per row: number of positive entries, sums of D^p, p = 1, ..., 4 */
+    int    i, j, p, n = D->n;
+    double d, dp, *Di, *m;
+
+    M->dmin = DBL_MAX;
+    M->dmax = 0.0;
+    m = M->m = Calloc((size_t) 5 * n, double);
+    for (i=1; i<n; i++) {
+        Di = D->x + PACKED_OFFSET(i);
         for (j=0; j<i; j++) {
-            Cx += sqrt(D2x[i][j]);
-            Cy += sqrt(D2y[i][j]);
-            Cz += sqrt(D2x[i][j] + D2y[i][j]);
+            d = Di[j];
+            if (d <= 0.0) continue;
+            if (d < M->dmin) M->dmin = d;
+            if (d > M->dmax) M->dmax = d;
+            dp = 1.0;
+            for (p=0; p<5; p++) {
+                m[(size_t) p*n + i] += dp;
+                m[(size_t) p*n + j] += dp;
+                dp *= d;
+            }
         }
     }
-    Cx = 2.0 * Cx / n2;
-    Cy = 2.0 * Cy / n2;
-    Cz = 2.0 * Cz / n2;
+}
+
+static void laplace_rows(packed_matrix *D, laplace_moments *M, double t,
+                         double *E, double *F)
+{
+    /*
+        E[k] = sum_i exp(-t D(k,i)), F[k] = sum_i (1 - exp(-t D(k,i)))
+        at nodes in the tails F follows from the row moments M
+        E NULL: F only
+    */
+    int    i, j, n = D->n;
+    double e, *Di, *m = M->m;
 
-    for (i=0; i<n; i++) {
-        for (j=0; j<n; j++) {
-            for (k=0; k<n; k++) {
-                C3 += sqrt(D2x[k][i] + D2y[k][j]);
-                for (m=0; m<n; m++)
-                    C4 += sqrt(D2x[i][k] + D2y[j][m]);
+    if (t * M->dmax < LAPLACE_SERIES) {
+        /* 1 - exp(-u) = u - u^2/2 + u^3/6 - u^4/24 + O(u^5) */
+        for (i=0; i<n; i++)
+            F[i] = t * (m[n + i] - t * (m[2*n + i] / 2.0 -
+                   t * (m[3*n + i] / 6.0 - t * m[4*n + i] / 24.0)));
+    }
+    else if (t * M->dmin > LAPLACE_ZERO) {
+        /* exp(-t D(k,i)) = 0 for the positive entries */
+        for (i=0; i<n; i++)
+            F[i] = m[i];
+    }
+    else {
+        for (i=0; i<n; i++)
+            F[i] = 0.0;
+        for (i=1; i<n; i++) {
+            Di = D->x + PACKED_OFFSET(i);
+            for (j=0; j<i; j++) {
+                e = -expm1(-t * Di[j]);
+                F[i] += e;
+                F[j] += e;
             }
         }
     }
-    C3 /= n3;
-    C4 /= n4;
+    if (E != NULL)
+        for (i=0; i<n; i++)
+            E[i] = n - F[i];
+}
 
-    v = Cx + Cy - C4;
-    *Istat = (2.0 * C3 - Cz - C4) / v;
+static double laplace_S3(indep_laplace *L, const int *perm)
+{
+    /*
+        sum_k sum_i sum_j sqrt(D2x(k,i) + D2y(perm(k),j))
+        perm NULL for the identity
+        for rows with transforms Ex, Fx and Ey = n - Fy, Fy:
+            n^2 - Ex Ey = n Fx + Ex Fy  (no cancellation)
+    */
+    int    k, q, n = L->n, K;
+    double s3 = 0.0, sq, *Ex, *Fx, *Fy;
 
-    M = 0;
-    /* compute the replicates */
-    if (B > 0) {
-        GetRNGstate();
-        perm = Calloc(n, int);
-        for (i=0; i<n; i++)
-            perm[i] = i;
-        for (b = 0; b < B; b++) {
-            permute(perm, n);
-            Cz = 0.0;
-            C3 = 0.0;
-            for (i=0; i<n; i++)
-                for (j=0; j<n; j++) {
-                    Cz += sqrt(D2x[i][j] + D2y[perm[i]][perm[j]]);
-                    for (k=0; k<n; k++) {
-                        C3 += sqrt(D2x[k][perm[i]] + D2y[k][perm[j]]);
-                    }
-                }
-            Cz /= n2;
-            C3 /= n3;
-            reps[b] = (2.0 * C3 - Cz - C4) / v;
-            if (reps[b] >= (*Istat)) M++;
+    for (q=0; q<L->Q; q++) {
+        Ex = L->Ex + (size_t) q*n;
+        Fx = L->Fx + (size_t) q*n;
+        Fy = L->Fy + (size_t) q*n;
+        sq = 0.0;
+        for (k=0; k<n; k++) {
+            K = (perm == NULL) ? k : perm[k];
+            sq += n * Fx[k] + Ex[k] * Fy[K];
         }
-        *pval = (double) M / (double) B;
-        PutRNGstate();
-        Free(perm);
+        s3 += L->w[q] * sq;
     }
+    return s3;
+}
 
-    free_matrix(D2x, n, n);
-    free_matrix(D2y, n, n);
-    return;
+static double laplace_S4(indep_laplace *L)
+{
+    /* sum over all entries a of D2x and b of D2y of sqrt(a + b) */
+    int    k, q, n = L->n;
+    double s4 = 0.0, ex, fx, fy, n2 = ((double) n) * n;
+
+    for (q=0; q<L->Q; q++) {
+        ex = fx = fy = 0.0;
+        for (k=0; k<n; k++) {
+            ex += L->Ex[(size_t) q*n + k];
+            fx += L->Fx[(size_t) q*n + k];
+            fy += L->Fy[(size_t) q*n + k];
+        }
+        s4 += L->w[q] * (n2 * fx + ex * fy);
+    }
+    return s4;
+}
+
+static void laplace_free(indep_laplace *L)
+{
+    if (L->Q > 0) {
+        Free(L->w);
+        Free(L->Ex);
+        Free(L->Fx);
+        Free(L->Fy);
+    }
+    L->Q = 0;
 }
 
 
-void squared_distance(double *x, double **D2, int n, int d)
+static double indep_row(int i, const double *row, void *ctx)
+{
+    /* row i of the sum of |(x_i, y_perm(i)) - (x_j, y_perm(j))|, j < i */
+    packed_matrix *D2x = (packed_matrix *) ctx;
+    double s = 0.0, *Dxi = D2x->x + PACKED_OFFSET(i);
+    int    j;
+
+    for (j=0; j<i; j++)
+        s += sqrt(Dxi[j] + row[j]);
+    return s;
+}
+
+static double indep_replicate(const int *perm, void *data, double *work)
 {
     /*
-        interpret x as an n by d matrix, in row order (n vectors in R^d)
-        compute the squared distance matrix D2
+       I_n^2 statistic of the permutation replicate (x, y[perm])
+       work: packed_perm_worksize(n)
     */
-    int i, j, k, p, q;
-    double dsum, dif;
-    for (i=1; i<n; i++) {
-        D2[i][i] = 0.0;
-        p = i*d;
-        for (j=0; j<i; j++) {
-            dsum = 0.0;
-            q = j*d;
-            for (k=0; k<d; k++) {
-                dif = *(x+p+k) - *(x+q+k);
-                dsum += dif*dif;
-            }
-            D2[i][j] = D2[j][i] = dsum;
-        }
-    }
-}
+    indep_perm_data *pd = (indep_perm_data *) data;
+    double Cz, C3, n2;
+    int    n = pd->D2x->n;
 
+    n2 = ((double) n) * n;
+    Cz = packed_perm_sum(pd->D2y, perm, indep_row, pd->D2x, work);
+    Cz = 2.0 * Cz / n2;
+    C3 = laplace_S3(pd->L, perm) / (n2 * n);
+    return (2.0 * C3 - Cz - pd->C4) / pd->v;
+}
@@ -1,26 +1,20 @@
-#include <Rcpp.h>
-using namespace Rcpp;
-
-// [[Rcpp::export]]
-NumericMatrix calc_dist(NumericMatrix x) {
-  int n = x.nrow(), d = x.ncol(), i, j, k;
-  double dsum, dk;
-  NumericMatrix Dx(n, n);
-  for (i = 0; i < n; i++) {
-    for (j = i; j < n; j++) {
-      if (i == j) {
-        Dx(i, i) = 0.0;
-      } else {
-        dsum = 0.0;
-        for (k = 0; k < d; k++) {
-          dk = x(i,k) - x(j,k);
-          dsum += dk * dk;
-        }
-        Dx(i, j) = sqrt(dsum);
-        Dx(j, i) = sqrt(dsum);
-      }
-    }
-  }
-  return Dx;
-}
-
+#include <Rcpp.h>
+using namespace Rcpp;
+
+#include <vector>
+#include "distance.h"
+
+// [[Rcpp::export]]
+NumericMatrix calc_dist(NumericMatrix x) {
+  // Euclidean distance matrix of the rows of x (blocked kernel in distance.c)
+  int n = x.nrow(), d = x.ncol(), i, k;
+  std::vector<double> xt((size_t) n * d);
+  NumericMatrix Dx(n, n);
+  // the kernel expects the data in row order
+  for (k = 0; k < d; k++)
+    for (i = 0; i < n; i++)
+      xt[(size_t) i * d + k] = x(i, k);
+  dist_square(xt.data(), n, d, Dx.begin());
+  return Dx;
+}
+
@@ -17,6 +17,18 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// gamma1_direct
+NumericVector gamma1_direct(IntegerVector y, NumericVector z);
+RcppExport SEXP _energy_gamma1_direct(SEXP ySEXP, SEXP zSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< IntegerVector >::type y(ySEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type z(zSEXP);
+    rcpp_result_gen = Rcpp::wrap(gamma1_direct(y, z));
+    return rcpp_result_gen;
+END_RCPP
+}
 // calc_dist
 NumericMatrix calc_dist(NumericMatrix x);
 RcppExport SEXP _energy_calc_dist(SEXP xSEXP) {
@@ -62,6 +74,72 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// dcor_matrix
+NumericMatrix dcor_matrix(NumericMatrix x, bool unbiased, double mem_mb);
+RcppExport SEXP _energy_dcor_matrix(SEXP xSEXP, SEXP unbiasedSEXP, SEXP mem_mbSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericMatrix >::type x(xSEXP);
+    Rcpp::traits::input_parameter< bool >::type unbiased(unbiasedSEXP);
+    Rcpp::traits::input_parameter< double >::type mem_mb(mem_mbSEXP);
+    rcpp_result_gen = Rcpp::wrap(dcor_matrix(x, unbiased, mem_mb));
+    return rcpp_result_gen;
+END_RCPP
+}
+// dcor_screen2d
+NumericVector dcor_screen2d(NumericMatrix x, NumericVector y, bool unbiased);
+RcppExport SEXP _energy_dcor_screen2d(SEXP xSEXP, SEXP ySEXP, SEXP unbiasedSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericMatrix >::type x(xSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type y(ySEXP);
+    Rcpp::traits::input_parameter< bool >::type unbiased(unbiasedSEXP);
+    rcpp_result_gen = Rcpp::wrap(dcor_screen2d(x, y, unbiased));
+    return rcpp_result_gen;
+END_RCPP
+}
+// dcor_screen
+NumericVector dcor_screen(NumericMatrix x, SEXP h, bool unbiased);
+RcppExport SEXP _energy_dcor_screen(SEXP xSEXP, SEXP hSEXP, SEXP unbiasedSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericMatrix >::type x(xSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type h(hSEXP);
+    Rcpp::traits::input_parameter< bool >::type unbiased(unbiasedSEXP);
+    rcpp_result_gen = Rcpp::wrap(dcor_screen(x, h, unbiased));
+    return rcpp_result_gen;
+END_RCPP
+}
+// dcov2d_sums
+List dcov2d_sums(NumericVector x, NumericVector y, bool all_sums);
+RcppExport SEXP _energy_dcov2d_sums(SEXP xSEXP, SEXP ySEXP, SEXP all_sumsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type x(xSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type y(ySEXP);
+    Rcpp::traits::input_parameter< bool >::type all_sums(all_sumsSEXP);
+    rcpp_result_gen = Rcpp::wrap(dcov2d_sums(x, y, all_sums));
+    return rcpp_result_gen;
+END_RCPP
+}
+// dcov2d_test
+List dcov2d_test(NumericVector x, NumericVector y, int R, bool unbiased);
+RcppExport SEXP _energy_dcov2d_test(SEXP xSEXP, SEXP ySEXP, SEXP RSEXP, SEXP unbiasedSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type x(xSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type y(ySEXP);
+    Rcpp::traits::input_parameter< int >::type R(RSEXP);
+    Rcpp::traits::input_parameter< bool >::type unbiased(unbiasedSEXP);
+    rcpp_result_gen = Rcpp::wrap(dcov2d_test(x, y, R, unbiased));
+    return rcpp_result_gen;
+END_RCPP
+}
 // dcovU_stats
 NumericVector dcovU_stats(NumericMatrix Dx, NumericMatrix Dy);
 RcppExport SEXP _energy_dcovU_stats(SEXP DxSEXP, SEXP DySEXP) {
@@ -75,17 +153,34 @@ BEGIN_RCPP
 END_RCPP
 }
 // kgroups_start
-List kgroups_start(NumericMatrix x, int k, IntegerVector clus, int iter_max, bool distance);
-RcppExport SEXP _energy_kgroups_start(SEXP xSEXP, SEXP kSEXP, SEXP clusSEXP, SEXP iter_maxSEXP, SEXP distanceSEXP) {
+List kgroups_start(NumericMatrix x, int k, IntegerMatrix clus, int iter_max, bool distance, double cache_mb, int nrepeat);
+RcppExport SEXP _energy_kgroups_start(SEXP xSEXP, SEXP kSEXP, SEXP clusSEXP, SEXP iter_maxSEXP, SEXP distanceSEXP, SEXP cache_mbSEXP, SEXP nrepeatSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< NumericMatrix >::type x(xSEXP);
     Rcpp::traits::input_parameter< int >::type k(kSEXP);
-    Rcpp::traits::input_parameter< IntegerVector >::type clus(clusSEXP);
+    Rcpp::traits::input_parameter< IntegerMatrix >::type clus(clusSEXP);
     Rcpp::traits::input_parameter< int >::type iter_max(iter_maxSEXP);
     Rcpp::traits::input_parameter< bool >::type distance(distanceSEXP);
-    rcpp_result_gen = Rcpp::wrap(kgroups_start(x, k, clus, iter_max, distance));
+    Rcpp::traits::input_parameter< double >::type cache_mb(cache_mbSEXP);
+    Rcpp::traits::input_parameter< int >::type nrepeat(nrepeatSEXP);
+    rcpp_result_gen = Rcpp::wrap(kgroups_start(x, k, clus, iter_max, distance, cache_mb, nrepeat));
+    return rcpp_result_gen;
+END_RCPP
+}
+// kgroups_handle
+List kgroups_handle(SEXP h, int k, IntegerMatrix clus, int iter_max, int nrepeat);
+RcppExport SEXP _energy_kgroups_handle(SEXP hSEXP, SEXP kSEXP, SEXP clusSEXP, SEXP iter_maxSEXP, SEXP nrepeatSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type h(hSEXP);
+    Rcpp::traits::input_parameter< int >::type k(kSEXP);
+    Rcpp::traits::input_parameter< IntegerMatrix >::type clus(clusSEXP);
+    Rcpp::traits::input_parameter< int >::type iter_max(iter_maxSEXP);
+    Rcpp::traits::input_parameter< int >::type nrepeat(nrepeatSEXP);
+    rcpp_result_gen = Rcpp::wrap(kgroups_handle(h, k, clus, iter_max, nrepeat));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -115,6 +210,20 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// pdcov_test
+List pdcov_test(NumericMatrix Dx, NumericMatrix Dy, NumericMatrix Dz, int R);
+RcppExport SEXP _energy_pdcov_test(SEXP DxSEXP, SEXP DySEXP, SEXP DzSEXP, SEXP RSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericMatrix >::type Dx(DxSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type Dy(DySEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type Dz(DzSEXP);
+    Rcpp::traits::input_parameter< int >::type R(RSEXP);
+    rcpp_result_gen = Rcpp::wrap(pdcov_test(Dx, Dy, Dz, R));
+    return rcpp_result_gen;
+END_RCPP
+}
 // poisMstat
 NumericVector poisMstat(IntegerVector x);
 RcppExport SEXP _energy_poisMstat(SEXP xSEXP) {
@@ -138,3 +247,42 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// dcov_projections
+NumericMatrix dcov_projections(NumericMatrix x, NumericMatrix y, NumericMatrix u, NumericMatrix v);
+RcppExport SEXP _energy_dcov_projections(SEXP xSEXP, SEXP ySEXP, SEXP uSEXP, SEXP vSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericMatrix >::type x(xSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type y(ySEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type u(uSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type v(vSEXP);
+    rcpp_result_gen = Rcpp::wrap(dcov_projections(x, y, u, v));
+    return rcpp_result_gen;
+END_RCPP
+}
+// edist_projections
+NumericMatrix edist_projections(NumericMatrix x, IntegerVector sizes, NumericMatrix u);
+RcppExport SEXP _energy_edist_projections(SEXP xSEXP, SEXP sizesSEXP, SEXP uSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericMatrix >::type x(xSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type sizes(sizesSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type u(uSEXP);
+    rcpp_result_gen = Rcpp::wrap(edist_projections(x, sizes, u));
+    return rcpp_result_gen;
+END_RCPP
+}
+// poisson_stats
+NumericMatrix poisson_stats(IntegerVector x, int R);
+RcppExport SEXP _energy_poisson_stats(SEXP xSEXP, SEXP RSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< IntegerVector >::type x(xSEXP);
+    Rcpp::traits::input_parameter< int >::type R(RSEXP);
+    rcpp_result_gen = Rcpp::wrap(poisson_stats(x, R));
+    return rcpp_result_gen;
+END_RCPP
+}
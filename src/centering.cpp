@@ -2,14 +2,30 @@
 //
 // Maria L. Rizzo <mrizzo@bgsu.edu>
 // August, 2016
+//
+// energy 1.7-9: U_center_means, U_center_inplace and U_gram work on
+// the column-major n by n matrices without allocating:
+//   U_center_inplace  U-centering in place, for callers that own D
+//   U_gram            the U_products of the U-centered matrices of
+//                     several distance matrices, with the centered
+//                     entries computed on the fly from the row means,
+//                     in one pass over the pairs i < j
+// so dcovU_stats, partial_dcor, partial_dcov and projection no longer
+// allocate and re-read the U-centered matrices.
 
 
 
 #include <Rcpp.h>
 using namespace Rcpp;
 
+#include <vector>
+#include "profile.h"
+
 NumericMatrix D_center(NumericMatrix Dx);
 NumericMatrix U_center(NumericMatrix Dx);
+void U_center_means(const double *D, int n, double *m);
+void U_center_inplace(double *D, int n);
+void U_gram(const double * const *D, int p, int n, double *G);
 
 // [[Rcpp::export]]
 NumericMatrix D_center(NumericMatrix Dx) {
@@ -22,7 +38,7 @@ NumericMatrix D_center(NumericMatrix Dx) {
   int n = Dx.nrow();
   NumericVector akbar(n);
   NumericMatrix A(n, n);
-  double abar = 0.0;
+  double abar = 0.0, t0 = prof_start();
 
   for (k=0; k<n; k++) {
     akbar(k) = 0.0;
@@ -40,43 +56,99 @@ NumericMatrix D_center(NumericMatrix Dx) {
       A(j, k) = A(k, j);
     }
 
+  prof_stop(PROF_CENTER, t0);
   return A;
 }
 
-// [[Rcpp::export]]
-NumericMatrix U_center(NumericMatrix Dx) {
+void U_center_means(const double *D, int n, double *m) {
   /*
-  computes the A_{kl}^U distances from the distance matrix (Dx_{kl}) for dCov^U
-  U-centering: if Dx = (a_{ij}) then compute U-centered A^U using
-  a_{ij} - a_{i.}/(n-2) - a_{.j}/(n-2) + a_{..}/((n-1)(n-2)), i \neq j
-  and zero diagonal
+  D is a symmetric n by n matrix (column-major)
+  m[k] = a_{k.}/(n-2), k < n, and m[n] = a_{..}/((n-1)(n-2))
+  the row sums are computed as column sums (contiguous)
   */
   int j, k;
-  int n = Dx.nrow();
-  NumericVector akbar(n);
-  NumericMatrix A(n, n);
-  double abar = 0.0;
+  const double *Dk;
+  double abar = 0.0, s;
 
   for (k=0; k<n; k++) {
-    akbar(k) = 0.0;
-    for (j=0; j<n; j++) {
-      akbar(k) += Dx(k, j);
-    }
-    abar += akbar(k);
-    akbar(k) /= (double) (n-2);
+    Dk = D + (size_t) k * n;
+    s = 0.0;
+    for (j=0; j<n; j++)
+      s += Dk[j];
+    abar += s;
+    m[k] = s / (double) (n-2);
   }
-  abar /= (double) ((n-1)*(n-2));
+  m[n] = abar / (((double) (n-1)) * (n-2));
+}
 
+void U_center_inplace(double *D, int n) {
+  /*
+  U-centering of the symmetric n by n matrix D in place (see U_center)
+  */
+  int j, k;
+  double *Dk, t0 = prof_start();
+  std::vector<double> m(n + 1);
+
+  U_center_means(D, n, m.data());
   for (k=0; k<n; k++) {
-    for (j=k; j<n; j++) {
-      A(k, j) = Dx(k, j) - akbar(k) - akbar(j) + abar;
-      A(j, k) = A(k, j);
+    Dk = D + (size_t) k * n;
+    // same order of operations as for entry (min(j, k), max(j, k))
+    for (j=0; j<k; j++)
+      Dk[j] = Dk[j] - m[j] - m[k] + m[n];
+    Dk[k] = 0.0;
+    for (j=k+1; j<n; j++)
+      Dk[j] = Dk[j] - m[k] - m[j] + m[n];
+  }
+  prof_stop(PROF_CENTER, t0);
+}
+
+void U_gram(const double * const *D, int p, int n, double *G) {
+  /*
+  D[0], ..., D[p-1] are symmetric n by n distance matrices
+  G is p by p: G[a*p + b] = U_product(U_center(D[a]), U_center(D[b]))
+  the U-centered entries are computed from the row means as the
+  pairs i < j are visited, one column at a time; each column sum is
+  accumulated separately before it is added to G
+  */
+  int a, b, i, j;
+  std::vector<double> m((size_t) p * (n + 1)), u(p), gj((size_t) p * p);
+  std::vector<double> S((size_t) p * p, 0.0);
+  const double *mj;
+
+  for (a=0; a<p; a++)
+    U_center_means(D[a], n, &m[(size_t) a * (n + 1)]);
+
+  for (j=1; j<n; j++) {
+    std::fill(gj.begin(), gj.end(), 0.0);
+    for (i=0; i<j; i++) {
+      for (a=0; a<p; a++) {
+        mj = &m[(size_t) a * (n + 1)];
+        u[a] = D[a][(size_t) j * n + i] - mj[i] - mj[j] + mj[n];
+      }
+      for (a=0; a<p; a++)
+        for (b=a; b<p; b++)
+          gj[a*p + b] += u[a] * u[b];
     }
+    for (a=0; a<p; a++)
+      for (b=a; b<p; b++)
+        S[a*p + b] += gj[a*p + b];
   }
-  /* diagonal is zero */
-  for (k=0; k<n; k++)
-    A(k, k) = 0.0;
+  for (a=0; a<p; a++)
+    for (b=a; b<p; b++)
+      G[a*p + b] = G[b*p + a] =
+        2.0 * S[a*p + b] / ((double) n * (n-3));
+}
 
+// [[Rcpp::export]]
+NumericMatrix U_center(NumericMatrix Dx) {
+  /*
+  computes the A_{kl}^U distances from the distance matrix (Dx_{kl}) for dCov^U
+  U-centering: if Dx = (a_{ij}) then compute U-centered A^U using
+  a_{ij} - a_{i.}/(n-2) - a_{.j}/(n-2) + a_{..}/((n-1)(n-2)), i \neq j
+  and zero diagonal
+  */
+  int n = Dx.nrow();
+  NumericMatrix A = clone(Dx);
+  U_center_inplace(A.begin(), n);
   return A;
 }
-
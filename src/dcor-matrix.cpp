@@ -0,0 +1,200 @@
+#include <Rcpp.h>
+using namespace Rcpp;
+
+#include <vector>
+#include <cfloat>
+#include <climits>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include <R_ext/BLAS.h>
+#ifndef FCONE
+#define FCONE
+#endif
+#include "permutation.h"
+#include "utilities.h"
+
+// all pairs distance correlation matrix of the p columns of x
+//
+// Every column is centered once: its row means (double centered, or
+// U-centered if unbiased) are computed from the sorted row sums of the
+// distances (dcov2d.cpp), so that a centered entry
+//   |x_ia - x_ja| - m_ia - m_ja + M_a
+// can be generated on the fly without storing any n by n matrix.
+// The Gram matrix G[a, b] = sum_{i,j} A_ij B_ij / 2 of all p centered
+// matrices is C'C, where C has one row for each pair j <= i and one
+// column for each variable.  C is generated in chunks of ld rows, and
+// the product of each chunk is accumulated in DCORMAT_TILE by
+// DCORMAT_TILE tiles of G by dgemm.  The columns of a chunk and the
+// tiles are computed in parallel (num_threads, see energy.threads);
+// each tile is summed in chunk order, so the result does not depend
+// on the number of threads.
+// The chunk (ld p doubles) is the only workspace; ld is chosen so that
+// it fits in mem_mb megabytes, but no less than n.
+
+#define DCORMAT_TILE 128
+
+NumericMatrix dcor_matrix(NumericMatrix x, bool unbiased, double mem_mb);
+
+struct dcormat_data {
+  int n, p, unbiased;
+  const double *x;   // n by p data
+  const double *m;   // p by (n + 1): the row means and the grand mean
+};
+
+static void centered_chunk(const dcormat_data *dd, int v0, int nv,
+                           int i0, int i1, double *C, int ld);
+
+// dcov2d.cpp
+void sort_rank(const double *x, int n, int *ix, int *r);
+void rowsums_dist1(const double *x, int n, const int *ix, const int *r,
+                   double *rowsums);
+
+
+static void centered_chunk(const dcormat_data *dd, int v0, int nv,
+                           int i0, int i1, double *C, int ld) {
+  // C[v * ld + q] = centered distance of pair q of rows i0 <= i < i1
+  // (pairs (i, 0), ..., (i, i)) for the variables v0, ..., v0 + nv - 1
+  // the diagonal entry is scaled by 1/sqrt(2), so that C'C is half
+  // the sum over all i, j
+  int v, i, j, n = dd->n;
+  size_t q;
+  const double *xv, *mv;
+  double *Cv, xi, mi, M;
+
+  for (v = 0; v < nv; v++) {
+    xv = dd->x + (size_t) (v0 + v) * n;
+    mv = dd->m + (size_t) (v0 + v) * (n + 1);
+    M = mv[n];
+    Cv = C + (size_t) v * ld;
+    q = 0;
+    for (i = i0; i < i1; i++) {
+      xi = xv[i];
+      mi = mv[i];
+      for (j = 0; j < i; j++)
+        Cv[q++] = fabs(xi - xv[j]) - mi - mv[j] + M;
+      Cv[q++] = dd->unbiased ? 0.0 : (M - 2.0 * mi) * M_SQRT1_2;
+    }
+  }
+}
+
+
+// [[Rcpp::export(.dcor_matrix)]]
+NumericMatrix dcor_matrix(NumericMatrix x, bool unbiased, double mem_mb) {
+  // p by p matrix of dCor (V) or bias corrected dCor^2 (U) of the
+  // columns of x; mem_mb bounds the workspace of the chunks
+  int n = x.nrow(), p = x.ncol(), a, b, c;
+  int nthreads = num_threads();
+  int ntiles = (p + DCORMAT_TILE - 1) / DCORMAT_TILE, njobs, nchunks;
+  double N = (double) n, budget, V;
+  size_t ld, npairs = (size_t) n * (n + 1) / 2;
+  std::vector<double> m((size_t) p * (n + 1)), G((size_t) p * p);
+  std::vector<int> jobs, chunks, iwork((size_t) nthreads * 2 * n);
+  std::vector<double> C;
+  NumericMatrix R(p, p);
+  dcormat_data dd;
+
+  budget = mem_mb * 1048576.0 / ((double) p * sizeof(double));
+  ld = ((double) npairs < budget) ? npairs : (size_t) budget;
+  // ld is the leading dimension of C for dgemm (an int)
+  if (ld > (size_t) INT_MAX)
+    ld = INT_MAX;
+  if (ld < (size_t) n)
+    ld = n;
+  // row chunks [chunks[c], chunks[c+1]) of at most ld pairs
+  chunks.push_back(0);
+  for (a = 0, c = 0; a < n; a++) {
+    if (c + a + 1 > (int) ld) {
+      chunks.push_back(a);
+      c = 0;
+    }
+    c += a + 1;
+  }
+  chunks.push_back(n);
+  nchunks = (int) chunks.size() - 1;
+  // the tiles of the upper triangle of G
+  for (b = 0; b < ntiles; b++)
+    for (a = 0; a <= b; a++) {
+      jobs.push_back(a);
+      jobs.push_back(b);
+    }
+  njobs = (int) jobs.size() / 2;
+  C.resize(ld * p);
+
+  dd.n = n;
+  dd.p = p;
+  dd.unbiased = unbiased;
+  dd.x = x.begin();
+  dd.m = m.data();
+
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(nthreads)
+#endif
+  {
+    int t = 0, v, k, job, a0, b0, na, nb, nq, ldi = (int) ld, ldg = p;
+    int *ix, *rx;
+    double *mv, S, beta, one = 1.0;
+#ifdef _OPENMP
+    t = omp_get_thread_num();
+#endif
+    ix = iwork.data() + (size_t) t * 2 * n;
+    rx = ix + n;
+
+    // row means of the distances of each variable
+#ifdef _OPENMP
+    #pragma omp for schedule(static)
+#endif
+    for (v = 0; v < p; v++) {
+      mv = m.data() + (size_t) v * (n + 1);
+      sort_rank(dd.x + (size_t) v * n, n, ix, rx);
+      rowsums_dist1(dd.x + (size_t) v * n, n, ix, rx, mv);
+      S = 0.0;
+      for (k = 0; k < n; k++)
+        S += mv[k];
+      for (k = 0; k < n; k++)
+        mv[k] /= unbiased ? (N - 2.0) : N;
+      mv[n] = unbiased ? S / ((N - 1.0) * (N - 2.0)) : S / (N * N);
+    }
+
+    for (k = 0; k < nchunks; k++) {
+      nq = (int) (PACKED_OFFSET(chunks[k + 1]) - PACKED_OFFSET(chunks[k]));
+#ifdef _OPENMP
+      #pragma omp for schedule(static)
+#endif
+      for (v = 0; v < p; v++)
+        centered_chunk(&dd, v, 1, chunks[k], chunks[k + 1],
+                       C.data() + (size_t) v * ld, ldi);
+      // G[a, b] += C[, a]' C[, b], tile by tile
+      beta = (k == 0) ? 0.0 : 1.0;
+#ifdef _OPENMP
+      #pragma omp for schedule(dynamic)
+#endif
+      for (job = 0; job < njobs; job++) {
+        a0 = jobs[2 * job] * DCORMAT_TILE;
+        b0 = jobs[2 * job + 1] * DCORMAT_TILE;
+        na = (p - a0 < DCORMAT_TILE) ? p - a0 : DCORMAT_TILE;
+        nb = (p - b0 < DCORMAT_TILE) ? p - b0 : DCORMAT_TILE;
+        F77_CALL(dgemm)("T", "N", &na, &nb, &nq, &one,
+                        C.data() + (size_t) a0 * ld, &ldi,
+                        C.data() + (size_t) b0 * ld, &ldi, &beta,
+                        G.data() + (size_t) b0 * p + a0, &ldg FCONE FCONE);
+      }
+    }
+  }
+
+  for (b = 0; b < p; b++)
+    for (a = 0; a <= b; a++)
+      G[(size_t) a * p + b] = G[(size_t) b * p + a];
+  for (b = 0; b < p; b++)
+    for (a = 0; a < p; a++) {
+      V = G[(size_t) a * p + a] * G[(size_t) b * p + b];
+      if (unbiased) {
+        R(a, b) = (V > DBL_EPSILON) ? G[(size_t) b * p + a] / sqrt(V) : 0.0;
+      } else {
+        // dCor = dCov / sqrt(dVar(x) dVar(y)), see DCOR
+        R(a, b) = (V > 0.0 && G[(size_t) b * p + a] > 0.0) ?
+          sqrt(G[(size_t) b * p + a] / sqrt(V)) : 0.0;
+      }
+    }
+  return R;
+}
@@ -0,0 +1,247 @@
+#include <Rcpp.h>
+using namespace Rcpp;
+
+#include <vector>
+#include <cfloat>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "permutation.h"
+#include "utilities.h"
+#include "disthandle.h"
+
+// distance correlation screening: one response y, p univariate predictors
+//
+// Every statistic is computed from the centered distances of y, which
+// are computed once, and the distances of one column of x:
+//   sum_{i,j} A_ij |x_i - x_j| = sum_{i,j} A_ij B_ij
+// for the double centered (V) or U-centered (U) A, because the
+// centered B differs from the distances of x by terms that sum to zero
+// against A.  dVar(x) only needs the row sums of the distances of the
+// univariate column (dcov2d.cpp), in O(n log n).
+//
+// dcor_screen2d: univariate y.  Each column is one O(n log n) pass of
+//   dcov2d_sums, with the sort, ranks and row sums of y computed once.
+// dcor_screen: y is an energy.dist handle (disthandle.c), with the
+//   centered distances cached.  The columns are scored SCREEN_BLOCK at
+//   a time, so that each row of A is read once per block.
+//
+// The columns are scored in parallel (num_threads, see energy.threads)
+// with O(n) workspace per thread.
+
+#define SCREEN_BLOCK 8
+
+NumericVector dcor_screen2d(NumericMatrix x, NumericVector y, bool unbiased);
+NumericVector dcor_screen(NumericMatrix x, SEXP h, bool unbiased);
+
+static double screen_ratio(double dcov, double dvarx, double dvary);
+
+// dcov2d.cpp
+void sort_rank(const double *x, int n, int *ix, int *r);
+void rowsums_dist1(const double *x, int n, const int *ix, const int *r,
+                   double *rowsums);
+double gamma_S1(const double *x1, const double *y1, const int *ry1, int n,
+                double *work);
+
+
+static double screen_ratio(double dcov, double dvarx, double dvary) {
+  // dcor^2 or bias corrected dcor^2 (as dcor2d)
+  double V = dvarx * dvary;
+  if (V > 10.0 * DBL_EPSILON)
+    return dcov / sqrt(V);
+  return 0.0;
+}
+
+
+// [[Rcpp::export(.dcor_screen2d)]]
+NumericVector dcor_screen2d(NumericMatrix x, NumericVector y, bool unbiased) {
+  // dcor^2 (V) or bias corrected dcor^2 (U) of each column of x with
+  // univariate y, by the O(n log n) sums of dcov2d
+  int n = x.nrow(), p = x.ncol(), i;
+  int nthreads = num_threads();
+  double N = (double) n, d1, d2, d3;
+  double sumb = 0.0, s2b = 0.0, my = 0.0, ssy = 0.0, dvary;
+  std::vector<int> iy(n), ry(n);
+  std::vector<double> b(n);
+  // per thread: ix, rx, ry1 (n ints); x1, y1, a (n), gamma_S1 8 (n + 1)
+  size_t wsi = 3 * (size_t) n, wsd = 3 * (size_t) n + 8 * ((size_t) n + 1);
+  std::vector<int> iwork((size_t) nthreads * wsi);
+  std::vector<double> work((size_t) nthreads * wsd);
+  NumericVector stats(p);
+  const double *px = x.begin(), *py = y.begin();
+  double *ps = stats.begin();
+
+  if (unbiased) {
+    d1 = N * (N - 3.0);
+    d2 = d1 * (N - 2.0);
+    d3 = d2 * (N - 1.0);
+  } else {
+    d1 = N * N;
+    d2 = d1 * N;
+    d3 = d2 * N;
+  }
+  sort_rank(py, n, iy.data(), ry.data());
+  rowsums_dist1(py, n, iy.data(), ry.data(), b.data());
+  for (i = 0; i < n; i++) {
+    sumb += b[i];
+    s2b += b[i] * b[i];
+    my += py[i];
+  }
+  my /= N;
+  for (i = 0; i < n; i++)
+    ssy += (py[i] - my) * (py[i] - my);
+  dvary = 2.0 * N * ssy / d1 - 2.0 * s2b / d2 + sumb * sumb / d3;
+
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(nthreads) if (p > 1)
+#endif
+  {
+    int t = 0, j, k;
+    int *ix, *rx, *ry1;
+    double *x1, *y1, *a, *g;
+    double S1, S2, suma, s2a, mx, ssx, dvarx;
+    const double *xj;
+#ifdef _OPENMP
+    t = omp_get_thread_num();
+#endif
+    ix = iwork.data() + (size_t) t * wsi;
+    rx = ix + n;
+    ry1 = rx + n;
+    x1 = work.data() + (size_t) t * wsd;
+    y1 = x1 + n;
+    a = y1 + n;
+    g = a + n;
+#ifdef _OPENMP
+    #pragma omp for schedule(dynamic, 16)
+#endif
+    for (j = 0; j < p; j++) {
+      xj = px + (size_t) j * n;
+      sort_rank(xj, n, ix, rx);
+      rowsums_dist1(xj, n, ix, rx, a);
+      S2 = suma = s2a = mx = 0.0;
+      for (k = 0; k < n; k++) {
+        S2 += a[k] * b[k];
+        suma += a[k];
+        s2a += a[k] * a[k];
+        mx += xj[k];
+        x1[k] = xj[ix[k]];
+        y1[k] = py[ix[k]];
+        ry1[k] = ry[ix[k]];
+      }
+      mx /= N;
+      ssx = 0.0;
+      for (k = 0; k < n; k++)
+        ssx += (xj[k] - mx) * (xj[k] - mx);
+      S1 = gamma_S1(x1, y1, ry1, n, g);
+      dvarx = 2.0 * N * ssx / d1 - 2.0 * s2a / d2 + suma * suma / d3;
+      ps[j] = screen_ratio(S1 / d1 - 2.0 * S2 / d2 + suma * sumb / d3,
+                           dvarx, dvary);
+    }
+  }
+  return stats;
+}
+
+
+// [[Rcpp::export(.dcor_screen)]]
+NumericVector dcor_screen(NumericMatrix x, SEXP h, bool unbiased) {
+  // dcor^2 (V) or bias corrected dcor^2 (U) of each column of x with
+  // the sample of the energy.dist handle h (index 1)
+  dist_handle *H = dist_handle_ptr(h);
+  packed_matrix *A;
+  int n = x.nrow(), p = x.ncol(), i, k;
+  int nthreads = num_threads();
+  int nblocks = (p + SCREEN_BLOCK - 1) / SCREEN_BLOCK;
+  double N = (double) n, d1, d2, d3, saa = 0.0, dvary;
+  const double *Ai;
+  // per thread: ix, rx (n ints); the row sums of the distances of x (n)
+  size_t wsi = 2 * (size_t) n, wsd = (size_t) n;
+  std::vector<int> iwork((size_t) nthreads * wsi);
+  std::vector<double> work((size_t) nthreads * wsd);
+  NumericVector stats(p);
+  const double *px = x.begin();
+  double *ps = stats.begin();
+
+  // checked here: error() in dist_handle_get or dist_handle_ucenter
+  // would longjmp past the destructors of the vectors above
+  if (H == NULL)
+    stop("not a valid energy.dist handle: create it again with energy.dist");
+  if (H->D->n != n)
+    stop("sample sizes must agree");
+  if (unbiased && n < 4)
+    stop("U-centering requires sample size n > 3");
+  // computed (and cached with the handle) before the parallel region
+  if (unbiased) {
+    A = dist_handle_ucenter(H);
+    d1 = N * (N - 3.0);
+    d2 = d1 * (N - 2.0);
+    d3 = d2 * (N - 1.0);
+  } else {
+    A = dist_handle_dcenter(H);
+    d1 = N * N;
+    d2 = d1 * N;
+    d3 = d2 * N;
+  }
+  for (i = 0; i < n; i++) {
+    Ai = A->x + PACKED_OFFSET(i);
+    for (k = 0; k < i; k++)
+      saa += 2.0 * Ai[k] * Ai[k];
+    saa += Ai[i] * Ai[i];
+  }
+  dvary = saa / d1;
+
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(nthreads) if (nblocks > 1)
+#endif
+  {
+    int t = 0, bl, j0, m, c, ii, kk;
+    int *ix, *rx;
+    double *a, xi, s, suma, s2a, mx, ssx, dvarx, sab[SCREEN_BLOCK];
+    const double *xc[SCREEN_BLOCK], *Arow;
+#ifdef _OPENMP
+    t = omp_get_thread_num();
+#endif
+    ix = iwork.data() + (size_t) t * wsi;
+    rx = ix + n;
+    a = work.data() + (size_t) t * wsd;
+#ifdef _OPENMP
+    #pragma omp for schedule(dynamic)
+#endif
+    for (bl = 0; bl < nblocks; bl++) {
+      j0 = bl * SCREEN_BLOCK;
+      m = p - j0;
+      if (m > SCREEN_BLOCK) m = SCREEN_BLOCK;
+      for (c = 0; c < m; c++) {
+        xc[c] = px + (size_t) (j0 + c) * n;
+        sab[c] = 0.0;
+      }
+      // sum_{i > k} A_ik |x_i - x_k| for the m columns of the block
+      for (ii = 1; ii < n; ii++) {
+        Arow = A->x + PACKED_OFFSET(ii);
+        for (c = 0; c < m; c++) {
+          xi = xc[c][ii];
+          s = 0.0;
+          for (kk = 0; kk < ii; kk++)
+            s += Arow[kk] * fabs(xi - xc[c][kk]);
+          sab[c] += s;
+        }
+      }
+      for (c = 0; c < m; c++) {
+        sort_rank(xc[c], n, ix, rx);
+        rowsums_dist1(xc[c], n, ix, rx, a);
+        suma = s2a = mx = 0.0;
+        for (kk = 0; kk < n; kk++) {
+          suma += a[kk];
+          s2a += a[kk] * a[kk];
+          mx += xc[c][kk];
+        }
+        mx /= N;
+        ssx = 0.0;
+        for (kk = 0; kk < n; kk++)
+          ssx += (xc[c][kk] - mx) * (xc[c][kk] - mx);
+        dvarx = 2.0 * N * ssx / d1 - 2.0 * s2a / d2 + suma * suma / d3;
+        ps[j0 + c] = screen_ratio(2.0 * sab[c] / d1, dvarx, dvary);
+      }
+    }
+  }
+  return stats;
+}
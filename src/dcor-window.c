@@ -0,0 +1,345 @@
+/*
+   dcor-window.c: distance covariance and correlation of a sliding
+   window of paired observations (R function dcor.window)
+
+   The window holds the last (at most size) pairs (x_i, y_i), x_i in
+   R^p, y_i in R^q, in ring buffers, with the sums that determine the
+   statistics of the window, a_ij = |x_i - x_j|, b_ij = |y_i - y_j|:
+       the row sums a_i. and b_i.,
+       S_ab = sum_{i,j} a_ij b_ij, S_aa = sum a_ij^2, S_bb = sum b_ij^2,
+       a.. and b..
+   A point that enters or leaves changes these sums by its distances to
+   the points of the window, so a push or a pop is O(n (p + q)) for a
+   window of n points, instead of O(n^2 (p + q)) to recompute the
+   statistics.  The statistics are computed from the sums in O(n):
+       V   = S_ab / n^2 - 2 sum_i a_i. b_i. / n^3 + a.. b.. / n^4
+       U   = [S_ab - 2 sum_i a_i. b_i. / (n-2) + a.. b.. / ((n-1)(n-2))]
+             / (n (n-3))
+   (dCov^2 as dcov and dcovU).  The sums are recomputed from the window
+   after each size pops, so that the rounding error of the updates does
+   not accumulate (amortized O(n (p + q)) per pop).
+
+   energy_window_new    .Call: create a window
+   energy_window_push   .Call: add points, statistics after each
+   energy_window_pop    .Call: remove the oldest points
+   energy_window_stats  .Call: statistics of the window
+*/
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rmath.h>
+
+SEXP energy_window_new(SEXP size, SEXP dims);
+SEXP energy_window_push(SEXP h, SEXP x, SEXP y);
+SEXP energy_window_pop(SEXP h, SEXP k);
+SEXP energy_window_stats(SEXP h);
+
+#define WINDOW_NSTATS 8   /* n, dCov, dCor, dVarX, dVarY, V, U, bcdcor */
+
+typedef struct {
+    int    size, p, q;     /* capacity and dimensions */
+    int    n, first;       /* points in the window, slot of the oldest */
+    int    pops;           /* pops since the sums were recomputed */
+    double *x, *y;         /* size by p and size by q, by slot */
+    double *a, *b;         /* row sums of the distances, by slot */
+    double *da, *db;       /* distances from one point, by slot */
+    double Sab, Saa, Sbb, Sa, Sb;
+} dcor_window;
+
+static dcor_window *window_get(SEXP h);
+static void window_finalize(SEXP h);
+static void window_dist(dcor_window *W, const double *u, const double *v);
+static void window_add(dcor_window *W, const double *u, const double *v);
+static void window_remove(dcor_window *W);
+static void window_refresh(dcor_window *W);
+static void window_compute(dcor_window *W, double *stats);
+
+
+static dcor_window *window_get(SEXP h)
+{
+    dcor_window *W;
+    if (TYPEOF(h) != EXTPTRSXP)
+        error("not a dcor.window");
+    W = (dcor_window *) R_ExternalPtrAddr(h);
+    if (W == NULL)
+        error("dcor.window is not valid (saved and restored?): "
+              "create it again with dcor.window");
+    return W;
+}
+
+static void window_finalize(SEXP h)
+{
+    dcor_window *W = (dcor_window *) R_ExternalPtrAddr(h);
+    if (W != NULL) {
+        Free(W->x);
+        Free(W->y);
+        Free(W->a);
+        Free(W->b);
+        Free(W->da);
+        Free(W->db);
+        Free(W);
+        R_ClearExternalPtr(h);
+    }
+}
+
+static void window_dist(dcor_window *W, const double *u, const double *v)
+{
+    /* da[s], db[s]: distances from (u, v) to the points in the window */
+    int    i, s, k, p = W->p, q = W->q;
+    double t, dif, *xs, *ys;
+
+    for (i=0; i<W->n; i++) {
+        s = (W->first + i) % W->size;
+        xs = W->x + (size_t) s * p;
+        ys = W->y + (size_t) s * q;
+        if (p == 1) {
+            W->da[s] = fabs(xs[0] - u[0]);
+        } else {
+            t = 0.0;
+            for (k=0; k<p; k++) {
+                dif = xs[k] - u[k];
+                t += dif * dif;
+            }
+            W->da[s] = sqrt(t);
+        }
+        if (q == 1) {
+            W->db[s] = fabs(ys[0] - v[0]);
+        } else {
+            t = 0.0;
+            for (k=0; k<q; k++) {
+                dif = ys[k] - v[k];
+                t += dif * dif;
+            }
+            W->db[s] = sqrt(t);
+        }
+    }
+}
+
+static void window_add(dcor_window *W, const double *u, const double *v)
+{
+    /* add (u, v) as the newest point; the window is not full */
+    int    i, s, k, slot = (W->first + W->n) % W->size;
+    double A = 0.0, B = 0.0, ab = 0.0, aa = 0.0, bb = 0.0, al, be;
+
+    window_dist(W, u, v);
+    for (i=0; i<W->n; i++) {
+        s = (W->first + i) % W->size;
+        al = W->da[s];
+        be = W->db[s];
+        W->a[s] += al;
+        W->b[s] += be;
+        A += al;
+        B += be;
+        ab += al * be;
+        aa += al * al;
+        bb += be * be;
+    }
+    W->Sab += 2.0 * ab;
+    W->Saa += 2.0 * aa;
+    W->Sbb += 2.0 * bb;
+    W->Sa += 2.0 * A;
+    W->Sb += 2.0 * B;
+    for (k=0; k<W->p; k++)
+        W->x[(size_t) slot * W->p + k] = u[k];
+    for (k=0; k<W->q; k++)
+        W->y[(size_t) slot * W->q + k] = v[k];
+    W->a[slot] = A;
+    W->b[slot] = B;
+    W->n++;
+}
+
+static void window_remove(dcor_window *W)
+{
+    /* remove the oldest point; the window is not empty */
+    int    i, s, old = W->first;
+    double ab = 0.0, aa = 0.0, bb = 0.0, A = W->a[old], B = W->b[old];
+    double al, be;
+
+    W->first = (old + 1) % W->size;
+    W->n--;
+    window_dist(W, W->x + (size_t) old * W->p, W->y + (size_t) old * W->q);
+    for (i=0; i<W->n; i++) {
+        s = (W->first + i) % W->size;
+        al = W->da[s];
+        be = W->db[s];
+        W->a[s] -= al;
+        W->b[s] -= be;
+        ab += al * be;
+        aa += al * al;
+        bb += be * be;
+    }
+    W->Sab -= 2.0 * ab;
+    W->Saa -= 2.0 * aa;
+    W->Sbb -= 2.0 * bb;
+    W->Sa -= 2.0 * A;
+    W->Sb -= 2.0 * B;
+    if (++W->pops >= W->size)
+        window_refresh(W);
+}
+
+static void window_refresh(dcor_window *W)
+{
+    /* recompute the sums from the points in the window */
+    int    i, j, s, n = W->n;
+    double *x, *y;
+
+    W->pops = 0;
+    x = Calloc((size_t) n * W->p + 1, double);
+    y = Calloc((size_t) n * W->q + 1, double);
+    for (i=0; i<n; i++) {
+        s = (W->first + i) % W->size;
+        for (j=0; j<W->p; j++)
+            x[(size_t) i * W->p + j] = W->x[(size_t) s * W->p + j];
+        for (j=0; j<W->q; j++)
+            y[(size_t) i * W->q + j] = W->y[(size_t) s * W->q + j];
+    }
+    W->n = 0;
+    W->first = 0;
+    W->Sab = W->Saa = W->Sbb = W->Sa = W->Sb = 0.0;
+    for (i=0; i<n; i++)
+        window_add(W, x + (size_t) i * W->p, y + (size_t) i * W->q);
+    Free(x);
+    Free(y);
+}
+
+static void window_compute(dcor_window *W, double *stats)
+{
+    /*
+       stats: n, dCov, dCor, dVarX, dVarY (V statistics, as DCOR),
+       V = dCov^2, U (dcovU) and bcdcor
+    */
+    int    i, s;
+    double n = (double) W->n, n2 = n * n, n3 = n2 * n, n4 = n3 * n;
+    double S2ab = 0.0, S2aa = 0.0, S2bb = 0.0, Vab, Vaa, Vbb, Uab, Uaa, Ubb;
+    double c;
+
+    for (i=0; i<W->n; i++) {
+        s = (W->first + i) % W->size;
+        S2ab += W->a[s] * W->b[s];
+        S2aa += W->a[s] * W->a[s];
+        S2bb += W->b[s] * W->b[s];
+    }
+    stats[0] = n;
+    for (i=1; i<WINDOW_NSTATS; i++)
+        stats[i] = NA_REAL;
+    if (W->n < 1)
+        return;
+
+    Vab = W->Sab / n2 - 2.0 * S2ab / n3 + W->Sa * W->Sb / n4;
+    Vaa = W->Saa / n2 - 2.0 * S2aa / n3 + W->Sa * W->Sa / n4;
+    Vbb = W->Sbb / n2 - 2.0 * S2bb / n3 + W->Sb * W->Sb / n4;
+    if (Vab < 0.0) Vab = 0.0;
+    if (Vaa < 0.0) Vaa = 0.0;
+    if (Vbb < 0.0) Vbb = 0.0;
+    stats[1] = sqrt(Vab);
+    stats[2] = (Vaa * Vbb > 0.0) ? sqrt(Vab / sqrt(Vaa * Vbb)) : 0.0;
+    stats[3] = sqrt(Vaa);
+    stats[4] = sqrt(Vbb);
+    stats[5] = Vab;
+
+    if (W->n > 3) {
+        c = n * (n - 3.0);
+        Uab = (W->Sab - 2.0 * S2ab / (n - 2.0) +
+               W->Sa * W->Sb / ((n - 1.0) * (n - 2.0))) / c;
+        Uaa = (W->Saa - 2.0 * S2aa / (n - 2.0) +
+               W->Sa * W->Sa / ((n - 1.0) * (n - 2.0))) / c;
+        Ubb = (W->Sbb - 2.0 * S2bb / (n - 2.0) +
+               W->Sb * W->Sb / ((n - 1.0) * (n - 2.0))) / c;
+        stats[6] = Uab;
+        stats[7] = (Uaa * Ubb > 0.0) ? Uab / sqrt(Uaa * Ubb) : 0.0;
+    }
+}
+
+
+SEXP energy_window_new(SEXP size, SEXP dims)
+{
+    /*
+       size  the largest number of points in the window
+       dims  c(p, q): dimensions of x and y
+    */
+    int    m = asInteger(size), p = INTEGER(dims)[0], q = INTEGER(dims)[1];
+    dcor_window *W;
+    SEXP   h;
+
+    if (m == NA_INTEGER || m < 1)
+        error("size must be a positive integer");
+    W = Calloc(1, dcor_window);
+    W->size = m;
+    W->p = p;
+    W->q = q;
+    W->n = W->first = W->pops = 0;
+    W->x = Calloc((size_t) m * p, double);
+    W->y = Calloc((size_t) m * q, double);
+    W->a = Calloc(m, double);
+    W->b = Calloc(m, double);
+    W->da = Calloc(m, double);
+    W->db = Calloc(m, double);
+    W->Sab = W->Saa = W->Sbb = W->Sa = W->Sb = 0.0;
+
+    PROTECT(h = R_MakeExternalPtr(W, install("dcor.window"), R_NilValue));
+    R_RegisterCFinalizerEx(h, window_finalize, TRUE);
+    UNPROTECT(1);
+    return h;
+}
+
+SEXP energy_window_push(SEXP h, SEXP x, SEXP y)
+{
+    /*
+       x, y  m by p and m by q (column order): m points, oldest first;
+       the oldest point of a full window is removed before each is added
+       returns the m by WINDOW_NSTATS statistics after each point
+    */
+    dcor_window *W = window_get(h);
+    int    i, k, m = LENGTH(x) / W->p, p = W->p, q = W->q;
+    double *px = REAL(x), *py = REAL(y), *u, *v, stats[WINDOW_NSTATS];
+    SEXP   ans;
+
+    if (LENGTH(y) / q != m)
+        error("x and y must have the same number of points");
+    PROTECT(ans = allocMatrix(REALSXP, m, WINDOW_NSTATS));
+    u = (double *) R_alloc(p + q, sizeof(double));
+    v = u + p;
+    for (i=0; i<m; i++) {
+        for (k=0; k<p; k++)
+            u[k] = px[(size_t) k * m + i];
+        for (k=0; k<q; k++)
+            v[k] = py[(size_t) k * m + i];
+        if (W->n == W->size)
+            window_remove(W);
+        window_add(W, u, v);
+        window_compute(W, stats);
+        for (k=0; k<WINDOW_NSTATS; k++)
+            REAL(ans)[(size_t) k * m + i] = stats[k];
+    }
+    UNPROTECT(1);
+    return ans;
+}
+
+SEXP energy_window_pop(SEXP h, SEXP k)
+{
+    /* remove the k oldest points; returns the statistics */
+    dcor_window *W = window_get(h);
+    int    i, m = asInteger(k);
+
+    if (m == NA_INTEGER || m < 0)
+        error("k must be a non-negative integer");
+    for (i=0; i<m && W->n > 0; i++)
+        window_remove(W);
+    if (W->n == 0) {
+        W->first = W->pops = 0;
+        W->Sab = W->Saa = W->Sbb = W->Sa = W->Sb = 0.0;
+    }
+    return energy_window_stats(h);
+}
+
+SEXP energy_window_stats(SEXP h)
+{
+    /* the WINDOW_NSTATS statistics of the window */
+    dcor_window *W = window_get(h);
+    SEXP   ans;
+
+    PROTECT(ans = allocVector(REALSXP, WINDOW_NSTATS));
+    window_compute(W, REAL(ans));
+    UNPROTECT(1);
+    return ans;
+}
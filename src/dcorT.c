@@ -0,0 +1,230 @@
+/*
+   dcorT.c: bias corrected distance correlation for the dcor t-test
+   (dcorT, dcorT.test)
+
+   Szekely, G. J. and Rizzo, M. L. (2013) The distance correlation
+   t-test of independence in high dimension, Journal of Multivariate
+   Analysis 117, 193-213.
+
+   The modified double centered distances of the paper are
+       A*_ij = n/(n-1) (a_ij (1 - 1/n) - m_i - m_j + M),  i != j,
+       A*_ii = n/(n-1) (m_i - M)
+   with the row means m_i and the grand mean M of the distances, and
+       XY = sum_{i,j} A*_ij B*_ij - n/(n-2) sum_i A*_ii B*_ii.
+   The sums XY, XX and YY are computed in two passes over the
+   distances, which are recomputed by tiles from the data (distance.c)
+   or read from a dist object, so that no n by n matrix is formed: the
+   first pass computes the row means, the second the sums of the
+   products of A* and B*.  The tile rows are computed in parallel (see
+   energy.threads) and their sums added in order, so that the result
+   does not depend on the number of threads.
+
+   energy_bcdcor   .Call: bcR, XY/n^2, XX/n^2, YY/n^2 (BCDCOR in R)
+*/
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rmath.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "distance.h"
+#include "permutation.h"
+
+SEXP energy_bcdcor(SEXP x, SEXP y, SEXP dims);
+
+typedef struct {
+    int    n, type;          /* type 0: data, 1: dist object */
+    dist_data X;             /* the data (type 0) */
+    const double *px;        /* the dist object (type 1) */
+    double *m, M;            /* row means and grand mean */
+} bcdcor_sample;
+
+static void sample_tile(const bcdcor_sample *S, int i0, int j0, int m,
+                        int nj, double *work);
+static void sample_means(bcdcor_sample *S, int ws, int nthreads);
+static void bcdcor_sums(bcdcor_sample *Sx, bcdcor_sample *Sy, int ws,
+                        int nthreads, double *sums);
+
+
+static void sample_tile(const bcdcor_sample *S, int i0, int j0, int m,
+                        int nj, double *work)
+{
+    /* work[i*DIST_TILE + j] = a_(i0+i, j0+j), i < m, j < nj */
+    int    i, j, I, J, n = S->n;
+    double *wi;
+
+    if (S->type == 0) {
+        dist_block(&S->X, &S->X, i0, j0, m, nj, FALSE, work);
+        return;
+    }
+    /* dist: element (I, J), I > J, is px[n J - J (J+1)/2 + I - J - 1] */
+    for (i=0; i<m; i++) {
+        I = i0 + i;
+        wi = work + (size_t) i * DIST_TILE;
+        for (j=0; j<nj; j++) {
+            J = j0 + j;
+            if (I > J)
+                wi[j] = S->px[(size_t) n*J - (size_t) J*(J+1)/2 + I - J - 1];
+            else if (I < J)
+                wi[j] = S->px[(size_t) n*I - (size_t) I*(I+1)/2 + J - I - 1];
+            else
+                wi[j] = 0.0;
+        }
+    }
+}
+
+static void sample_means(bcdcor_sample *S, int ws, int nthreads)
+{
+    /*
+       row means m and grand mean M; each tile row is summed over all
+       columns by one thread
+    */
+    int    t, i, n = S->n, ntiles = (n + DIST_TILE - 1) / DIST_TILE;
+    double *works = Calloc((size_t) nthreads * ws, double);
+
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(nthreads) schedule(dynamic) \
+        if (ntiles > 1)
+#endif
+    for (t=0; t<ntiles; t++) {
+        int    ii, j, i0 = t * DIST_TILE, j0, m, nj, tid = 0;
+        double *tile;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        tile = works + (size_t) tid * ws;
+        m = (n - i0 < DIST_TILE) ? n - i0 : DIST_TILE;
+        for (ii=0; ii<m; ii++)
+            S->m[i0 + ii] = 0.0;
+        for (j0=0; j0<n; j0+=DIST_TILE) {
+            nj = (n - j0 < DIST_TILE) ? n - j0 : DIST_TILE;
+            sample_tile(S, i0, j0, m, nj, tile);
+            for (ii=0; ii<m; ii++)
+                for (j=0; j<nj; j++)
+                    S->m[i0 + ii] += tile[(size_t) ii * DIST_TILE + j];
+        }
+    }
+    S->M = 0.0;
+    for (i=0; i<n; i++) {
+        S->M += S->m[i];
+        S->m[i] /= (double) n;
+    }
+    S->M /= ((double) n) * n;
+    Free(works);
+}
+
+static void bcdcor_sums(bcdcor_sample *Sx, bcdcor_sample *Sy, int ws,
+                        int nthreads, double *sums)
+{
+    /* sums = c(XY, XX, YY) */
+    int    t, k, i, n = Sx->n, ntiles = (n + DIST_TILE - 1) / DIST_TILE;
+    double *works, *tsums, c, dc, a, b;
+
+    works = Calloc((size_t) nthreads * 2 * ws, double);
+    tsums = Calloc((size_t) ntiles * 3, double);
+    dc = 1.0 - 1.0 / (double) n;
+
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(nthreads) schedule(dynamic) \
+        if (ntiles > 1)
+#endif
+    for (t=0; t<ntiles; t++) {
+        int    ii, j, I, J, i0 = t * DIST_TILE, j0, m, nj, tid = 0;
+        double *wx, *wy, u, v, ab = 0.0, aa = 0.0, bb = 0.0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        wx = works + (size_t) tid * 2 * ws;
+        wy = wx + ws;
+        m = (n - i0 < DIST_TILE) ? n - i0 : DIST_TILE;
+        for (j0=0; j0<=i0; j0+=DIST_TILE) {
+            nj = (j0 == i0) ? m : DIST_TILE;
+            sample_tile(Sx, i0, j0, m, nj, wx);
+            sample_tile(Sy, i0, j0, m, nj, wy);
+            for (ii=0; ii<m; ii++) {
+                I = i0 + ii;
+                for (j=0; j<nj && j0+j<I; j++) {
+                    J = j0 + j;
+                    u = dc * wx[(size_t) ii * DIST_TILE + j]
+                        - Sx->m[I] - Sx->m[J] + Sx->M;
+                    v = dc * wy[(size_t) ii * DIST_TILE + j]
+                        - Sy->m[I] - Sy->m[J] + Sy->M;
+                    ab += u * v;
+                    aa += u * u;
+                    bb += v * v;
+                }
+            }
+        }
+        tsums[3*t] = ab;
+        tsums[3*t + 1] = aa;
+        tsums[3*t + 2] = bb;
+    }
+
+    for (k=0; k<3; k++)
+        sums[k] = 0.0;
+    for (t=0; t<ntiles; t++)
+        for (k=0; k<3; k++)
+            sums[k] += 2.0 * tsums[3*t + k];
+    /* diagonal: weight 1 - n/(n-2) */
+    c = 1.0 - (double) n / (n - 2.0);
+    for (i=0; i<n; i++) {
+        a = Sx->m[i] - Sx->M;
+        b = Sy->m[i] - Sy->M;
+        sums[0] += c * a * b;
+        sums[1] += c * a * a;
+        sums[2] += c * b * b;
+    }
+    c = (double) n / (n - 1.0);
+    for (k=0; k<3; k++)
+        sums[k] *= c * c;
+    Free(works);
+    Free(tsums);
+}
+
+
+SEXP energy_bcdcor(SEXP x, SEXP y, SEXP dims)
+{
+    /*
+       x, y  data matrices (column order) or dist objects
+       dims  c(n, p, q, type of x, type of y), type 0: data, 1: dist
+       returns c(bcR, XY/n^2, XX/n^2, YY/n^2)
+    */
+    int    k, n = INTEGER(dims)[0], p = INTEGER(dims)[1];
+    int    q = INTEGER(dims)[2], ws, nthreads = num_threads();
+    double sums[3], n2 = ((double) n) * n;
+    bcdcor_sample Sx, Sy;
+    SEXP   ans;
+
+    if (nthreads < 1) nthreads = 1;
+    Sx.n = Sy.n = n;
+    Sx.type = INTEGER(dims)[3];
+    Sy.type = INTEGER(dims)[4];
+    Sx.px = REAL(x);
+    Sy.px = REAL(y);
+    if (Sx.type == 0)
+        dist_prepare_cols(&Sx.X, REAL(x), n, p, NULL);
+    if (Sy.type == 0)
+        dist_prepare_cols(&Sy.X, REAL(y), n, q, NULL);
+    Sx.m = Calloc(n, double);
+    Sy.m = Calloc(n, double);
+    ws = dist_worksize(p > q ? p : q);
+
+    sample_means(&Sx, ws, nthreads);
+    sample_means(&Sy, ws, nthreads);
+    bcdcor_sums(&Sx, &Sy, ws, nthreads, sums);
+
+    PROTECT(ans = allocVector(REALSXP, 4));
+    REAL(ans)[0] = sums[0] / sqrt(sums[1] * sums[2]);
+    for (k=0; k<3; k++)
+        REAL(ans)[k + 1] = sums[k] / n2;
+
+    Free(Sx.m);
+    Free(Sy.m);
+    if (Sx.type == 0)
+        dist_release(&Sx.X);
+    if (Sy.type == 0)
+        dist_release(&Sy.X);
+    UNPROTECT(1);
+    return ans;
+}
@@ -34,21 +34,80 @@
    
  energy 1.6.2: Insert GetRNGstate() ... PutRNGstate()
    around replication loop
+
+ energy 1.7-9: dCOVtest replicates are computed by perm_replicates
+   (permutation.c), in parallel if energy.threads() > 1.
+   dCOV and dCOVtest store the distance and double centered matrices
+   in packed lower triangular form (utilities.h), and Akl centers in
+   place, so two packed matrices are used instead of four n by n.
+   dCOVstream computes the dCOV statistics from data in O(n + d)
+   memory: distances are recomputed tile by tile (distance.c, by the
+   direct formulation for any d, without the centered copy of the
+   GEMM formulation) in two passes,
+   the first for the row means and the second for the products of
+   the double centered distances.
+   dcov_packed computes the statistics and the test from the double
+   centered matrices, for dCOVtest and the distance handles
+   (disthandle.c).
+   With energy.storage("single"), dCOVtest converts each centered
+   matrix to single precision (packed_float) before the next one is
+   computed, and the replicates read the single precision matrices,
+   with products and sums in double (dcov_float_test).
+   The replicates read B(perm[k], perm[j]) through packed_perm_sum
+   (utilities.c), which reads B sequentially by blocks of rows.
+   The .C routines dCOV, dCOVtest and dCOVstream are replaced by the
+   .Call entry points energy_dcov and energy_dcov_stream, which read
+   the R matrices (column order) or dist objects in place: the
+   arguments are not duplicated by .C, transposed by t() in R or
+   reordered by roworder.
 */
 
 #include <R.h>
+#include <Rinternals.h>
 #include <Rmath.h>
-
-void   dCOVtest(double *x, double *y, int *byrow, int *dims,
-                double *index, double *reps, double *DCOV,
-                double *pval);
+#include <string.h>
+#include "permutation.h"
+#include "utilities.h"
+#include "distance.h"
+#include "profile.h"
+
+SEXP   energy_dcov(SEXP x, SEXP y, SEXP dims, SEXP index);
+SEXP   energy_dcov_stream(SEXP x, SEXP y, SEXP dims, SEXP index);
 void   dCovTest(double *x, double *y, int *byrow, int *dims,
                 double *index, double *reps, double *Dstat,
                 double *pval);
 
-void   dCOV(double *x, double *y, int *byrow, int *dims,
-            double *index, int *idx, double *DCOV);
-double Akl(double **akl, double **A, int n);
+double Akl(packed_matrix *akl, packed_matrix *A);
+void   dcov_packed(packed_matrix *A, packed_matrix *B, int R, double *reps,
+                   double *DCOV, double *pval);
+
+typedef struct {
+    packed_matrix *A, *B;
+} dcov_perm_data;
+
+typedef struct {
+    packed_float *A, *B;
+} dcov_float_data;
+
+static packed_matrix *centered_distance(double *x, int n, int d, int type,
+                                        double index);
+static void   dcov_stream(double *x, double *y, int n, int p, int q,
+                          double index, double *DCOV);
+static double centered_sumsq(packed_matrix *A);
+static void   dcov_stats(packed_matrix *A, packed_matrix *B, double *DCOV);
+static void   dcov_finish(double *DCOV, int n);
+static double dcov_row(int k, const double *row, void *ctx);
+static double dcov_replicate(const int *perm, void *data, double *work);
+static void   dcov_float_test(double *x, double *y, const int *dims,
+                              double index, double *reps, double *DCOV,
+                              double *pval);
+static double dcov_float_row(int k, const double *row, void *ctx);
+static double dcov_float_sum(const int *perm, dcov_float_data *pd,
+                             double *work);
+static double dcov_float_replicate(const int *perm, void *data,
+                                   double *work);
+static void   stream_block(const dist_data *X, int i0, int j0, int m, int n,
+                           double index, double *work);
 
 /* functions in utilities.c */
 extern double **alloc_matrix(int r, int c);
@@ -62,70 +121,192 @@ extern void   index_distance(double **Dx, int n, double index);
 extern void   vector2matrix(double *x, double **y, int N, int d, int isroworder);
 
 
-void dCOVtest(double *x, double *y, int *byrow, int *dims,
-              double *index, double *reps,
-              double *DCOV, double *pval) {
-    /*  computes dCov(x,y), dCor(x,y), dVar(x), dVar(y)
-        V-statistic is n*dCov^2 where n*dCov^2 --> Q
+SEXP energy_dcov(SEXP x, SEXP y, SEXP dims, SEXP index) {
+    /*  computes dCov(x,y), dCor(x,y), dVar(x), dVar(y), and if R > 0
+        the dCov permutation test; V-statistic is n*dCov^2 where
+        n*dCov^2 --> Q
+        x, y  : the samples, read in place: data (an R matrix or
+                vector in column order, type 0) or dist objects (type 1)
         dims[0] = n (sample size)
         dims[1] = p (dimension of X)
         dims[2] = q (dimension of Y)
-        dims[3] = dst (logical, TRUE if x, y are distances)
-        dims[4] = R (number of replicates)
+        dims[3], dims[4] = type of x, y
+        dims[5] = R (number of replicates)
         index : exponent for distance
-        DCOV  : vector [dCov, dCor, dVar(x), dVar(y), mean(A), mean(B)]
+        returns list(DCOV, reps, pval), DCOV = [dCov, dCor, dVar(x), dVar(y)]
      */
-    int    i, j, k, n, n2, p, q, r, J, K, M, R;
-    int    dst;
-    int*   perm;
-    double **Dx, **Dy, **A, **B;
-    double dcov, V;
+    int    *dm = INTEGER(dims), n = dm[0], R = dm[5];
+    double a = asReal(index);
+    packed_matrix *A, *B;
+    SEXP   ans, DCOV, reps, pval, nms;
+
+    if (!sample_finite(REAL(x), XLENGTH(x)) ||
+        !sample_finite(REAL(y), XLENGTH(y)))
+        error("Data contains missing or infinite values");
+    if (R < 0) R = 0;
+    PROTECT(DCOV = allocVector(REALSXP, 4));
+    PROTECT(reps = allocVector(REALSXP, R));
+    PROTECT(pval = ScalarReal(1.0));
+    if (R > 0)
+        memset(REAL(reps), 0, (size_t) R * sizeof(double));
+
+    if (R > 0 && float_storage()) {
+        dcov_float_test(REAL(x), REAL(y), dm, a, REAL(reps), REAL(DCOV),
+                        REAL(pval));
+    } else {
+        A = centered_distance(REAL(x), n, dm[1], dm[3], a);
+        B = centered_distance(REAL(y), n, dm[2], dm[4], a);
+        dcov_packed(A, B, R, REAL(reps), REAL(DCOV), REAL(pval));
+        free_packed(A);
+        free_packed(B);
+    }
 
-    n = dims[0];
-    p = dims[1];
-    q = dims[2];
-    dst = dims[3];
-    R = dims[4];
+    PROTECT(ans = allocVector(VECSXP, 3));
+    PROTECT(nms = allocVector(STRSXP, 3));
+    SET_VECTOR_ELT(ans, 0, DCOV);
+    SET_VECTOR_ELT(ans, 1, reps);
+    SET_VECTOR_ELT(ans, 2, pval);
+    SET_STRING_ELT(nms, 0, mkChar("DCOV"));
+    SET_STRING_ELT(nms, 1, mkChar("reps"));
+    SET_STRING_ELT(nms, 2, mkChar("pval"));
+    setAttrib(ans, R_NamesSymbol, nms);
+    UNPROTECT(5);
+    return ans;
+}
 
-    if (*byrow == FALSE) {
-        /* avoid this step: use as.double(t(x)) in R */
-        roworder(x, byrow, n, p);
-        *byrow = FALSE;  /* false for y */
-        roworder(y, byrow, n, q);
+void dcov_packed(packed_matrix *A, packed_matrix *B, int R, double *reps,
+                 double *DCOV, double *pval) {
+    /*  DCOV = [dCov, dCor, dVar(x), dVar(y)] from the double centered
+        distance matrices A, B, and if R > 0 the permutation test:
+        R replicates of dCov and the p-value
+        A and B are not changed
+     */
+    dcov_perm_data pd;
+    perm_stop stop;
+
+    dcov_stats(A, B, DCOV);
+    if (R > 0) {
+        /* compute the replicates */
+        if (DCOV[1] > 0.0) {
+            pd.A = A;
+            pd.B = B;
+            stop.observed = DCOV[0];
+            stop.strict = FALSE;
+            stop.plus1 = TRUE;
+            perm_replicates_stop(A->n, R, dcov_replicate, &pd,
+                                 (int) packed_perm_worksize(A->n), reps,
+                                 &stop);
+            *pval = perm_pvalue(&stop, R);
+        } else {
+            *pval = 1.0;
+        }
     }
+}
 
-    /* critical to pass correct flag dst from R */
-    Dx = alloc_matrix(n, n);
-    Dy = alloc_matrix(n, n);
-    if (dst) {
-		vector2matrix(x, Dx, n, n, 1);
-		vector2matrix(y, Dy, n, n, 1);
-	}
-	else {
-		Euclidean_distance(x, Dx, n, p);
-		Euclidean_distance(y, Dy, n, q);
-	}
-	index_distance(Dx, n, *index);
-	index_distance(Dy, n, *index);
-
-    A = alloc_matrix(n, n);
-    B = alloc_matrix(n, n);
-    Akl(Dx, A, n);
-    Akl(Dy, B, n);
-    free_matrix(Dx, n, n);
-    free_matrix(Dy, n, n);
+SEXP energy_dcov_stream(SEXP x, SEXP y, SEXP dims, SEXP index) {
+    /*  computes dCov(x,y), dCor(x,y), dVar(x), dVar(y) from the data
+        x, y (R matrices or vectors, read in place) without storing
+        any n by n matrix
+        dims = c(n, p, q)
+        returns DCOV = [dCov, dCor, dVar(x), dVar(y)]
+     */
+    int    *dm = INTEGER(dims);
+    SEXP   DCOV;
+
+    if (!sample_finite(REAL(x), XLENGTH(x)) ||
+        !sample_finite(REAL(y), XLENGTH(y)))
+        error("Data contains missing or infinite values");
+    PROTECT(DCOV = allocVector(REALSXP, 4));
+    dcov_stream(REAL(x), REAL(y), dm[0], dm[1], dm[2], asReal(index),
+                REAL(DCOV));
+    UNPROTECT(1);
+    return DCOV;
+}
 
+static void dcov_stream(double *x, double *y, int n, int p, int q,
+                        double index, double *DCOV) {
+    /*  DCOV = [dCov, dCor, dVar(x), dVar(y)] from the n by p and n by q
+        data x, y in column order; the distances are recomputed tile by
+        tile in two passes
+     */
+    int    i, j, k, m, mj, I, J, i0, j0;
+    double *ma, *mb, *wx, *wy, Ma, Mb, n2, V;
+    double a, b, ab, aa, bb;
+    dist_data X, Y;
+
+    ma = Calloc(n, double);
+    mb = Calloc(n, double);
+    wx = Calloc(dist_worksize(p), double);
+    wy = Calloc(dist_worksize(q), double);
+    dist_attach_cols(&X, x, n, p);
+    dist_attach_cols(&Y, y, n, q);
     n2 = ((double) n) * n;
 
-    /* compute dCov(x,y), dVar(x), dVar(y) */
+    /* first pass: row means and grand means of a_{kl}, b_{kl} */
+    for (i0=0; i0<n; i0+=DIST_TILE) {
+        m = (n - i0 < DIST_TILE) ? n - i0 : DIST_TILE;
+        for (j0=0; j0<=i0; j0+=DIST_TILE) {
+            mj = (n - j0 < DIST_TILE) ? n - j0 : DIST_TILE;
+            stream_block(&X, i0, j0, m, mj, index, wx);
+            stream_block(&Y, i0, j0, m, mj, index, wy);
+            for (i=0; i<m; i++) {
+                I = i0 + i;
+                for (j=0; j<mj && j0+j<I; j++) {
+                    J = j0 + j;
+                    a = wx[i*DIST_TILE + j];
+                    b = wy[i*DIST_TILE + j];
+                    ma[I] += a;
+                    ma[J] += a;
+                    mb[I] += b;
+                    mb[J] += b;
+                }
+            }
+        }
+    }
+    Ma = Mb = 0.0;
+    for (k=0; k<n; k++) {
+        Ma += ma[k];
+        Mb += mb[k];
+        ma[k] /= (double) n;
+        mb[k] /= (double) n;
+    }
+    Ma /= n2;
+    Mb /= n2;
+
+    /* second pass: sums of A_{kl} B_{kl}, A_{kl}^2, B_{kl}^2 */
     for (k=0; k<4; k++)
         DCOV[k] = 0.0;
-    for (k=0; k<n; k++)
-        for (j=0; j<n; j++) {
-            DCOV[0] += A[k][j]*B[k][j];
-            DCOV[2] += A[k][j]*A[k][j];
-            DCOV[3] += B[k][j]*B[k][j];
+    for (i0=0; i0<n; i0+=DIST_TILE) {
+        m = (n - i0 < DIST_TILE) ? n - i0 : DIST_TILE;
+        for (j0=0; j0<=i0; j0+=DIST_TILE) {
+            mj = (n - j0 < DIST_TILE) ? n - j0 : DIST_TILE;
+            stream_block(&X, i0, j0, m, mj, index, wx);
+            stream_block(&Y, i0, j0, m, mj, index, wy);
+            ab = aa = bb = 0.0;
+            for (i=0; i<m; i++) {
+                I = i0 + i;
+                for (j=0; j<mj && j0+j<I; j++) {
+                    J = j0 + j;
+                    a = wx[i*DIST_TILE + j] - ma[I] - ma[J] + Ma;
+                    b = wy[i*DIST_TILE + j] - mb[I] - mb[J] + Mb;
+                    ab += a*b;
+                    aa += a*a;
+                    bb += b*b;
+                }
+            }
+            DCOV[0] += 2.0*ab;
+            DCOV[2] += 2.0*aa;
+            DCOV[3] += 2.0*bb;
         }
+    }
+    /* diagonal terms A_{kk} = -2 a_{k.} + a_{..} */
+    for (k=0; k<n; k++) {
+        a = Ma - 2.0*ma[k];
+        b = Mb - 2.0*mb[k];
+        DCOV[0] += a*b;
+        DCOV[2] += a*a;
+        DCOV[3] += b*b;
+    }
 
     for (k=0; k<4; k++) {
         DCOV[k] /= n2;
@@ -133,109 +314,92 @@ void dCOVtest(double *x, double *y, int *byrow, int *dims,
             DCOV[k] = sqrt(DCOV[k]);
             else DCOV[k] = 0.0;
     }
-    /* compute dCor(x, y) */
     V = DCOV[2]*DCOV[3];
     if (V > DBL_EPSILON)
         DCOV[1] = DCOV[0] / sqrt(V);
         else DCOV[1] = 0.0;
 
-	if (R > 0) {
-		/* compute the replicates */
-		if (DCOV[1] > 0.0) {
-			perm = Calloc(n, int);
-			M = 0;
-			for (i=0; i<n; i++) perm[i] = i;
-      GetRNGstate();
-      for (r=0; r<R; r++) {
-			   permute(perm, n);
-			   dcov = 0.0;
-			   for (k=0; k<n; k++) {
-				   K = perm[k];
-				   for (j=0; j<n; j++) {
-					   J = perm[j];
-					   dcov += A[k][j]*B[K][J];
-				   }
-			   }
-			   dcov /= n2;
-			   dcov = sqrt(dcov);
-			   reps[r] = dcov;
-			   if (dcov >= DCOV[0]) M++;
-			}
-			*pval = (double) (M+1) / (double) (R+1);
-      PutRNGstate();
-			Free(perm);
-		} else {
-		    *pval = 1.0;
-			}
-	}
-
-    free_matrix(A, n, n);
-    free_matrix(B, n, n);
+    dist_release(&X);
+    dist_release(&Y);
+    Free(ma);
+    Free(mb);
+    Free(wx);
+    Free(wy);
     return;
 }
 
-void dCOV(double *x, double *y, int *byrow, int *dims,
-              double *index, int *idx, double *DCOV) {
-    /*  computes dCov(x,y), dCor(x,y), dVar(x), dVar(y)
-        V-statistic is n*dCov^2 where n*dCov^2 --> Q
-        dims[0] = n (sample size)
-        dims[1] = p (dimension of X)
-        dims[2] = q (dimension of Y)
-        dims[3] = dst (logical, TRUE if x, y are distances)
-        index : exponent for distance
-        idx   : index vector, a permutation of sample indices
-        DCOV  : vector [dCov, dCor, dVar(x), dVar(y)]
+static void stream_block(const dist_data *X, int i0, int j0, int m, int n,
+                         double index, double *work) {
+    /* one tile of distances |x_i - x_j|^index (see dist_pblock) */
+    if (fabs(index - 1) <= DBL_EPSILON)
+        index = 1.0;
+    dist_pblock(X, X, i0, j0, m, n, index, work);
+}
+
+static packed_matrix *centered_distance(double *x, int n, int d, int type,
+                                        double index) {
+    /*  double centered distance matrix of the sample x of type 0 (data
+        in column order), 1 (dist object) or 2 (n by n distances), see
+        packed_sample_distance; the packed distances are centered in
+        place
      */
+    packed_matrix *D;
 
-    int    j, k, n, n2, p, q, dst;
-    double **Dx, **Dy, **A, **B;
-    double V;
+    D = alloc_packed(n);
+    packed_sample_distance(x, d, type, index, D);
+    Akl(D, D);
+    return D;
+}
 
-    n = dims[0];
-    p = dims[1];
-    q = dims[2];
-    dst = dims[3];
+static double centered_sumsq(packed_matrix *A) {
+    /* sum of A_{kj}^2 over all (k, j) */
+    int    j, k, n = A->n;
+    double *Ak, s, sum = 0.0;
 
-    if (*byrow == FALSE) {
-        /* avoid this step: use as.double(t(x)) in R */
-        roworder(x, byrow, n, p);
-        *byrow = FALSE;  /* false for y */
-        roworder(y, byrow, n, q);
+    for (k=0; k<n; k++) {
+        Ak = A->x + PACKED_OFFSET(k);
+        s = 0.0;
+        for (j=0; j<k; j++)
+            s += Ak[j]*Ak[j];
+        sum += 2.0*s + Ak[k]*Ak[k];
     }
+    return sum;
+}
 
-
-    /* critical to pass correct flag dst from R */
-    Dx = alloc_matrix(n, n);
-    Dy = alloc_matrix(n, n);
-    if (dst) {
-		vector2matrix(x, Dx, n, n, 1);
-		vector2matrix(y, Dy, n, n, 1);
-	}
-	else {
-		Euclidean_distance(x, Dx, n, p);
-		Euclidean_distance(y, Dy, n, q);
-	}
-	index_distance(Dx, n, *index);
-	index_distance(Dy, n, *index);
-
-    A = alloc_matrix(n, n);
-    B = alloc_matrix(n, n);
-    Akl(Dx, A, n);
-    Akl(Dy, B, n);
-    free_matrix(Dx, n, n);
-    free_matrix(Dy, n, n);
-
-    n2 = ((double) n) * n;
+static void dcov_stats(packed_matrix *A, packed_matrix *B, double *DCOV) {
+    /*  DCOV = [dCov, dCor, dVar(x), dVar(y)] from centered A, B
+        sums over all (k, j) are twice the sums over j < k
+        plus the diagonal terms
+     */
+    int    j, k, n = A->n;
+    double *Ak, *Bk;
+    double ab, aa, bb;
 
     /* compute dCov(x,y), dVar(x), dVar(y) */
     for (k=0; k<4; k++)
         DCOV[k] = 0.0;
-    for (k=0; k<n; k++)
-        for (j=0; j<n; j++) {
-            DCOV[0] += A[k][j]*B[k][j];
-            DCOV[2] += A[k][j]*A[k][j];
-            DCOV[3] += B[k][j]*B[k][j];
+    for (k=0; k<n; k++) {
+        Ak = A->x + PACKED_OFFSET(k);
+        Bk = B->x + PACKED_OFFSET(k);
+        ab = aa = bb = 0.0;
+        for (j=0; j<k; j++) {
+            ab += Ak[j]*Bk[j];
+            aa += Ak[j]*Ak[j];
+            bb += Bk[j]*Bk[j];
         }
+        DCOV[0] += 2.0*ab + Ak[k]*Bk[k];
+        DCOV[2] += 2.0*aa + Ak[k]*Ak[k];
+        DCOV[3] += 2.0*bb + Bk[k]*Bk[k];
+    }
+    dcov_finish(DCOV, n);
+}
+
+static void dcov_finish(double *DCOV, int n) {
+    /*  DCOV[0], DCOV[2], DCOV[3] are the sums of A B, A^2, B^2
+        on entry; DCOV = [dCov, dCor, dVar(x), dVar(y)] on return
+     */
+    int    k;
+    double n2 = ((double) n) * n, V;
 
     for (k=0; k<4; k++) {
         DCOV[k] /= n2;
@@ -248,39 +412,140 @@ void dCOV(double *x, double *y, int *byrow, int *dims,
     if (V > DBL_EPSILON)
         DCOV[1] = DCOV[0] / sqrt(V);
         else DCOV[1] = 0.0;
+}
 
-    free_matrix(A, n, n);
-    free_matrix(B, n, n);
-    return;
+static double dcov_row(int k, const double *row, void *ctx) {
+    /* row k of the sum of A_{kj} B_{perm[k] perm[j]}, row[j] of B */
+    packed_matrix *A = (packed_matrix *) ctx;
+    double *Ak = A->x + PACKED_OFFSET(k), dsum = 0.0;
+    int    j;
+
+    for (j=0; j<k; j++)
+        dsum += Ak[j]*row[j];
+    return 2.0*dsum + Ak[k]*row[k];
+}
+
+static double dcov_replicate(const int *perm, void *data, double *work) {
+    /*  dCov of the permutation replicate (x, y[perm])
+        work: packed_perm_worksize(n)
+     */
+    dcov_perm_data *pd = (dcov_perm_data *) data;
+    double dcov, n = (double) pd->A->n;
+
+    dcov = packed_perm_sum(pd->B, perm, dcov_row, pd->A, work);
+    dcov /= n * n;
+    return sqrt(dcov);
+}
+
+static void dcov_float_test(double *x, double *y, const int *dims,
+                            double index, double *reps, double *DCOV,
+                            double *pval) {
+    /*  energy_dcov (dims[5] = R > 0) with single precision storage:
+        A is converted to single precision before B is computed, so
+        that at most one double and one single precision matrix are
+        stored.  dVar(x) and dVar(y) are computed in double precision
+        before the conversion; dCov and the replicates are computed
+        from the single precision matrices, so that the observed
+        statistic and the replicates are comparable.
+     */
+    int    k, n = dims[0], R = dims[5];
+    int    *perm;
+    double *work;
+    packed_matrix *D;
+    dcov_float_data pd;
+    perm_stop stop;
+
+    D = centered_distance(x, n, dims[1], dims[3], index);
+    DCOV[2] = centered_sumsq(D);
+    pd.A = packed_to_float(D);
+    D = centered_distance(y, n, dims[2], dims[4], index);
+    DCOV[3] = centered_sumsq(D);
+    pd.B = packed_to_float(D);
+
+    perm = Calloc(n, int);
+    work = Calloc(packed_perm_worksize(n), double);
+    for (k=0; k<n; k++)
+        perm[k] = k;
+    DCOV[0] = dcov_float_sum(perm, &pd, work);
+    Free(perm);
+    Free(work);
+    dcov_finish(DCOV, n);
+
+    if (DCOV[1] > 0.0) {
+        stop.observed = DCOV[0];
+        stop.strict = FALSE;
+        stop.plus1 = TRUE;
+        perm_replicates_stop(n, R, dcov_float_replicate, &pd,
+                             (int) packed_perm_worksize(n), reps, &stop);
+        *pval = perm_pvalue(&stop, R);
+    } else {
+        *pval = 1.0;
+    }
+    free_packed_float(pd.A);
+    free_packed_float(pd.B);
+}
+
+static double dcov_float_row(int k, const double *row, void *ctx) {
+    /* dcov_row for single precision A */
+    packed_float *A = (packed_float *) ctx;
+    float  *Ak = A->x + PACKED_OFFSET(k);
+    double dsum = 0.0;
+    int    j;
+
+    for (j=0; j<k; j++)
+        dsum += (double) Ak[j] * row[j];
+    return 2.0*dsum + (double) Ak[k] * row[k];
+}
+
+static double dcov_float_sum(const int *perm, dcov_float_data *pd,
+                             double *work) {
+    /*  sum of A_{kj} B_{perm[k] perm[j]} over all (k, j) for single
+        precision A, B; the products and sums are in double precision
+        work: packed_perm_worksize(n)
+     */
+    return packed_float_perm_sum(pd->B, perm, dcov_float_row, pd->A, work);
+}
+
+static double dcov_float_replicate(const int *perm, void *data,
+                                   double *work) {
+    /*  dCov of the permutation replicate (x, y[perm]) from single
+        precision A, B; the rounded matrices need not give a
+        nonnegative V-statistic, so a negative sum is dCov = 0
+     */
+    dcov_float_data *pd = (dcov_float_data *) data;
+    double n = (double) pd->A->n, dcov;
+
+    dcov = dcov_float_sum(perm, pd, work) / (n * n);
+    return (dcov > 0.0) ? sqrt(dcov) : 0.0;
 }
 
-double Akl(double **akl, double **A, int n) {
+double Akl(packed_matrix *akl, packed_matrix *A) {
     /* -computes the A_{kl} or B_{kl} distances from the
         distance matrix (a_{kl}) or (b_{kl}) for dCov, dCor, dVar
         dCov = mean(Akl*Bkl), dVar(X) = mean(Akl^2), etc.
+        A may be the same matrix as akl (centering in place)
     */
-    int j, k;
-    double *akbar;
-    double abar;
+    int j, k, n = akl->n;
+    double *akbar, *ak, *Ak;
+    double abar, t0 = prof_start();
 
     akbar = Calloc(n, double);
+    packed_rowsums(akl, akbar);
     abar = 0.0;
     for (k=0; k<n; k++) {
-        akbar[k] = 0.0;
-        for (j=0; j<n; j++) {
-            akbar[k] += akl[k][j];
-        }
         abar += akbar[k];
         akbar[k] /= (double) n;
     }
-    abar /= (double) (n*n);
+    abar /= ((double) n) * n;
 
-    for (k=0; k<n; k++)
-        for (j=k; j<n; j++) {
-            A[k][j] = akl[k][j] - akbar[k] - akbar[j] + abar;
-            A[j][k] = A[k][j];
-        }
+    for (k=0; k<n; k++) {
+        ak = akl->x + PACKED_OFFSET(k);
+        Ak = A->x + PACKED_OFFSET(k);
+        for (j=0; j<=k; j++)
+            Ak[j] = ak[j] - akbar[k] - akbar[j] + abar;
+    }
     Free(akbar);
+    prof_stop(PROF_CENTER, t0);
     return(abar);
 }
 
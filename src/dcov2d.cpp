@@ -0,0 +1,264 @@
+#include <Rcpp.h>
+using namespace Rcpp;
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "permutation.h"
+
+// O(n log n) sums for dcov2d (Huo and Szekely 2016) in one native pass
+//
+// The sums S1, S2, S3 replace .gamma1 (four calls, each through
+// Btree_sum) and the sort / rank work previously done in R.
+// gamma1 for the four weights z = 1, x, y, xy is accumulated in one
+// traversal of a flat Fenwick tree with four sums per node, so there
+// is no allocation inside the O(n log n) loop.
+//
+// dcov2d_test: permutation test; x is sorted once and each replicate
+// only needs the ranks of the permuted y, which are the stored ranks
+// of y, so a replicate is one O(n log n) Fenwick pass with no sorting.
+// The replicates are computed by perm_replicates (permutation.c).
+
+List dcov2d_sums(NumericVector x, NumericVector y, bool all_sums);
+void sort_rank(const double *x, int n, int *ix, int *r);
+void rowsums_dist1(const double *x, int n, const int *ix, const int *r,
+                   double *rowsums);
+double gamma_S1(const double *x1, const double *y1, const int *ry1, int n,
+                double *work);
+List dcov2d_test(NumericVector x, NumericVector y, int R, bool unbiased);
+
+struct dcov2d_perm_data {
+  int n;
+  const int *ix, *ry;
+  const double *x1, *y, *a, *b;
+  double S3, d1, d2, d3;
+};
+
+extern "C" {
+static double dcov2d_replicate(const int *perm, void *data, double *work);
+}
+
+
+void sort_rank(const double *x, int n, int *ix, int *r) {
+  // ix = order(x) and r = rank(x, ties.method = "first"), 0-based
+  // NaN is ordered last, so that the comparison is a strict weak order
+  int i;
+  for (i = 0; i < n; i++)
+    ix[i] = i;
+  std::stable_sort(ix, ix + n, [x](int a, int b) {
+    return !std::isnan(x[a]) && (std::isnan(x[b]) || x[a] < x[b]);
+  });
+  for (i = 0; i < n; i++)
+    r[ix[i]] = i;
+}
+
+void rowsums_dist1(const double *x, int n, const int *ix, const int *r,
+                   double *rowsums) {
+  // rowsums[i] = sum_j |x_i - x_j| from the sorted sample
+  // psum[k] is the sum of the k smallest observations
+  int i, k;
+  double sx = 0.0;
+  std::vector<double> psum(n);
+  for (k = 0; k < n; k++) {
+    psum[k] = sx;
+    sx += x[ix[k]];
+  }
+  for (i = 0; i < n; i++)
+    rowsums[i] = (2.0 * r[i] - n) * x[i] + sx - 2.0 * psum[r[i]];
+}
+
+double gamma_S1(const double *x1, const double *y1, const int *ry1, int n,
+                double *work) {
+  /*
+   * S1 = sum_{i,j} |x_i - x_j| |y_i - y_j| for the sample sorted by x:
+   *   x1 sorted x, y1 = y[order(x)], ry1 = 0-based ranks of y1
+   * work: length 8 * (n + 1), the Fenwick tree (four sums per node)
+   *   followed by the partial sums of the weights in y order
+   * the weights are z = (1, x1, y1, x1*y1)
+   */
+  int i, k, w;
+  double *tree = work, *py = work + 4 * (n + 1);
+  double z[4], g[4], Z[4] = {0.0, 0.0, 0.0, 0.0};
+  double px[4] = {0.0, 0.0, 0.0, 0.0};
+  double S1 = 0.0;
+
+  std::fill(work, work + 8 * (n + 1), 0.0);
+
+  // partial sums of z in y order: py[4 * r] = sum(z_j : ry1_j < r)
+  for (i = 0; i < n; i++) {
+    k = 4 * (ry1[i] + 1);
+    py[k] = 1.0;
+    py[k + 1] = x1[i];
+    py[k + 2] = y1[i];
+    py[k + 3] = x1[i] * y1[i];
+  }
+  for (k = 4; k < 4 * (n + 1); k += 4)
+    for (w = 0; w < 4; w++) {
+      py[k + w] += py[k - 4 + w];
+      Z[w] = py[k + w];
+    }
+
+  for (i = 0; i < n; i++) {
+    z[0] = 1.0;
+    z[1] = x1[i];
+    z[2] = y1[i];
+    z[3] = x1[i] * y1[i];
+
+    // gamma1(i) = sum(z_j : j < i, ry1_j < ry1_i)
+    g[0] = g[1] = g[2] = g[3] = 0.0;
+    for (k = ry1[i]; k > 0; k -= k & (-k))
+      for (w = 0; w < 4; w++)
+        g[w] += tree[4 * k + w];
+    for (k = ry1[i] + 1; k <= n; k += k & (-k))
+      for (w = 0; w < 4; w++)
+        tree[4 * k + w] += z[w];
+
+    // g_z = sum(z) - z - 2 psumsx1 - 2 psumsy1 + 4 gamma1
+    for (w = 0; w < 4; w++) {
+      g[w] = Z[w] - z[w] - 2.0 * px[w] - 2.0 * py[4 * ry1[i] + w]
+             + 4.0 * g[w];
+      px[w] += z[w];
+    }
+    S1 += z[3] * g[0] + g[3] - x1[i] * g[2] - y1[i] * g[1];
+  }
+  return S1;
+}
+
+
+// [[Rcpp::export(.dcov2d_sums)]]
+List dcov2d_sums(NumericVector x, NumericVector y, bool all_sums) {
+  // the sums S1, S2, S3 for dcov^2 of univariate x, y (see .dcovSums2d)
+  // if all_sums, also the sums for dVar(x), dVar(y) and the row sums
+  int n = x.length(), i;
+  std::vector<int> ix(n), rx(n), iy(n), ry(n), ry1(n);
+  std::vector<double> x1(n), y1(n), work(8 * ((size_t) n + 1));
+  NumericVector a(n), b(n);
+  double S1, S2 = 0.0, suma = 0.0, sumb = 0.0;
+
+  if (!is_true(all(is_finite(x))) || !is_true(all(is_finite(y))))
+    stop("Data contains missing or infinite values");
+  sort_rank(x.begin(), n, ix.data(), rx.data());
+  sort_rank(y.begin(), n, iy.data(), ry.data());
+  rowsums_dist1(x.begin(), n, ix.data(), rx.data(), a.begin());
+  rowsums_dist1(y.begin(), n, iy.data(), ry.data(), b.begin());
+  for (i = 0; i < n; i++) {
+    S2 += a(i) * b(i);
+    suma += a(i);
+    sumb += b(i);
+  }
+
+  // sort by x; ranks of y1 = y[order(x)] are the ranks of y
+  // (ties in y are broken by position in y rather than in y1,
+  // which does not change the sums)
+  for (i = 0; i < n; i++) {
+    x1[i] = x(ix[i]);
+    y1[i] = y(ix[i]);
+    ry1[i] = ry[ix[i]];
+  }
+  S1 = gamma_S1(x1.data(), y1.data(), ry1.data(), n, work.data());
+
+  List L = List::create(
+    _["S1"] = S1, _["S2"] = S2, _["S3"] = suma * sumb,
+    _["S1a"] = NA_REAL, _["S1b"] = NA_REAL,
+    _["S2a"] = NA_REAL, _["S2b"] = NA_REAL,
+    _["S3a"] = NA_REAL, _["S3b"] = NA_REAL,
+    _["rowsumsA"] = NA_REAL, _["rowsumsB"] = NA_REAL,
+    _["sumA"] = NA_REAL, _["sumB"] = NA_REAL);
+  if (all_sums) {
+    double mx = Rcpp::mean(x), my = Rcpp::mean(y);
+    double ssx = 0.0, ssy = 0.0, s2a = 0.0, s2b = 0.0;
+    for (i = 0; i < n; i++) {
+      ssx += (x(i) - mx) * (x(i) - mx);
+      ssy += (y(i) - my) * (y(i) - my);
+      s2a += a(i) * a(i);
+      s2b += b(i) * b(i);
+    }
+    // S1a = sum_{i,j} (x_i - x_j)^2 = 2 n sum (x_i - mean(x))^2
+    L["S1a"] = 2.0 * n * ssx;
+    L["S1b"] = 2.0 * n * ssy;
+    L["S2a"] = s2a;
+    L["S2b"] = s2b;
+    L["S3a"] = suma * suma;
+    L["S3b"] = sumb * sumb;
+    L["rowsumsA"] = a;
+    L["rowsumsB"] = b;
+    L["sumA"] = suma;
+    L["sumB"] = sumb;
+  }
+  return L;
+}
+
+
+extern "C" {
+static double dcov2d_replicate(const int *perm, void *data, double *work) {
+  // dcov^2 (V or U) of the replicate (x, y[perm])
+  // work: 8 (n + 1) for gamma_S1, n for y1, n for the ranks of y1
+  dcov2d_perm_data *pd = (dcov2d_perm_data *) data;
+  int i, k, n = pd->n;
+  double *y1 = work + 8 * ((size_t) n + 1);
+  int *ry1 = (int *) (y1 + n);
+  double S1, S2 = 0.0;
+
+  for (i = 0; i < n; i++) {
+    k = perm[pd->ix[i]];
+    y1[i] = pd->y[k];
+    ry1[i] = pd->ry[k];
+    S2 += pd->a[i] * pd->b[perm[i]];
+  }
+  S1 = gamma_S1(pd->x1, y1, ry1, n, work);
+  return S1 / pd->d1 - 2.0 * S2 / pd->d2 + pd->S3 / pd->d3;
+}
+}
+
+
+// [[Rcpp::export(.dcov2d_test)]]
+List dcov2d_test(NumericVector x, NumericVector y, int R, bool unbiased) {
+  // dcov^2 of univariate x, y (V-statistic, or U-statistic if unbiased)
+  // and R permutation replicates of it
+  int n = x.length(), i;
+  std::vector<int> ix(n), rx(n), iy(n), ry(n), ry1(n);
+  std::vector<double> x1(n), y1(n), a(n), b(n), work(8 * ((size_t) n + 1));
+  double S1, S2 = 0.0, suma = 0.0, sumb = 0.0, N = (double) n;
+  NumericVector reps(R > 0 ? R : 0);
+  dcov2d_perm_data pd;
+
+  if (!is_true(all(is_finite(x))) || !is_true(all(is_finite(y))))
+    stop("Data contains missing or infinite values");
+  sort_rank(x.begin(), n, ix.data(), rx.data());
+  sort_rank(y.begin(), n, iy.data(), ry.data());
+  rowsums_dist1(x.begin(), n, ix.data(), rx.data(), a.data());
+  rowsums_dist1(y.begin(), n, iy.data(), ry.data(), b.data());
+  for (i = 0; i < n; i++) {
+    S2 += a[i] * b[i];
+    suma += a[i];
+    sumb += b[i];
+    x1[i] = x(ix[i]);
+    y1[i] = y(ix[i]);
+    ry1[i] = ry[ix[i]];
+  }
+  S1 = gamma_S1(x1.data(), y1.data(), ry1.data(), n, work.data());
+
+  pd.n = n;
+  pd.ix = ix.data();
+  pd.ry = ry.data();
+  pd.x1 = x1.data();
+  pd.y = y.begin();
+  pd.a = a.data();
+  pd.b = b.data();
+  pd.S3 = suma * sumb;
+  if (unbiased) {
+    pd.d1 = N * (N - 3.0);
+    pd.d2 = pd.d1 * (N - 2.0);
+    pd.d3 = pd.d2 * (N - 1.0);
+  } else {
+    pd.d1 = N * N;
+    pd.d2 = pd.d1 * N;
+    pd.d3 = pd.d2 * N;
+  }
+  double stat = S1 / pd.d1 - 2.0 * S2 / pd.d2 + pd.S3 / pd.d3;
+
+  if (R > 0)
+    perm_replicates(n, R, dcov2d_replicate, &pd, 10 * (n + 1), reps.begin());
+
+  return List::create(_["statistic"] = stat, _["replicates"] = reps);
+}
@@ -1,29 +1,23 @@
 #include <Rcpp.h>
 using namespace Rcpp;
 
-NumericMatrix U_center(NumericMatrix);
+void U_gram(const double * const *D, int p, int n, double *G);
 
 //[[Rcpp::export]]
 NumericVector dcovU_stats(NumericMatrix Dx, NumericMatrix Dy) {
   // x and y must be square distance matrices
-  NumericMatrix A = U_center(Dx);
-  NumericMatrix B = U_center(Dy);
-  double ab = 0.0, aa = 0.0, bb = 0.0;
+  // the U-centered matrices are not stored (see U_gram in centering.cpp)
+  const double *D[2] = {Dx.begin(), Dy.begin()};
+  double G[4];
+  double ab, aa, bb;
   double V, dcorU = 0.0;
   double eps = std::numeric_limits<double>::epsilon();  //machine epsilon
   int n = Dx.nrow();
-  int n2 = n * (n - 3);
 
-  for (int i=0; i<n; i++)
-    for (int j=0; j<i; j++) {
-      // U-centered is symmetric, with zero diagonal
-      ab += A(i, j) * B(i, j);
-      aa += A(i, j) * A(i, j);
-      bb += B(i, j) * B(i, j);
-    }
-  ab = 2.0 * ab / (double) n2;
-  aa = 2.0 * aa / (double) n2;
-  bb = 2.0 * bb / (double) n2;
+  U_gram(D, 2, n, G);
+  aa = G[0];
+  ab = G[1];
+  bb = G[3];
   V = aa * bb;
   if (V > eps)
     dcorU = ab / sqrt(V);
@@ -0,0 +1,141 @@
+/*
+   disco.c: distance components (DISCO) for the energy package
+
+   Rizzo, M.L. and Szekely, G.J. (2010) DISCO Analysis: A Nonparametric
+   Extension of Analysis of Variance, Annals of Applied Statistics
+   Vol. 4, No. 2, 1034-1055.
+
+   For a factor with K levels of sizes n_1, ..., n_K the total
+   dispersion of the N observations is T = sum_{i > j} D(i, j) / N,
+   the within-sample component is
+       W = sum_k  sum_{i > j in sample k} D(i, j) / n_k
+   and the between-sample component is B = T - W.  The sums by level
+   are computed in one pass over the packed lower triangle of D
+   (packed_group_sums in utilities.c).
+
+   The permutation replicates permute the labels and are computed by
+   perm_replicates (permutation.c) in parallel.  Each factor of a model
+   is tested on its own, as in disco() of earlier versions.
+
+   disco_packed   decomposition and replicates of the F ratio or B
+                  for each factor (disco, disco.between, distance
+                  handles in disthandle.c)
+*/
+
+#include <R.h>
+#include <Rmath.h>
+#include "utilities.h"
+#include "permutation.h"
+
+void   disco_packed(packed_matrix *D, int nfactors, const int *trt,
+                    const int *nlevels, int R, int between,
+                    double *stats, double *reps);
+
+typedef struct {
+    packed_matrix *D;
+    const int *trt;       /* labels of one factor, 0:(K-1) */
+    const double *sizes;  /* sample sizes of the levels */
+    int    K, between;
+    double total;
+} disco_data;
+
+static double disco_within(packed_matrix *D, const int *group, int K,
+                           const double *sizes, double *G);
+static double disco_replicate(const int *perm, void *data, double *work);
+
+
+static double disco_within(packed_matrix *D, const int *group, int K,
+                           const double *sizes, double *G)
+{
+    /*
+       the within-sample component W for the labels group
+       G is scratch of length K (K + 1)
+    */
+    int    k;
+    double W = 0.0;
+    packed_group_sums(D, group, K, G, G + K*K);
+    for (k=0; k<K; k++)
+        W += G[k*K + k] / sizes[k];
+    return W;
+}
+
+static double disco_replicate(const int *perm, void *data, double *work)
+{
+    /*
+       F ratio or between component for the permuted labels
+       work: the labels (N ints, stored in the first N doubles), then
+       K (K + 1) for disco_within
+    */
+    disco_data *dd = (disco_data *) data;
+    int    i, N = dd->D->n, K = dd->K;
+    int    *g = (int *) work;
+    double W, B;
+
+    for (i=0; i<N; i++)
+        g[i] = dd->trt[perm[i]];
+    W = disco_within(dd->D, g, K, dd->sizes, work + N);
+    B = dd->total - W;
+    if (dd->between)
+        return B;
+    return (B / (double) (K - 1)) / (W / (double) (N - K));
+}
+
+void disco_packed(packed_matrix *D, int nfactors, const int *trt,
+                  const int *nlevels, int R, int between,
+                  double *stats, double *reps)
+{
+    /*
+       D        packed distances (to the power index) of N observations
+       trt      N by nfactors labels, 0:(nlevels[j]-1) for factor j
+       R        number of replicates
+       between  TRUE: replicates of B, otherwise of the F ratio
+       stats    nfactors by 6, as disco: B, W, df1, df2, statistic and
+                the total dispersion T
+       reps     R by nfactors replicates (if R > 0)
+    */
+    int    i, j, k, K, N = D->n;
+    double total = 0.0, W, B, *G, *sizes, *Di;
+    disco_data dd;
+    perm_stop stop;
+
+    for (i=1; i<N; i++) {
+        Di = D->x + PACKED_OFFSET(i);
+        for (k=0; k<i; k++)
+            total += Di[k];
+    }
+    total /= (double) N;
+
+    for (j=0; j<nfactors; j++) {
+        K = nlevels[j];
+        sizes = Calloc(K, double);
+        G = Calloc(K * (K + 1), double);
+        for (i=0; i<N; i++)
+            sizes[trt[(size_t) j*N + i]] += 1.0;
+        W = disco_within(D, trt + (size_t) j*N, K, sizes, G);
+        B = total - W;
+        stats[j] = B;
+        stats[j + nfactors] = W;
+        stats[j + 2*nfactors] = (double) (K - 1);
+        stats[j + 3*nfactors] = (double) (N - K);
+        stats[j + 4*nfactors] = between ? B :
+            (B / (double) (K - 1)) / (W / (double) (N - K));
+        stats[j + 5*nfactors] = total;
+        Free(G);
+
+        if (R > 0) {
+            dd.D = D;
+            dd.trt = trt + (size_t) j*N;
+            dd.sizes = sizes;
+            dd.K = K;
+            dd.between = between;
+            dd.total = total;
+            stop.observed = stats[j + 4*nfactors];
+            stop.strict = !between;   /* as the p-values of disco in R */
+            stop.plus1 = !between;
+            perm_replicates_stop(N, R, disco_replicate, &dd,
+                                 N + K * (K + 1), reps + (size_t) j*R,
+                                 &stop);
+        }
+        Free(sizes);
+    }
+}
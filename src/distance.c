@@ -0,0 +1,552 @@
+/*
+   distance.c: blocked Euclidean distance kernel for the energy package
+
+   All distance computations on data (rather than distance matrices)
+   go through dist_tiles, which computes the distances between the rows
+   of two samples in DIST_TILE by DIST_TILE tiles and passes each tile
+   to a sink that stores or reduces it.
+
+   Two formulations are used:
+   1. direct: |x_i - y_j|^2 = sum_k (x_ik - y_jk)^2, with the y tile
+      transposed so that the inner loop runs over a contiguous row of
+      the tile (vectorized by the compiler), for d < DIST_GEMM_DIM.
+   2. GEMM: |x_i - y_j|^2 = |x_i|^2 + |y_j|^2 - 2 <x_i, y_j>, with the
+      inner products from the BLAS routine dgemm, for d >= DIST_GEMM_DIM.
+      The data are centered first (distances are translation invariant)
+      and entries that lose more than DIST_CANCEL of the relative
+      precision to cancellation are recomputed directly, so duplicate
+      and near-duplicate points get accurate (zero) distances.
+
+   dist_center     column means of a sample (common center for GEMM)
+   dist_prepare    set up a sample for dist_tiles
+   dist_prepare_cols  the same for a sample in column order (an R
+                   matrix), read in place without a transposed copy
+   dist_attach     set up a centered sample in storage of the caller
+   dist_attach_cols  a sample in column order for the direct
+                   formulation only, at any d (no copy)
+   dist_view       rows i0, ..., i0+m-1 of a prepared sample
+   dist_release    free the centered copy of a prepared sample
+   dist_worksize   length of the scratch vector used by dist_tiles
+   dist_block      compute one tile of distances
+   dist_pblock     compute one tile of distances to a power
+   dist_tiles      compute distances tile by tile and pass them to a sink
+   dist_ptiles     the same for distances to a power
+   dist_power      distances (or squared distances) to a power, in place
+   dist_square     n by n distance matrix
+   dist_row        distances from row i of a sample to all rows
+   dist_sum        sum of distances within or between samples
+   dist_wsum       the same with scratch of the caller (any thread)
+   dist_psum       the same for distances to a power, by tile rows in
+                   parallel (OpenMP), in a fixed order of summation
+
+   The exponent (index) is applied to each tile as it is computed, so
+   distances to a power cost no pass over a stored matrix.  The kernel
+   computes squared distances s; the exponents 1/2, 1, 3/2 and 2 of
+   the distance (the usual values of index) have closed forms in sqrt
+   and products of s, with separate loops so that each is vectorized,
+   and other exponents are one pow(s, index/2) per entry.
+*/
+
+#define USE_FC_LEN_T
+#include <R.h>
+#include <Rmath.h>
+#include <R_ext/BLAS.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "distance.h"
+#include "profile.h"
+
+#ifndef FCONE
+#define FCONE
+#endif
+
+/* recompute squared distances below DIST_CANCEL * (|x_i|^2 + |y_j|^2) */
+#define DIST_CANCEL 1.0e-4
+
+static void prepare(dist_data *X, const double *x, int n, int d,
+                    size_t rs, size_t cs, const double *center);
+static void direct_tile(const dist_data *X, const dist_data *Y, int i0,
+                        int j0, int m, int n, double *tile, double *yt);
+static void gemm_tile(const dist_data *X, const dist_data *Y, int i0,
+                      int j0, int m, int n, double *tile);
+
+
+void dist_center(const double *x, int n, int d, double *center)
+{
+    /* column means of the n by d sample x in row order */
+    int i, k;
+    for (k=0; k<d; k++)
+        center[k] = 0.0;
+    for (i=0; i<n; i++)
+        for (k=0; k<d; k++)
+            center[k] += x[(size_t) i*d + k];
+    for (k=0; k<d; k++)
+        center[k] /= (double) n;
+}
+
+void dist_prepare(dist_data *X, const double *x, int n, int d,
+                  const double *center)
+{
+    /*
+       x is an n by d sample in row order
+       center is used by the GEMM formulation: two samples passed to
+       dist_tiles must be prepared with the same center
+       (NULL: use the column means of x)
+    */
+    prepare(X, x, n, d, (size_t) d, 1, center);
+}
+
+void dist_prepare_cols(dist_data *X, const double *x, int n, int d,
+                       const double *center)
+{
+    /*
+       dist_prepare for an n by d sample in column order (an R matrix
+       or vector), which is read in place; center as in dist_prepare
+    */
+    prepare(X, x, n, d, 1, (size_t) n, center);
+}
+
+static void prepare(dist_data *X, const double *x, int n, int d,
+                    size_t rs, size_t cs, const double *center)
+{
+    /* x_ik is x[i*rs + k*cs]; the GEMM copy xc is in row order */
+    int i, k;
+    double *c, *xi, s;
+
+    X->n = n;
+    X->d = d;
+    X->x = x;
+    X->rs = rs;
+    X->cs = cs;
+    X->xc = NULL;
+    X->norm2 = NULL;
+    X->owner = TRUE;
+    if (d < DIST_GEMM_DIM || n < 1) return;
+
+    c = Calloc(d, double);
+    if (center == NULL) {
+        for (k=0; k<d; k++) {
+            s = 0.0;
+            for (i=0; i<n; i++)
+                s += x[i*rs + k*cs];
+            c[k] = s / (double) n;
+        }
+    } else {
+        for (k=0; k<d; k++) c[k] = center[k];
+    }
+    X->xc = Calloc((size_t) n*d, double);
+    X->norm2 = Calloc(n, double);
+    prof_alloc(((size_t) n*d + n) * sizeof(double));
+    for (i=0; i<n; i++) {
+        xi = X->xc + (size_t) i*d;
+        s = 0.0;
+        for (k=0; k<d; k++) {
+            xi[k] = x[i*rs + k*cs] - c[k];
+            s += xi[k]*xi[k];
+        }
+        X->norm2[i] = s;
+    }
+    Free(c);
+}
+
+void dist_attach(dist_data *X, const double *x, int n, int d,
+                 double *norm2)
+{
+    /*
+       as dist_prepare for a sample x that is already centered (or
+       nearly), without allocation, so that it can be called from any
+       thread: the GEMM formulation uses x itself and the squared
+       norms are stored in norm2 (length n, not used if d < DIST_GEMM_DIM)
+    */
+    int i, k;
+    double s;
+    const double *xi;
+
+    X->n = n;
+    X->d = d;
+    X->x = x;
+    X->rs = (size_t) d;
+    X->cs = 1;
+    X->xc = NULL;
+    X->norm2 = NULL;
+    X->owner = FALSE;
+    if (d < DIST_GEMM_DIM) return;
+
+    X->xc = (double *) x;
+    X->norm2 = norm2;
+    for (i=0; i<n; i++) {
+        xi = x + (size_t) i*d;
+        s = 0.0;
+        for (k=0; k<d; k++)
+            s += xi[k]*xi[k];
+        norm2[i] = s;
+    }
+}
+
+void dist_attach_cols(dist_data *X, const double *x, int n, int d)
+{
+    /*
+       as dist_prepare_cols without the centered copy of the GEMM
+       formulation: the tiles are computed directly for any d, so the
+       memory is O(n + d) at the cost of not using dgemm for large d
+    */
+    X->n = n;
+    X->d = d;
+    X->x = x;
+    X->rs = 1;
+    X->cs = (size_t) n;
+    X->xc = NULL;
+    X->norm2 = NULL;
+    X->owner = FALSE;
+}
+
+void dist_view(dist_data *V, const dist_data *X, int i0, int m)
+{
+    /* V refers to rows i0, ..., i0+m-1 of X (no copy) */
+    int d = X->d;
+    V->n = m;
+    V->d = d;
+    V->x = X->x + (size_t) i0*X->rs;
+    V->rs = X->rs;
+    V->cs = X->cs;
+    V->xc = (X->xc == NULL) ? NULL : X->xc + (size_t) i0*d;
+    V->norm2 = (X->norm2 == NULL) ? NULL : X->norm2 + i0;
+    V->owner = FALSE;
+}
+
+void dist_release(dist_data *X)
+{
+    if (X->owner) {
+        if (X->xc != NULL) Free(X->xc);
+        if (X->norm2 != NULL) Free(X->norm2);
+    }
+    X->xc = NULL;
+    X->norm2 = NULL;
+}
+
+int dist_worksize(int d)
+{
+    return DIST_TILE * DIST_TILE + DIST_TILE * d;
+}
+
+void dist_power(double *v, size_t len, double index, int squared)
+{
+    /*
+       v[k] = v[k]^index for distances, or v[k]^(index/2) for squared
+       distances, k < len; closed forms for the exponents 1/4, 1/2,
+       3/4, 1, 3/2 and 2 of v, pow otherwise
+    */
+    size_t k;
+    double h = squared ? 0.5 * index : index, r;
+
+    if (h == 1.0) {
+        return;
+    } else if (h == 0.5) {
+        for (k=0; k<len; k++)
+            v[k] = sqrt(v[k]);
+    } else if (h == 0.25) {
+        for (k=0; k<len; k++)
+            v[k] = sqrt(sqrt(v[k]));
+    } else if (h == 0.75) {
+        for (k=0; k<len; k++) {
+            r = sqrt(v[k]);
+            v[k] = r * sqrt(r);
+        }
+    } else if (h == 1.5) {
+        for (k=0; k<len; k++)
+            v[k] = v[k] * sqrt(v[k]);
+    } else if (h == 2.0) {
+        for (k=0; k<len; k++)
+            v[k] = v[k] * v[k];
+    } else {
+        for (k=0; k<len; k++)
+            v[k] = pow(v[k], h);
+    }
+}
+
+void dist_block(const dist_data *X, const dist_data *Y, int i0, int j0,
+                int m, int n, int squared, double *work)
+{
+    /*
+       one tile: work[i*DIST_TILE + j] = |x_(i0+i) - y_(j0+j)|,
+       i < m, j < n, m and n at most DIST_TILE
+       work: scratch of length dist_worksize(d)
+    */
+    dist_pblock(X, Y, i0, j0, m, n, squared ? 2.0 : 1.0, work);
+}
+
+void dist_pblock(const dist_data *X, const dist_data *Y, int i0, int j0,
+                 int m, int n, double index, double *work)
+{
+    /* dist_block for |x_(i0+i) - y_(j0+j)|^index */
+    int    i;
+    double *tile = work, *yt = work + DIST_TILE * DIST_TILE;
+
+    if (X->xc != NULL && Y->xc != NULL)
+        gemm_tile(X, Y, i0, j0, m, n, tile);
+    else
+        direct_tile(X, Y, i0, j0, m, n, tile, yt);
+    if (index != 2.0)
+        for (i=0; i<m; i++)
+            dist_power(tile + (size_t) i*DIST_TILE, n, index, TRUE);
+}
+
+void dist_tiles(const dist_data *X, const dist_data *Y, int squared,
+                dist_sink sink, void *ctx, double *work)
+{
+    /*
+       distances between rows of X and rows of Y, by tiles
+       if Y == X only the tiles on or below the diagonal are computed
+       (the sink receives the whole diagonal tile)
+       work: scratch of length dist_worksize(d), or NULL to allocate
+       (pass work from threads other than the main thread)
+    */
+    dist_ptiles(X, Y, squared ? 2.0 : 1.0, sink, ctx, work);
+}
+
+void dist_ptiles(const dist_data *X, const dist_data *Y, double index,
+                 dist_sink sink, void *ctx, double *work)
+{
+    /* dist_tiles for the distances to the power index */
+    int    i0, j0, m, n;
+    int    symmetric = (X == Y);
+    double *buf = work, t0 = prof_start();
+
+    if (buf == NULL)
+        buf = Calloc(dist_worksize(X->d), double);
+
+    for (i0=0; i0<X->n; i0+=DIST_TILE) {
+        m = X->n - i0;
+        if (m > DIST_TILE) m = DIST_TILE;
+        for (j0=0; j0<Y->n; j0+=DIST_TILE) {
+            if (symmetric && j0 > i0) break;
+            n = Y->n - j0;
+            if (n > DIST_TILE) n = DIST_TILE;
+            dist_pblock(X, Y, i0, j0, m, n, index, buf);
+            sink(i0, j0, m, n, buf, DIST_TILE, ctx);
+        }
+    }
+    if (work == NULL)
+        Free(buf);
+    prof_stop(PROF_DISTANCE, t0);
+}
+
+static void direct_tile(const dist_data *X, const dist_data *Y, int i0,
+                        int j0, int m, int n, double *tile, double *yt)
+{
+    /*
+       squared distances, y tile transposed into yt (d by n), read
+       by rows (row order) or by columns (column order)
+    */
+    int i, j, k, d = X->d;
+    size_t xrs = X->rs, xcs = X->cs, yrs = Y->rs, ycs = Y->cs;
+    const double *x = X->x + (size_t) i0*xrs, *y = Y->x + (size_t) j0*yrs;
+    double xik, dif, *ti, *ytk;
+
+    if (ycs == 1) {
+        for (j=0; j<n; j++)
+            for (k=0; k<d; k++)
+                yt[k*DIST_TILE + j] = y[j*yrs + k];
+    } else {
+        for (k=0; k<d; k++)
+            for (j=0; j<n; j++)
+                yt[k*DIST_TILE + j] = y[j*yrs + k*ycs];
+    }
+    for (i=0; i<m; i++) {
+        ti = tile + (size_t) i*DIST_TILE;
+        for (j=0; j<n; j++)
+            ti[j] = 0.0;
+        for (k=0; k<d; k++) {
+            xik = x[i*xrs + k*xcs];
+            ytk = yt + k*DIST_TILE;
+            for (j=0; j<n; j++) {
+                dif = xik - ytk[j];
+                ti[j] += dif*dif;
+            }
+        }
+    }
+}
+
+static void gemm_tile(const dist_data *X, const dist_data *Y, int i0,
+                      int j0, int m, int n, double *tile)
+{
+    /*
+       squared distances from norms and inner products
+       in column-major terms tile is the n by m matrix Yc^T Xc
+       (leading dimension DIST_TILE), i.e. tile[i*DIST_TILE + j] = <x_i, y_j>
+    */
+    int    i, j, k, d = X->d, ld = DIST_TILE;
+    double one = 1.0, zero = 0.0, nx, d2, dif, *ti;
+    const double *xi, *yj;
+
+    F77_CALL(dgemm)("T", "N", &n, &m, &d, &one, Y->xc + (size_t) j0*d, &d,
+                    X->xc + (size_t) i0*d, &d, &zero, tile, &ld FCONE FCONE);
+
+    for (i=0; i<m; i++) {
+        ti = tile + (size_t) i*DIST_TILE;
+        nx = X->norm2[i0 + i];
+        for (j=0; j<n; j++) {
+            d2 = nx + Y->norm2[j0 + j] - 2.0*ti[j];
+            if (d2 <= DIST_CANCEL * (nx + Y->norm2[j0 + j])) {
+                /* cancellation: recompute directly */
+                xi = X->xc + (size_t) (i0 + i)*d;
+                yj = Y->xc + (size_t) (j0 + j)*d;
+                d2 = 0.0;
+                for (k=0; k<d; k++) {
+                    dif = xi[k] - yj[k];
+                    d2 += dif*dif;
+                }
+            }
+            ti[j] = d2;
+        }
+    }
+}
+
+
+/* sinks for the convenience functions below */
+
+typedef struct {
+    double *D;
+    int    n;
+} square_ctx;
+
+static void square_sink(int i0, int j0, int m, int n, const double *tile,
+                        int ld, void *ctx)
+{
+    /* store the tile and its transpose in a symmetric n by n matrix */
+    square_ctx *s = (square_ctx *) ctx;
+    int i, j, I, J;
+    for (i=0; i<m; i++) {
+        I = i0 + i;
+        for (j=0; j<n; j++) {
+            J = j0 + j;
+            if (J > I) break;
+            s->D[(size_t) I*s->n + J] = s->D[(size_t) J*s->n + I] =
+                (I == J) ? 0.0 : tile[(size_t) i*ld + j];
+        }
+    }
+}
+
+static void row_sink(int i0, int j0, int m, int n, const double *tile,
+                     int ld, void *ctx)
+{
+    double *row = (double *) ctx;
+    int j;
+    for (j=0; j<n; j++)
+        row[j0 + j] = tile[j];
+}
+
+typedef struct {
+    double sum;
+    int    symmetric;
+} sum_ctx;
+
+static void sum_sink(int i0, int j0, int m, int n, const double *tile,
+                     int ld, void *ctx)
+{
+    sum_ctx *s = (sum_ctx *) ctx;
+    int i, j, nj;
+    double tsum = 0.0;
+    for (i=0; i<m; i++) {
+        nj = n;
+        if (s->symmetric && i0 == j0) nj = i;   /* j < i on the diagonal */
+        for (j=0; j<nj; j++)
+            tsum += tile[(size_t) i*ld + j];
+    }
+    s->sum += tsum;
+}
+
+void dist_square(const double *x, int n, int d, double *D)
+{
+    /* D is the n by n distance matrix of the rows of x (row order) */
+    dist_data X;
+    square_ctx s;
+    s.D = D;
+    s.n = n;
+    dist_prepare(&X, x, n, d, NULL);
+    dist_tiles(&X, &X, FALSE, square_sink, &s, NULL);
+    dist_release(&X);
+}
+
+void dist_row(const dist_data *X, int i, double *row, double *work)
+{
+    /* row[j] = |x_i - x_j|, j = 0, ..., n-1 */
+    dist_data V;
+    dist_view(&V, X, i, 1);
+    dist_tiles(&V, X, FALSE, row_sink, row, work);
+    row[i] = 0.0;
+}
+
+double dist_sum(const dist_data *X, const dist_data *Y)
+{
+    /*
+       if Y == X, the sum of |x_i - x_j| over i > j,
+       otherwise the sum of |x_i - y_j| over all i, j
+    */
+    return dist_wsum(X, Y, NULL);
+}
+
+double dist_wsum(const dist_data *X, const dist_data *Y, double *work)
+{
+    /* dist_sum, work as in dist_tiles */
+    sum_ctx s;
+    s.sum = 0.0;
+    s.symmetric = (X == Y);
+    dist_tiles(X, Y, FALSE, sum_sink, &s, work);
+    return s.sum;
+}
+
+double dist_psum(const dist_data *X, const dist_data *Y, double index,
+                 int nthreads)
+{
+    /*
+       as dist_sum for the distances |x_i - y_j|^index
+       the tile rows of X are summed by nthreads threads and the row
+       sums are added in order, so the result does not depend on the
+       number of threads
+    */
+    int    t, ntiles = (X->n + DIST_TILE - 1) / DIST_TILE;
+    int    ws = dist_worksize(X->d), symmetric = (X == Y);
+    double *rowsums, *works, sum = 0.0, t0;
+
+    if (ntiles == 0 || Y->n == 0) return 0.0;
+    if (nthreads < 1) nthreads = 1;
+    t0 = prof_start();
+    rowsums = Calloc(ntiles, double);
+    works = Calloc((size_t) nthreads * ws, double);
+
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(nthreads) schedule(dynamic) \
+        if (ntiles > 1)
+#endif
+    for (t=0; t<ntiles; t++) {
+        int    i, j, i0 = t * DIST_TILE, j0, m, n, nj, tid = 0;
+        double *tile, *ti, s = 0.0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        tile = works + (size_t) tid * ws;
+        m = X->n - i0;
+        if (m > DIST_TILE) m = DIST_TILE;
+        for (j0=0; j0<Y->n; j0+=DIST_TILE) {
+            if (symmetric && j0 > i0) break;
+            n = Y->n - j0;
+            if (n > DIST_TILE) n = DIST_TILE;
+            dist_pblock(X, Y, i0, j0, m, n, index, tile);
+            for (i=0; i<m; i++) {
+                ti = tile + (size_t) i * DIST_TILE;
+                nj = (symmetric && i0 == j0) ? i : n;  /* j < i */
+                for (j=0; j<nj; j++)
+                    s += ti[j];
+            }
+        }
+        rowsums[t] = s;
+    }
+    for (t=0; t<ntiles; t++)
+        sum += rowsums[t];
+    Free(rowsums);
+    Free(works);
+    prof_stop(PROF_DISTANCE, t0);
+    return sum;
+}
@@ -0,0 +1,68 @@
+/*
+   distance.h: blocked Euclidean distance kernel (see distance.c)
+*/
+
+#ifndef ENERGY_DISTANCE_H
+#define ENERGY_DISTANCE_H
+
+#include <stddef.h>
+
+/* tile size (rows and columns) of the distance kernel */
+#define DIST_TILE 128
+
+/* use the norm plus inner product (GEMM) formulation if d >= DIST_GEMM_DIM */
+#define DIST_GEMM_DIM 32
+
+typedef struct {
+    int    n, d;
+    const double *x;    /* n by d data: x_ik is x[i*rs + k*cs] */
+    size_t rs, cs;      /* row order (d, 1), or an R matrix (1, ld) */
+    double *xc;         /* centered copy for the GEMM formulation, or NULL */
+    double *norm2;      /* squared norms of the rows of xc, or NULL */
+    int    owner;       /* TRUE if xc and norm2 are owned (not a view) */
+} dist_data;
+
+/*
+   a tile of distances: tile[i*ld + j] = |x_(i0+i) - y_(j0+j)|,
+   i < m, j < n (squared distances if requested)
+*/
+typedef void (*dist_sink)(int i0, int j0, int m, int n,
+                          const double *tile, int ld, void *ctx);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void   dist_center(const double *x, int n, int d, double *center);
+void   dist_prepare(dist_data *X, const double *x, int n, int d,
+                    const double *center);
+void   dist_prepare_cols(dist_data *X, const double *x, int n, int d,
+                         const double *center);
+void   dist_attach(dist_data *X, const double *x, int n, int d,
+                   double *norm2);
+void   dist_attach_cols(dist_data *X, const double *x, int n, int d);
+void   dist_view(dist_data *V, const dist_data *X, int i0, int m);
+void   dist_release(dist_data *X);
+int    dist_worksize(int d);
+void   dist_block(const dist_data *X, const dist_data *Y, int i0, int j0,
+                  int m, int n, int squared, double *work);
+void   dist_pblock(const dist_data *X, const dist_data *Y, int i0, int j0,
+                   int m, int n, double index, double *work);
+void   dist_tiles(const dist_data *X, const dist_data *Y, int squared,
+                  dist_sink sink, void *ctx, double *work);
+void   dist_ptiles(const dist_data *X, const dist_data *Y, double index,
+                   dist_sink sink, void *ctx, double *work);
+void   dist_power(double *v, size_t len, double index, int squared);
+
+void   dist_square(const double *x, int n, int d, double *D);
+void   dist_row(const dist_data *X, int i, double *row, double *work);
+double dist_sum(const dist_data *X, const dist_data *Y);
+double dist_wsum(const dist_data *X, const dist_data *Y, double *work);
+double dist_psum(const dist_data *X, const dist_data *Y, double index,
+                 int nthreads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
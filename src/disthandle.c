@@ -0,0 +1,362 @@
+/*
+   disthandle.c: distance handles for the energy package
+
+   A distance handle (R function energy.dist) holds the packed distance
+   matrix |x_i - x_j|^index of one sample in an external pointer, so
+   that several analyses of the same sample compute the distances once.
+   The row sums, the double centered matrix (dcov, dcor, dcov.test) and
+   the U-centered matrix (dcovU, dcorU, bcdcor) are computed when first
+   needed and kept with the handle.
+
+   energy_dist_new      .Call: create a handle from data or distances
+   energy_dist_info     .Call: n, index, sum of distances, cached forms
+   energy_dist_matrix   .Call: the n by n distance matrix
+   energy_dist_dcov     .Call: dCov statistics and permutation test
+   energy_dist_dcovU    .Call: unbiased dCov^2 statistics
+   energy_dist_ksample  .Call: k-sample E statistic and test
+   energy_dist_disco    .Call: distance components and tests (disco)
+
+   dist_handle_get      the handle of an external pointer (or error)
+   dist_handle_ptr      the handle of an external pointer, or NULL
+   dist_handle_rowsums  row sums of D
+   dist_handle_dcenter  double centered D (Akl in dcov.c)
+   dist_handle_ucenter  U-centered D
+
+   An external pointer is not saved with the R object: after load()
+   or readRDS() the handle is invalid and must be created again.
+*/
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rmath.h>
+#include <string.h>
+#include "disthandle.h"
+
+SEXP energy_dist_new(SEXP x, SEXP dims, SEXP index);
+SEXP energy_dist_info(SEXP h);
+SEXP energy_dist_matrix(SEXP h);
+SEXP energy_dist_dcov(SEXP hx, SEXP hy, SEXP R);
+SEXP energy_dist_dcovU(SEXP hx, SEXP hy);
+SEXP energy_dist_ksample(SEXP h, SEXP sizes, SEXP R, SEXP U);
+SEXP energy_dist_disco(SEXP h, SEXP trt, SEXP nlevels, SEXP R,
+                       SEXP between);
+
+static void dist_handle_free(dist_handle *H);
+static void dist_handle_finalize(SEXP h);
+static dist_handle *dist_handle_pair(SEXP hx, SEXP hy, dist_handle **Hy);
+
+/* dcov.c, energy.c, disco.c */
+extern double Akl(packed_matrix *akl, packed_matrix *A);
+extern void   dcov_packed(packed_matrix *A, packed_matrix *B, int R,
+                          double *reps, double *DCOV, double *pval);
+extern void   ksample_packed(packed_matrix *D, int nsamples, int *sizes,
+                             int R, int unbiased, double *e0, double *e,
+                             double *pval);
+extern void   disco_packed(packed_matrix *D, int nfactors, const int *trt,
+                           const int *nlevels, int R, int between,
+                           double *stats, double *reps);
+
+
+SEXP energy_dist_new(SEXP x, SEXP dims, SEXP index)
+{
+    /*
+       x     data or distances, as double
+       dims  c(n, d, type):
+             type 0: x is the n by d data, an R matrix (column order)
+             type 1: x is a dist object (lower triangle by columns)
+             type 2: x is an n by n distance matrix
+             read in place (see packed_sample_distance, utilities.c)
+       index exponent on distance
+    */
+    int    n, d, type;
+    dist_handle *H;
+    SEXP   h;
+
+    n = INTEGER(dims)[0];
+    d = INTEGER(dims)[1];
+    type = INTEGER(dims)[2];
+    if (!sample_finite(REAL(x), XLENGTH(x)))
+        error("Data contains missing or infinite values");
+
+    H = Calloc(1, dist_handle);
+    H->index = asReal(index);
+    H->rowsums = NULL;
+    H->A = NULL;
+    H->U = NULL;
+    H->D = alloc_packed(n);
+    packed_sample_distance(REAL(x), d, type, H->index, H->D);
+
+    PROTECT(h = R_MakeExternalPtr(H, install("energy.dist"), R_NilValue));
+    R_RegisterCFinalizerEx(h, dist_handle_finalize, TRUE);
+    UNPROTECT(1);
+    return h;
+}
+
+dist_handle *dist_handle_get(SEXP h)
+{
+    dist_handle *H;
+    if (TYPEOF(h) != EXTPTRSXP)
+        error("not an energy.dist handle");
+    H = (dist_handle *) R_ExternalPtrAddr(h);
+    if (H == NULL)
+        error("energy.dist handle is not valid (saved and restored?): "
+              "create it again with energy.dist");
+    return H;
+}
+
+dist_handle *dist_handle_ptr(SEXP h)
+{
+    /*
+       as dist_handle_get, but NULL instead of an error, for the C++
+       callers, which must not longjmp past destructors (Rcpp::stop)
+    */
+    if (TYPEOF(h) != EXTPTRSXP)
+        return NULL;
+    return (dist_handle *) R_ExternalPtrAddr(h);
+}
+
+const double *dist_handle_rowsums(dist_handle *H)
+{
+    int i, n = H->D->n;
+    if (H->rowsums == NULL) {
+        H->rowsums = Calloc(n, double);
+        packed_rowsums(H->D, H->rowsums);
+        H->total = 0.0;
+        for (i=0; i<n; i++)
+            H->total += H->rowsums[i];
+    }
+    return H->rowsums;
+}
+
+packed_matrix *dist_handle_dcenter(dist_handle *H)
+{
+    if (H->A == NULL) {
+        H->A = alloc_packed(H->D->n);
+        Akl(H->D, H->A);
+    }
+    return H->A;
+}
+
+packed_matrix *dist_handle_ucenter(dist_handle *H)
+{
+    /*
+       U-centered D (see U_center in centering.cpp):
+       d_ij - d_i./(n-2) - d_.j/(n-2) + d_../((n-1)(n-2)), zero diagonal
+    */
+    int    i, j, n = H->D->n;
+    double *m, M, *Di, *Ui;
+    const double *r;
+
+    if (H->U == NULL) {
+        if (n < 4)
+            error("U-centering requires sample size n > 3");
+        r = dist_handle_rowsums(H);
+        m = Calloc(n, double);
+        for (i=0; i<n; i++)
+            m[i] = r[i] / (double) (n-2);
+        M = H->total / (((double) (n-1)) * (n-2));
+        H->U = alloc_packed(n);
+        for (i=0; i<n; i++) {
+            Di = H->D->x + PACKED_OFFSET(i);
+            Ui = H->U->x + PACKED_OFFSET(i);
+            for (j=0; j<i; j++)
+                Ui[j] = Di[j] - m[j] - m[i] + M;
+            Ui[i] = 0.0;
+        }
+        Free(m);
+    }
+    return H->U;
+}
+
+static void dist_handle_free(dist_handle *H)
+{
+    free_packed(H->D);
+    if (H->rowsums != NULL) Free(H->rowsums);
+    if (H->A != NULL) free_packed(H->A);
+    if (H->U != NULL) free_packed(H->U);
+    Free(H);
+}
+
+static void dist_handle_finalize(SEXP h)
+{
+    dist_handle *H = (dist_handle *) R_ExternalPtrAddr(h);
+    if (H != NULL) {
+        dist_handle_free(H);
+        R_ClearExternalPtr(h);
+    }
+}
+
+static dist_handle *dist_handle_pair(SEXP hx, SEXP hy, dist_handle **Hy)
+{
+    dist_handle *Hx = dist_handle_get(hx);
+    *Hy = dist_handle_get(hy);
+    if (Hx->D->n != (*Hy)->D->n)
+        error("Sample sizes must agree");
+    return Hx;
+}
+
+
+SEXP energy_dist_info(SEXP h)
+{
+    /* c(n, index, sum of distances, A cached, U-centered cached) */
+    dist_handle *H = dist_handle_get(h);
+    SEXP   info;
+    double *v;
+
+    dist_handle_rowsums(H);
+    PROTECT(info = allocVector(REALSXP, 5));
+    v = REAL(info);
+    v[0] = (double) H->D->n;
+    v[1] = H->index;
+    v[2] = H->total;
+    v[3] = (double) (H->A != NULL);
+    v[4] = (double) (H->U != NULL);
+    UNPROTECT(1);
+    return info;
+}
+
+SEXP energy_dist_matrix(SEXP h)
+{
+    dist_handle *H = dist_handle_get(h);
+    int    i, j, n = H->D->n;
+    double *Di, *pm;
+    SEXP   m;
+
+    PROTECT(m = allocMatrix(REALSXP, n, n));
+    pm = REAL(m);
+    for (i=0; i<n; i++) {
+        Di = H->D->x + PACKED_OFFSET(i);
+        for (j=0; j<=i; j++)
+            pm[(size_t) j*n + i] = pm[(size_t) i*n + j] = Di[j];
+    }
+    UNPROTECT(1);
+    return m;
+}
+
+SEXP energy_dist_dcov(SEXP hx, SEXP hy, SEXP R)
+{
+    /* list(DCOV = c(dCov, dCor, dVar(x), dVar(y)), reps, pval) as dCOVtest */
+    dist_handle *Hx, *Hy;
+    int    nR = asInteger(R);
+    double pval = 1.0;
+    SEXP   DCOV, reps, ans, nms;
+
+    Hx = dist_handle_pair(hx, hy, &Hy);
+    if (nR < 0) nR = 0;
+    PROTECT(DCOV = allocVector(REALSXP, 4));
+    PROTECT(reps = allocVector(REALSXP, nR));
+    if (nR > 0)
+        memset(REAL(reps), 0, (size_t) nR * sizeof(double));
+    dcov_packed(dist_handle_dcenter(Hx), dist_handle_dcenter(Hy), nR,
+                REAL(reps), REAL(DCOV), &pval);
+
+    PROTECT(ans = allocVector(VECSXP, 3));
+    PROTECT(nms = allocVector(STRSXP, 3));
+    SET_VECTOR_ELT(ans, 0, DCOV);
+    SET_VECTOR_ELT(ans, 1, reps);
+    SET_VECTOR_ELT(ans, 2, ScalarReal(pval));
+    SET_STRING_ELT(nms, 0, mkChar("DCOV"));
+    SET_STRING_ELT(nms, 1, mkChar("reps"));
+    SET_STRING_ELT(nms, 2, mkChar("pval"));
+    setAttrib(ans, R_NamesSymbol, nms);
+    UNPROTECT(4);
+    return ans;
+}
+
+SEXP energy_dist_dcovU(SEXP hx, SEXP hy)
+{
+    /* c(dCovU, bcdcor, dVarXU, dVarYU) as dcovU_stats */
+    dist_handle *Hx, *Hy;
+    packed_matrix *A, *B;
+    int    i, j, n;
+    double *Ai, *Bi, ab, aa, bb, sab, saa, sbb, V, *v;
+    SEXP   ans;
+
+    Hx = dist_handle_pair(hx, hy, &Hy);
+    A = dist_handle_ucenter(Hx);
+    B = dist_handle_ucenter(Hy);
+    n = A->n;
+    sab = saa = sbb = 0.0;
+    for (i=1; i<n; i++) {
+        Ai = A->x + PACKED_OFFSET(i);
+        Bi = B->x + PACKED_OFFSET(i);
+        ab = aa = bb = 0.0;
+        for (j=0; j<i; j++) {
+            ab += Ai[j]*Bi[j];
+            aa += Ai[j]*Ai[j];
+            bb += Bi[j]*Bi[j];
+        }
+        sab += ab;
+        saa += aa;
+        sbb += bb;
+    }
+    PROTECT(ans = allocVector(REALSXP, 4));
+    v = REAL(ans);
+    v[0] = 2.0 * sab / ((double) n * (n-3));
+    v[2] = 2.0 * saa / ((double) n * (n-3));
+    v[3] = 2.0 * sbb / ((double) n * (n-3));
+    V = v[2] * v[3];
+    v[1] = (V > DBL_EPSILON) ? v[0] / sqrt(V) : 0.0;
+    UNPROTECT(1);
+    return ans;
+}
+
+SEXP energy_dist_ksample(SEXP h, SEXP sizes, SEXP R, SEXP U)
+{
+    /* list(e0, e, pval) as ksampleEtest */
+    dist_handle *H = dist_handle_get(h);
+    int    k, N = 0, K = length(sizes), nR = asInteger(R);
+    double e0 = 0.0, pval = 1.0;
+    SEXP   e, ans, nms;
+
+    for (k=0; k<K; k++)
+        N += INTEGER(sizes)[k];
+    if (N != H->D->n)
+        error("sum(sizes) should equal the sample size of the handle");
+    if (nR < 0) nR = 0;
+    PROTECT(e = allocVector(REALSXP, nR));
+    ksample_packed(H->D, K, INTEGER(sizes), nR, asInteger(U), &e0,
+                   REAL(e), &pval);
+
+    PROTECT(ans = allocVector(VECSXP, 3));
+    PROTECT(nms = allocVector(STRSXP, 3));
+    SET_VECTOR_ELT(ans, 0, ScalarReal(e0));
+    SET_VECTOR_ELT(ans, 1, e);
+    SET_VECTOR_ELT(ans, 2, ScalarReal(pval));
+    SET_STRING_ELT(nms, 0, mkChar("e0"));
+    SET_STRING_ELT(nms, 1, mkChar("e"));
+    SET_STRING_ELT(nms, 2, mkChar("pval"));
+    setAttrib(ans, R_NamesSymbol, nms);
+    UNPROTECT(3);
+    return ans;
+}
+
+SEXP energy_dist_disco(SEXP h, SEXP trt, SEXP nlevels, SEXP R,
+                       SEXP between)
+{
+    /*
+       list(stats, reps) as disco_packed (disco.c)
+       trt  N by nfactors integer matrix of labels 0:(nlevels[j]-1)
+    */
+    dist_handle *H = dist_handle_get(h);
+    int    nfactors = length(nlevels), nR = asInteger(R);
+    SEXP   stats, reps, ans, nms;
+
+    if (nrows(trt) != H->D->n)
+        error("number of labels should equal the sample size of the handle");
+    if (nR < 0) nR = 0;
+    PROTECT(stats = allocMatrix(REALSXP, nfactors, 6));
+    PROTECT(reps = allocMatrix(REALSXP, nR, nfactors));
+    disco_packed(H->D, nfactors, INTEGER(trt), INTEGER(nlevels), nR,
+                 asLogical(between), REAL(stats), REAL(reps));
+
+    PROTECT(ans = allocVector(VECSXP, 2));
+    PROTECT(nms = allocVector(STRSXP, 2));
+    SET_VECTOR_ELT(ans, 0, stats);
+    SET_VECTOR_ELT(ans, 1, reps);
+    SET_STRING_ELT(nms, 0, mkChar("stats"));
+    SET_STRING_ELT(nms, 1, mkChar("reps"));
+    setAttrib(ans, R_NamesSymbol, nms);
+    UNPROTECT(4);
+    return ans;
+}
@@ -0,0 +1,34 @@
+/*
+   disthandle.h: distance handles (see disthandle.c)
+*/
+
+#ifndef ENERGY_DISTHANDLE_H
+#define ENERGY_DISTHANDLE_H
+
+#include <Rinternals.h>
+#include "utilities.h"
+
+typedef struct {
+    packed_matrix *D;   /* distances |x_i - x_j|^index */
+    double index;
+    double *rowsums;    /* row sums of D, or NULL until needed */
+    double total;       /* sum of all n^2 entries of D */
+    packed_matrix *A;   /* double centered D, or NULL until needed */
+    packed_matrix *U;   /* U-centered D, or NULL until needed */
+} dist_handle;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+dist_handle   *dist_handle_get(SEXP h);
+dist_handle   *dist_handle_ptr(SEXP h);
+const double  *dist_handle_rowsums(dist_handle *H);
+packed_matrix *dist_handle_dcenter(dist_handle *H);
+packed_matrix *dist_handle_ucenter(dist_handle *H);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,341 @@
+/*
+   edist-file.c: two-sample energy distance of samples stored in files
+
+   The samples are binary files of doubles (native byte order), written
+   for example by writeBin(as.double(t(x)), f) (rows layout: one row
+   after another) or writeBin(as.double(x), f) (columns layout: one
+   column after another).  The files are memory mapped and read in
+   blocks of rows, so the samples are never in memory as a whole; the
+   sums of distances within and between the samples are exact.
+
+   For each pair of blocks the sum of distances is computed by
+   dist_psum (distance.c), tile rows in parallel.  Before a pair is
+   computed the pages of the next block are requested from the system
+   (madvise WILLNEED), so that reading the next block from disk
+   overlaps with the computation on the current pair.  Without mmap
+   (Windows) the blocks are read with fread, without overlap.
+
+   For distance kernels in the GEMM formulation (d >= DIST_GEMM_DIM)
+   all blocks are centered at the column means of the first block of x.
+
+   The sums run under R_ExecWithCleanup with all the resources in one
+   edist_job, so that the mappings, buffers and prepared blocks are
+   released if the user interrupts a long run or a read fails.
+
+   energy_edist_file  .Call: e-distance and the three sums of distances
+*/
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rmath.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "distance.h"
+#include "permutation.h"
+
+typedef struct {
+    int    n, d, columns;  /* rows, dimension, TRUE if columns layout */
+    const double *map;     /* the mapped file, or NULL */
+    size_t len;            /* length of the file in bytes */
+    FILE   *fp;            /* the file if it is not mapped */
+} block_source;
+
+typedef struct {
+    block_source X, Y;
+    int    block, nthreads, open;  /* open: sources to close, 0, 1 or 2 */
+    double index, *center, *bufx, *bufy, sums[3];
+    dist_data BX, BY;              /* the blocks being computed */
+} edist_job;
+
+SEXP energy_edist_file(SEXP files, SEXP dims, SEXP index);
+
+static int    source_open(block_source *S, const char *file, int d,
+                          int columns);
+static void   source_close(block_source *S);
+static const double *source_block(block_source *S, int r0, int m,
+                                  double *buf);
+static void   source_prefetch(block_source *S, int r0, int m);
+static double block_sums(edist_job *J, block_source *X, block_source *Y);
+static SEXP   edist_run(void *data);
+static void   edist_cleanup(void *data);
+
+
+static int source_open(block_source *S, const char *file, int d,
+                       int columns)
+{
+    /* returns 0, or 1 if the file cannot be read, 2 if its size is wrong */
+    size_t len;
+
+    S->d = d;
+    S->columns = columns;
+    S->map = NULL;
+    S->fp = NULL;
+    S->n = 0;
+#ifndef _WIN32
+    {
+        int fd;
+        struct stat st;
+        void *p;
+        fd = open(file, O_RDONLY);
+        if (fd < 0)
+            return 1;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return 1;
+        }
+        len = (size_t) st.st_size;
+        p = (len > 0) ? mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+        close(fd);
+        if (p == MAP_FAILED)
+            return 1;
+        S->map = (const double *) p;
+        if (p != NULL)
+            madvise(p, len, MADV_SEQUENTIAL);
+    }
+#else
+    S->fp = fopen(file, "rb");
+    if (S->fp == NULL)
+        return 1;
+    _fseeki64(S->fp, 0, SEEK_END);
+    len = (size_t) _ftelli64(S->fp);
+#endif
+    S->len = len;
+    if (len % ((size_t) d * sizeof(double)) != 0) {
+        source_close(S);
+        return 2;
+    }
+    S->n = (int) (len / ((size_t) d * sizeof(double)));
+    return 0;
+}
+
+static void source_close(block_source *S)
+{
+#ifndef _WIN32
+    if (S->map != NULL)
+        munmap((void *) S->map, S->len);
+#endif
+    if (S->fp != NULL)
+        fclose(S->fp);
+    S->map = NULL;
+    S->fp = NULL;
+}
+
+static const double *source_block(block_source *S, int r0, int m,
+                                  double *buf)
+{
+    /*
+       rows r0, ..., r0+m-1 in row order: a pointer into the mapped
+       file (rows layout), or copied into buf (length m d)
+    */
+    int    i, k, d = S->d;
+    size_t off;
+
+    if (S->map != NULL) {
+        if (!S->columns)
+            return S->map + (size_t) r0 * d;
+        for (k=0; k<d; k++) {
+            const double *col = S->map + (size_t) k * S->n + r0;
+            for (i=0; i<m; i++)
+                buf[(size_t) i*d + k] = col[i];
+        }
+        return buf;
+    }
+#ifdef _WIN32
+    if (!S->columns) {
+        off = (size_t) r0 * d * sizeof(double);
+        _fseeki64(S->fp, (__int64) off, SEEK_SET);
+        if (fread(buf, sizeof(double), (size_t) m * d, S->fp) !=
+            (size_t) m * d)
+            error("read error");
+    } else {
+        double *col = buf + (size_t) m * d;   /* buf has length 2 m d */
+        for (k=0; k<d; k++) {
+            off = ((size_t) k * S->n + r0) * sizeof(double);
+            _fseeki64(S->fp, (__int64) off, SEEK_SET);
+            if (fread(col, sizeof(double), m, S->fp) != (size_t) m)
+                error("read error");
+            for (i=0; i<m; i++)
+                buf[(size_t) i*d + k] = col[i];
+        }
+    }
+#else
+    (void) off;
+#endif
+    return buf;
+}
+
+static void source_prefetch(block_source *S, int r0, int m)
+{
+    /* ask the system to read rows r0, ..., r0+m-1 ahead */
+#ifndef _WIN32
+    int    k;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE), a, b;
+
+    if (m > S->n - r0) m = S->n - r0;
+    if (S->map == NULL || m <= 0) return;
+    for (k=0; k<(S->columns ? S->d : 1); k++) {
+        if (S->columns) {
+            a = ((size_t) k * S->n + r0) * sizeof(double);
+            b = a + (size_t) m * sizeof(double);
+        } else {
+            a = (size_t) r0 * S->d * sizeof(double);
+            b = a + (size_t) m * S->d * sizeof(double);
+        }
+        a -= a % page;
+        madvise((char *) S->map + a, b - a, MADV_WILLNEED);
+    }
+#endif
+}
+
+static double block_sums(edist_job *J, block_source *X, block_source *Y)
+{
+    /*
+       if Y == X, the sum of |x_i - x_j|^index over i > j,
+       otherwise the sum of |x_i - y_j|^index over all i, j
+       by pairs of blocks of rows; the blocks are prepared in J->BX,
+       J->BY, released by edist_cleanup if the loop is left by error
+    */
+    int    i0, j0, m, n, jn, in, d = X->d, same = (X == Y);
+    int    block = J->block, nthreads = J->nthreads;
+    double sum = 0.0, index = J->index;
+    const double *xb, *yb, *center = J->center;
+    dist_data *BX = &J->BX, *BY = &J->BY;
+
+    for (i0=0; i0<X->n; i0+=block) {
+        m = X->n - i0;
+        if (m > block) m = block;
+        xb = source_block(X, i0, m, J->bufx);
+        dist_prepare(BX, xb, m, d, center);
+        for (j0=0; j0<(same ? i0 + 1 : Y->n); j0+=block) {
+            n = Y->n - j0;
+            if (n > block) n = block;
+            /* the next block of y, or the first block for the next x */
+            jn = j0 + block;
+            in = i0;
+            if (jn >= (same ? i0 + 1 : Y->n)) {
+                jn = 0;
+                in = i0 + block;
+                if (in < X->n)
+                    source_prefetch(X, in, block);
+            }
+            source_prefetch(Y, jn, block);
+            if (same && j0 == i0) {
+                sum += dist_psum(BX, BX, index, nthreads);
+            } else {
+                yb = source_block(Y, j0, n, J->bufy);
+                dist_prepare(BY, yb, n, d, center);
+                sum += dist_psum(BX, BY, index, nthreads);
+                dist_release(BY);
+            }
+            R_CheckUserInterrupt();
+        }
+        dist_release(BX);
+    }
+    return sum;
+}
+
+static SEXP edist_run(void *data)
+{
+    /* the three sums of distances, run by R_ExecWithCleanup */
+    edist_job *J = (edist_job *) data;
+    int    b, d = J->X.d;
+    size_t len = (size_t) 2 * J->block * d;
+
+    J->bufx = Calloc(len, double);
+    J->bufy = Calloc(len, double);
+    if (d >= DIST_GEMM_DIM) {
+        /* common center: column means of the first block of x */
+        b = (J->X.n < J->block) ? J->X.n : J->block;
+        J->center = Calloc(d, double);
+        dist_center(source_block(&J->X, 0, b, J->bufx), b, d, J->center);
+    }
+    J->sums[0] = block_sums(J, &J->X, &J->Y);
+    J->sums[1] = block_sums(J, &J->X, &J->X);
+    J->sums[2] = block_sums(J, &J->Y, &J->Y);
+    return R_NilValue;
+}
+
+static void edist_cleanup(void *data)
+{
+    /* on exit from edist_run, normal or by error or interrupt */
+    edist_job *J = (edist_job *) data;
+    dist_release(&J->BX);
+    dist_release(&J->BY);
+    if (J->bufx != NULL) Free(J->bufx);
+    if (J->bufy != NULL) Free(J->bufy);
+    if (J->center != NULL) Free(J->center);
+    if (J->open > 1) source_close(&J->Y);
+    if (J->open > 0) source_close(&J->X);
+    J->open = 0;
+}
+
+
+SEXP energy_edist_file(SEXP files, SEXP dims, SEXP index)
+{
+    /*
+       files  c(x file, y file)
+       dims   c(d, columns, block): dimension, TRUE for the columns
+              layout, rows per block
+       index  exponent on distance
+       returns c(e-distance, sum xy, sum xx, sum yy, m, n) where the
+       within sums are over pairs i > j
+    */
+    int    d = INTEGER(dims)[0], columns = INTEGER(dims)[1], k, e;
+    double m, n, w, *v;
+    block_source *S;
+    edist_job J;
+    SEXP   ans;
+
+    J.block = INTEGER(dims)[2];
+    J.nthreads = num_threads();
+    J.index = asReal(index);
+    J.center = J.bufx = J.bufy = NULL;
+    J.BX.xc = J.BY.xc = NULL;
+    J.BX.norm2 = J.BY.norm2 = NULL;
+    J.BX.owner = J.BY.owner = FALSE;
+    J.open = 0;
+    for (k=0; k<2; k++) {
+        S = (k == 0) ? &J.X : &J.Y;
+        e = source_open(S, CHAR(STRING_ELT(files, k)), d, columns);
+        if (e == 0 && S->n < 1) {
+            source_close(S);
+            e = 3;
+        }
+        if (e != 0) {
+            if (k == 1) source_close(&J.X);
+            if (e == 1)
+                error("cannot map file '%s'", CHAR(STRING_ELT(files, k)));
+            if (e == 2)
+                error("size of file '%s' is not a multiple of %d doubles",
+                      CHAR(STRING_ELT(files, k)), d);
+            error("file '%s' is empty", CHAR(STRING_ELT(files, k)));
+        }
+        J.open = k + 1;
+    }
+    if (J.block > J.X.n && J.block > J.Y.n)
+        J.block = (J.X.n > J.Y.n) ? J.X.n : J.Y.n;
+
+    /* edist_cleanup closes the files and frees the buffers */
+    R_ExecWithCleanup(edist_run, &J, edist_cleanup, &J);
+    m = (double) J.X.n;
+    n = (double) J.Y.n;
+
+    w = m * n / (m + n);
+    PROTECT(ans = allocVector(REALSXP, 6));
+    v = REAL(ans);
+    v[0] = 2.0 * w * (J.sums[0] / (m * n) - J.sums[1] / (m * m) -
+                      J.sums[2] / (n * n));
+    v[1] = J.sums[0];
+    v[2] = J.sums[1];
+    v[3] = J.sums[2];
+    v[4] = m;
+    v[5] = n;
+    UNPROTECT(1);
+    return ans;
+}
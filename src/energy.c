@@ -6,26 +6,67 @@
    Updated: 2 April 2008    some functions moved to utilities.c
    Updated: 25 August 2016  mvnEstat converted to c++ in mvnorm.cpp
    Updated: 16 February 2021  poisMstat ported to Rcpp in poissonM.cpp
-
-   ksampleEtest() performs the multivariate E-test for equal distributions,
-                  complete version, from data matrix
+   Updated: energy 1.7-9  ksampleEtest replicates computed by
+            perm_replicates (permutation.c); distance matrix D in
+            packed lower triangular storage (utilities.h);
+            E2sample uses the blocked distance kernel (distance.c),
+            tile rows summed in parallel (dist_psum);
+            multisampleE and the ksampleEtest replicates use the
+            group sums of D (packed_group_sums in utilities.c), one
+            pass over the lower triangle for all K samples;
+            with energy.storage("single") the ksampleEtest replicates
+            read D in single precision (ksample_float);
+            the .C routine ksampleEtest is replaced by the .Call entry
+            point energy_ksample, which reads the R matrix or dist
+            object in place (no copy or transposition of x)
+
+   energy_ksample() performs the multivariate E-test for equal
+                  distributions, complete version, from data matrix
+   ksample_packed() the same test from a packed distance matrix
+                  (energy_ksample and the distance handles, disthandle.c)
    E2sample()     computes the 2-sample E-statistic without creating distance
 */
 
 #include <R.h>
+#include <Rinternals.h>
 #include <Rmath.h>
+#include "permutation.h"
+#include "utilities.h"
+#include "distance.h"
 
-void   ksampleEtest(double *x, int *byrow, int *nsamples, int *sizes, int *dim,
-            int *R, double *e0, double *e, double *pval, int *U);
+SEXP   energy_ksample(SEXP x, SEXP sizes, SEXP dims, SEXP U);
 void   E2sample(double *x, int *sizes, int *dim, double *stat);
+void   ksample_packed(packed_matrix *D, int nsamples, int *sizes, int R,
+                      int unbiased, double *e0, double *e, double *pval);
 
-double edist(double **D, int m, int n, int unbiased);
-double multisampleE(double **D, int nsamples, int *sizes, int *perm, int unbiased);
-double twosampleE(double **D, int m, int n, int *xrows, int *yrows, int unbiased);
+double edist(packed_matrix *D, int m, int n, int unbiased);
+double multisampleE(packed_matrix *D, int nsamples, int *sizes, int *perm, int unbiased);
+double twosampleE(packed_matrix *D, int m, int n, int *xrows, int *yrows, int unbiased);
 double E2(double **x, int *sizes, int *start, int ncol, int *perm);
 double Eksample(double *x, int *byrow, int r, int d, int K, int *sizes, int *ix);
 void   distance(double **bxy, double **D, int N, int d);
 
+typedef struct {
+    packed_matrix *D;
+    int    nsamples, *sizes, unbiased;
+} ksample_perm_data;
+
+typedef struct {
+    packed_float *D;
+    int    nsamples, *sizes, unbiased;
+} ksample_float_data;
+
+static double ksample_replicate(const int *perm, void *data, double *work);
+static void   ksample_float(packed_matrix *D, int nsamples, int *sizes,
+                            int R, int unbiased, double *e0, double *e,
+                            double *pval);
+static double ksample_float_replicate(const int *perm, void *data,
+                                      double *work);
+static void   sample_labels(int nsamples, int *sizes, const int *perm,
+                            int *group);
+static double groupE(const double *G, int nsamples, int *sizes,
+                     int unbiased);
+
 /* utilities.c */
 extern double **alloc_matrix(int r, int c);
 extern int    **alloc_int_matrix(int r, int c);
@@ -49,115 +90,218 @@ void E2sample(double *x, int *sizes, int *dim, double *stat) {
       x must be in row order: x=as.double(t(x)) where
       x is pooled sample in matrix sum(en) by dim
     */
-    int    m=sizes[0], n=sizes[1], d=(*dim);
-    int    i, j, k, p, q;
-    double dif, dsum, sumxx, sumxy, sumyy, w;
-
-    sumxy = 0.0;
-    for (i=0; i<m; i++) {
-        p = i*d;
-        for (j=m; j<m+n; j++) {
-            dsum = 0.0;
-            q = j*d;
-            for (k=0; k<d; k++) {
-                dif = *(x+p+k) - *(x+q+k);
-                dsum += dif*dif;
-            }
-            sumxy += sqrt(dsum);
-        }
-    }
-    sumxy /= (double)(m*n);
-    sumxx = 0.0;
-    for (i=1; i<m; i++) {
-        p = i*d;
-        for (j=0; j<i; j++) {
-            dsum = 0.0;
-            q = j*d;
-            for (k=0; k<d; k++) {
-                dif = *(x+p+k) - *(x+q+k);
-                dsum += dif*dif;
-            }
-            sumxx += sqrt(dsum);
-        }
-    }
-    sumxx /= (double)(m*m);  /* half the sum */
-    sumyy = 0.0;
-    for (i=m+1; i<m+n; i++) {
-        p = i*d;
-        for (j=m; j<i; j++) {
-            dsum = 0.0;
-            q = j*d;
-            for (k=0; k<d; k++) {
-                dif = *(x+p+k) - *(x+q+k);
-                dsum += dif*dif;
-            }
-            sumyy += sqrt(dsum);
-        }
-    }
-    sumyy /= (double)(n*n);  /* half the sum */
+    int    m=sizes[0], n=sizes[1], d=(*dim), nthreads=num_threads();
+    double sumxx, sumxy, sumyy, w;
+    dist_data XY, X, Y;
+
+    /* both samples are views of the pooled sample (common center) */
+    dist_prepare(&XY, x, m+n, d, NULL);
+    dist_view(&X, &XY, 0, m);
+    dist_view(&Y, &XY, m, n);
+    sumxy = dist_psum(&X, &Y, 1.0, nthreads) / (double)(m*n);
+    sumxx = dist_psum(&X, &X, 1.0, nthreads) / (double)(m*m);  /* half the sum */
+    sumyy = dist_psum(&Y, &Y, 1.0, nthreads) / (double)(n*n);  /* half the sum */
+    dist_release(&XY);
     w = (double)(m*n)/(double)(m+n);
     *stat = 2.0*w*(sumxy - sumxx - sumyy);
 }
 
-void ksampleEtest(double *x, int *byrow,
-                  int *nsamples, int *sizes, int *dim,
-                  int *R, double *e0, double *e, double *pval,
-                  int *U)
+SEXP energy_ksample(SEXP x, SEXP sizes, SEXP dims, SEXP U)
 {
     /*
       exported for R energy package: E test for equal distributions
-      x         the pooled sample (or distances)
-      *byrow    logical, TRUE if x is stored by row
-                pass x=as.double(t(x)) if *byrow==TRUE
-      *nsamples number of samples
-      *sizes    vector of sample sizes
-      *dim      dimension of data in x (0 if x is distance matrix)
-      *R        number of replicates for permutation test
-      *e0       observed E test statistic
-      e         vector of replicates of E statistic
-      *pval     approximate p-value
+      x         the pooled sample (or distances), read in place
+      sizes     vector of sample sizes
+      dims      c(d, type, R): d the dimension of the data in x, type
+                0 (data, an R matrix or vector), 1 (dist object) or 2
+                (distance matrix), R the number of replicates for the
+                permutation test
+      U         TRUE for the unbiased statistic
+      returns list(e0, e, pval): observed E test statistic, vector of
+      replicates of E statistic and approximate p-value
     */
 
-    int    b, ek, i, k;
-    int    B = (*R), K = (*nsamples), d=(*dim), N;
-    int    *perm;
-    double **data, **D;
+    int    k, K = LENGTH(sizes), *sz = INTEGER(sizes), N;
+    int    d = INTEGER(dims)[0], type = INTEGER(dims)[1];
+    int    R = INTEGER(dims)[2], u = asLogical(U);
+    packed_matrix *D;
+    SEXP   ans, e0, e, pval, nms;
 
+    if (R < 0) R = 0;
+    if (!sample_finite(REAL(x), XLENGTH(x)))
+        error("Data contains missing or infinite values");
     N = 0;
     for (k=0; k<K; k++)
-        N += sizes[k];
+        N += sz[k];
+    PROTECT(e0 = ScalarReal(0.0));
+    PROTECT(e = allocVector(REALSXP, R));
+    PROTECT(pval = ScalarReal(1.0));
+    D = alloc_packed(N);           /* distance matrix */
+    packed_sample_distance(REAL(x), d, type, 1.0, D);
+
+    if (R > 0 && float_storage()) {
+        /* ksample_float frees D */
+        ksample_float(D, K, sz, R, u, REAL(e0), REAL(e), REAL(pval));
+    } else {
+        ksample_packed(D, K, sz, R, u, REAL(e0), REAL(e), REAL(pval));
+        free_packed(D);
+    }
+
+    PROTECT(ans = allocVector(VECSXP, 3));
+    PROTECT(nms = allocVector(STRSXP, 3));
+    SET_VECTOR_ELT(ans, 0, e0);
+    SET_VECTOR_ELT(ans, 1, e);
+    SET_VECTOR_ELT(ans, 2, pval);
+    SET_STRING_ELT(nms, 0, mkChar("e0"));
+    SET_STRING_ELT(nms, 1, mkChar("e"));
+    SET_STRING_ELT(nms, 2, mkChar("pval"));
+    setAttrib(ans, R_NamesSymbol, nms);
+    UNPROTECT(5);
+    return ans;
+}
+
+void ksample_packed(packed_matrix *D, int nsamples, int *sizes, int R,
+                    int unbiased, double *e0, double *e, double *pval)
+{
+    /*
+      E test for equal distributions from the packed distance matrix D
+      of the pooled sample (see ksampleEtest); D is not changed
+    */
+    int    i;
+    int    B = R, K = nsamples, N = D->n;
+    int    *perm;
+    ksample_perm_data pd;
+    perm_stop stop;
+
     perm = Calloc(N, int);
     for (i=0; i<N; i++)
         perm[i] = i;
-    D   = alloc_matrix(N, N);      /* distance matrix */
-    if (d > 0) {
-        data = alloc_matrix(N, d); /* sample matrix */
-        vector2matrix(x, data, N, d, *byrow);
-        distance(data, D, N, d);
-        free_matrix(data, N, d);
-    }
-    else
-        vector2matrix(x, D, N, N, *byrow);
 
-    *e0 = multisampleE(D, K, sizes, perm, *U);
+    *e0 = multisampleE(D, K, sizes, perm, unbiased);
 
     /* bootstrap */
     if (B > 0) {
-        ek = 0;
-        GetRNGstate();
-        for (b=0; b<B; b++) {
-            permute(perm, N);
-            e[b] = multisampleE(D, K, sizes, perm, *U);
-            if ((*e0) < e[b]) ek++;
-        }
-        PutRNGstate();
-        (*pval) = ((double) (ek + 1)) / ((double) (B + 1));
+        pd.D = D;
+        pd.nsamples = K;
+        pd.sizes = sizes;
+        pd.unbiased = unbiased;
+        stop.observed = *e0;
+        stop.strict = TRUE;
+        stop.plus1 = TRUE;
+        perm_replicates_stop(N, B, ksample_replicate, &pd, N + K*K + K, e,
+                             &stop);
+        (*pval) = perm_pvalue(&stop, B);
     }
 
-    free_matrix(D, N, N);
     Free(perm);
 }
 
+static double ksample_replicate(const int *perm, void *data, double *work)
+{
+    /* work: N group labels (stored as int), K by K group sums, K */
+    ksample_perm_data *pd = (ksample_perm_data *) data;
+    int    K = pd->nsamples, N = pd->D->n;
+    int    *group = (int *) work;
+    double *G = work + N, *acc = G + K*K;
+
+    sample_labels(K, pd->sizes, perm, group);
+    packed_group_sums(pd->D, group, K, G, acc);
+    return groupE(G, K, pd->sizes, pd->unbiased);
+}
+
+static void ksample_float(packed_matrix *D, int nsamples, int *sizes,
+                          int R, int unbiased, double *e0, double *e,
+                          double *pval)
+{
+    /*
+      ksample_packed (R > 0) with the replicates computed from D in
+      single precision; D is converted in place and freed.  e0 is
+      computed from D in double precision; the p-value compares the
+      replicates with the statistic of the single precision D, so that
+      the rounding is the same for both.
+    */
+    int    i, K = nsamples, N = D->n;
+    int    *perm;
+    double ef, *work;
+    ksample_float_data pd;
+    perm_stop stop;
+
+    perm = Calloc(N, int);
+    for (i=0; i<N; i++)
+        perm[i] = i;
+    *e0 = multisampleE(D, K, sizes, perm, unbiased);
+
+    pd.D = packed_to_float(D);
+    pd.nsamples = K;
+    pd.sizes = sizes;
+    pd.unbiased = unbiased;
+    work = Calloc(N + K*K + K, double);
+    ef = ksample_float_replicate(perm, &pd, work);
+    Free(work);
+    Free(perm);
+
+    stop.observed = ef;
+    stop.strict = TRUE;
+    stop.plus1 = TRUE;
+    perm_replicates_stop(N, R, ksample_float_replicate, &pd, N + K*K + K, e,
+                         &stop);
+    (*pval) = perm_pvalue(&stop, R);
+    free_packed_float(pd.D);
+}
+
+static double ksample_float_replicate(const int *perm, void *data,
+                                      double *work)
+{
+    /* ksample_replicate for single precision D */
+    ksample_float_data *pd = (ksample_float_data *) data;
+    int    K = pd->nsamples, N = pd->D->n;
+    int    *group = (int *) work;
+    double *G = work + N, *acc = G + K*K;
+
+    sample_labels(K, pd->sizes, perm, group);
+    packed_float_group_sums(pd->D, group, K, G, acc);
+    return groupE(G, K, pd->sizes, pd->unbiased);
+}
+
+static void sample_labels(int nsamples, int *sizes, const int *perm,
+                          int *group)
+{
+    /* sample k is rows perm[mk], ..., perm[mk + sizes[k] - 1] */
+    int i, k, m = 0;
+    for (k=0; k<nsamples; k++)
+        for (i=0; i<sizes[k]; i++)
+            group[perm[m++]] = k;
+}
+
+static double groupE(const double *G, int nsamples, int *sizes,
+                     int unbiased)
+{
+    /*
+      multisample E statistic from the group sums G of D
+      (see packed_group_sums): the sum over pairs of samples of the
+      two-sample statistics computed by twosampleE
+    */
+    int    i, j, K = nsamples;
+    double m, n, sumxx, sumyy, sumxy, e = 0.0;
+
+    for (i=0; i<K; i++) {
+        m = (double) sizes[i];
+        if (m < 1) continue;
+        sumxx = 2.0 * G[i*K + i] / (m*m);
+        if (unbiased == 1)
+            sumxx *= m / (m - 1);
+        for (j=i+1; j<K; j++) {
+            n = (double) sizes[j];
+            if (n < 1) continue;
+            sumyy = 2.0 * G[j*K + j] / (n*n);
+            if (unbiased == 1)
+                sumyy *= n / (n - 1);
+            sumxy = (G[i*K + j] + G[j*K + i]) / (m*n);
+            e += m*n/(m+n) * (2*sumxy - sumxx - sumyy);
+        }
+    }
+    return e;
+}
 
 
 double E2(double **x, int *sizes, int *start, int ncol, int *perm)
@@ -214,40 +358,33 @@ double E2(double **x, int *sizes, int *start, int ncol, int *perm)
 }
 
 
-double multisampleE(double **D, int nsamples, int *sizes, int *perm, int unbiased)
+double multisampleE(packed_matrix *D, int nsamples, int *sizes, int *perm, int unbiased)
 {
     /*
       returns the multisample E statistic
-      D is square Euclidean distance matrix
+      D is packed Euclidean distance matrix
       perm is a permutation of the row indices
     */
-    int i, j, k, m, n;
-    int *M;
-    double e;
-
-    M = Calloc(nsamples, int);
-    M[0] = 0;
-    for (k=1; k<nsamples; k++)
-        M[k] = M[k-1] + sizes[k-1]; /* index where sample k begins */
-
-    e = 0.0;
-    for (i=0; i<nsamples; i++) {
-        m = sizes[i];
-        for (j=i+1; j<nsamples; j++) {
-            n = sizes[j];
-            e += twosampleE(D, m, n, perm+M[i], perm+M[j], unbiased);
-        }
-    }
-    Free(M);
+    int    K = nsamples, *group;
+    double e, *G, *acc;
+
+    group = Calloc(D->n, int);
+    G = Calloc(K*K + K, double);
+    acc = G + K*K;
+    sample_labels(K, sizes, perm, group);
+    packed_group_sums(D, group, K, G, acc);
+    e = groupE(G, K, sizes, unbiased);
+    Free(group);
+    Free(G);
     return(e);
 }
 
-double twosampleE(double **D, int m, int n, int *xrows, int *yrows, int unbiased)
+double twosampleE(packed_matrix *D, int m, int n, int *xrows, int *yrows, int unbiased)
 {
     /*
        return the e-distance between two samples
        corresponding to samples indexed xrows[] and yrows[]
-       D is square Euclidean distance matrix
+       D is packed Euclidean distance matrix
     */
     int    i, j;
     double sumxx=0.0, sumyy=0.0, sumxy=0.0;
@@ -255,11 +392,11 @@ double twosampleE(double **D, int m, int n, int *xrows, int *yrows, int unbiased
     if (m < 1 || n < 1) return 0.0;
     for (i=0; i<m; i++)
         for (j=i+1; j<m; j++)
-            sumxx += D[xrows[i]][xrows[j]];
+            sumxx += PACKED_ELT(D, xrows[i], xrows[j]);
     sumxx *= 2.0/((double)(m*m));
     for (i=0; i<n; i++)
         for (j=i+1; j<n; j++)
-            sumyy += D[yrows[i]][yrows[j]];
+            sumyy += PACKED_ELT(D, yrows[i], yrows[j]);
     sumyy *= 2.0/((double)(n*n));
     if (unbiased == 1) {
       sumxx *= (double)(m) / (double)(m - 1);
@@ -268,17 +405,17 @@ double twosampleE(double **D, int m, int n, int *xrows, int *yrows, int unbiased
 
     for (i=0; i<m; i++)
         for (j=0; j<n; j++)
-            sumxy += D[xrows[i]][yrows[j]];
+            sumxy += PACKED_ELT(D, xrows[i], yrows[j]);
     sumxy /= ((double) (m*n));
 
     return (double)(m*n)/((double)(m+n)) * (2*sumxy - sumxx - sumyy);
 }
 
-double edist(double **D, int m, int n, int unbiased)
+double edist(packed_matrix *D, int m, int n, int unbiased)
 {
     /*
       return the e-distance between two samples size m and n
-      D is square Euclidean distance matrix
+      D is packed Euclidean distance matrix
     */
     int    i, j;
     double sumxx=0.0, sumyy=0.0, sumxy=0.0;
@@ -286,11 +423,11 @@ double edist(double **D, int m, int n, int unbiased)
     if (m < 1 || n < 1) return 0.0;
     for (i=0; i<m; i++)
         for (j=i+1; j<m; j++)
-            sumxx += D[i][j];
+            sumxx += PACKED_ELT(D, i, j);
     sumxx *= 2.0/((double)(m*m));
     for (i=0; i<n; i++)
         for (j=i+1; j<n; j++)
-            sumyy += D[i][j];
+            sumyy += PACKED_ELT(D, i, j);
     sumyy *= 2.0/((double)(n*n));
     if (unbiased == 1) {
       sumxx *= (double)(m) / (double)(m - 1);
@@ -299,7 +436,7 @@ double edist(double **D, int m, int n, int unbiased)
 
     for (i=0; i<m; i++)
         for (j=0; j<n; j++)
-            sumxy += D[i][j];
+            sumxy += PACKED_ELT(D, i, j);
     sumxy /= ((double) (m*n));
     return (double)(m*n)/((double)(m+n)) * (2*sumxy - sumxx - sumyy);
 }
@@ -2,57 +2,179 @@
 #include <Rinternals.h>
 #include <stdlib.h> // for NULL
 #include <R_ext/Rdynload.h>
+#include "profile.h"
 
 /* declarations to register native routines in this package */ 
 
-/* .C calls */
-extern void dCOV(void *, void *, void *, void *, void *, void *, void *);
-extern void dCOVtest(void *, void *, void *, void *, void *, void *, void *, void *);
-extern void indepE(void *, void *, void *, void *, void *);
-extern void indepEtest(void *, void *, void *, void *, void *, void *, void *);
-extern void ksampleEtest(void *, void *, void *, void *, void *, void *, void *, void *, void *, void *);
-
 /* .Call calls */
 extern SEXP _energy_D_center(SEXP);
+extern SEXP _energy_dcor_matrix(SEXP, SEXP, SEXP);
+extern SEXP _energy_dcor_screen2d(SEXP, SEXP, SEXP);
+extern SEXP _energy_dcor_screen(SEXP, SEXP, SEXP);
+extern SEXP _energy_dcov2d_sums(SEXP, SEXP, SEXP);
+extern SEXP _energy_dcov2d_test(SEXP, SEXP, SEXP, SEXP);
 extern SEXP _energy_dcovU_stats(SEXP, SEXP);
 extern SEXP _energy_partial_dcor(SEXP, SEXP, SEXP);
 extern SEXP _energy_partial_dcov(SEXP, SEXP, SEXP);
+extern SEXP _energy_pdcov_test(SEXP, SEXP, SEXP, SEXP);
 extern SEXP _energy_poisMstat(SEXP);
 extern SEXP _energy_projection(SEXP, SEXP);
+extern SEXP _energy_dcov_projections(SEXP, SEXP, SEXP, SEXP);
+extern SEXP _energy_edist_projections(SEXP, SEXP, SEXP);
+extern SEXP _energy_poisson_stats(SEXP, SEXP);
 extern SEXP _energy_U_center(SEXP);
 extern SEXP _energy_U_product(SEXP, SEXP);
 extern SEXP _energy_Btree_sum(SEXP, SEXP);
-extern SEXP _energy_kgroups_start(SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP _energy_gamma1_direct(SEXP, SEXP);
+extern SEXP _energy_kgroups_start(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP _energy_kgroups_handle(SEXP, SEXP, SEXP, SEXP, SEXP);
 extern SEXP _energy_calc_dist(SEXP);
 extern SEXP _energy_dCov2(SEXP, SEXP, SEXP);
 extern SEXP _energy_dCov2stats(SEXP, SEXP, SEXP);
+extern SEXP energy_dcov(SEXP, SEXP, SEXP, SEXP);
+extern SEXP energy_dcov_stream(SEXP, SEXP, SEXP, SEXP);
+extern SEXP energy_indep(SEXP, SEXP, SEXP);
+extern SEXP energy_ksample(SEXP, SEXP, SEXP, SEXP);
+extern SEXP energy_threads(SEXP);
+extern SEXP energy_dist_new(SEXP, SEXP, SEXP);
+extern SEXP energy_dist_info(SEXP);
+extern SEXP energy_dist_matrix(SEXP);
+extern SEXP energy_dist_dcov(SEXP, SEXP, SEXP);
+extern SEXP energy_dist_dcovU(SEXP, SEXP);
+extern SEXP energy_dist_ksample(SEXP, SEXP, SEXP, SEXP);
+extern SEXP energy_dist_disco(SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP energy_edist_file(SEXP, SEXP, SEXP);
+extern SEXP energy_hclust(SEXP, SEXP, SEXP);
+extern SEXP energy_mvnorm(SEXP, SEXP);
+extern SEXP energy_storage(SEXP);
+extern SEXP energy_sequential(SEXP, SEXP);
+extern SEXP energy_profile(SEXP);
+extern SEXP energy_stats(SEXP);
+extern SEXP energy_window_new(SEXP, SEXP);
+extern SEXP energy_bcdcor(SEXP, SEXP, SEXP);
+extern SEXP energy_window_push(SEXP, SEXP, SEXP);
+extern SEXP energy_window_pop(SEXP, SEXP);
+extern SEXP energy_window_stats(SEXP);
 
-static const R_CMethodDef CEntries[] = {
-  {"dCOV",         (DL_FUNC) &dCOV,         7},
-  {"dCOVtest",     (DL_FUNC) &dCOVtest,     8},
-  {"indepE",       (DL_FUNC) &indepE,       5},
-  {"indepEtest",   (DL_FUNC) &indepEtest,   7},
-  {"ksampleEtest", (DL_FUNC) &ksampleEtest, 10},
-  {NULL, NULL, 0}
-};
+/*
+   each entry point clears the phase of profile.c left open by an error
+   or an interrupt in an earlier call (prof_enter), then calls the
+   routine
+*/
+#define ENTRY1(f) static SEXP f##_entry(SEXP a1) \
+    { prof_enter(); return f(a1); }
+#define ENTRY2(f) static SEXP f##_entry(SEXP a1, SEXP a2) \
+    { prof_enter(); return f(a1, a2); }
+#define ENTRY3(f) static SEXP f##_entry(SEXP a1, SEXP a2, SEXP a3) \
+    { prof_enter(); return f(a1, a2, a3); }
+#define ENTRY4(f) static SEXP f##_entry(SEXP a1, SEXP a2, SEXP a3, SEXP a4) \
+    { prof_enter(); return f(a1, a2, a3, a4); }
+#define ENTRY5(f) static SEXP f##_entry(SEXP a1, SEXP a2, SEXP a3, \
+    SEXP a4, SEXP a5) \
+    { prof_enter(); return f(a1, a2, a3, a4, a5); }
+#define ENTRY7(f) static SEXP f##_entry(SEXP a1, SEXP a2, SEXP a3, SEXP a4, \
+    SEXP a5, SEXP a6, SEXP a7) \
+    { prof_enter(); return f(a1, a2, a3, a4, a5, a6, a7); }
+
+ENTRY1(_energy_D_center)
+ENTRY3(_energy_dcor_matrix)
+ENTRY3(_energy_dcor_screen2d)
+ENTRY3(_energy_dcor_screen)
+ENTRY3(_energy_dcov2d_sums)
+ENTRY4(_energy_dcov2d_test)
+ENTRY2(_energy_dcovU_stats)
+ENTRY3(_energy_partial_dcor)
+ENTRY3(_energy_partial_dcov)
+ENTRY4(_energy_pdcov_test)
+ENTRY1(_energy_poisMstat)
+ENTRY2(_energy_projection)
+ENTRY4(_energy_dcov_projections)
+ENTRY3(_energy_edist_projections)
+ENTRY2(_energy_poisson_stats)
+ENTRY1(_energy_U_center)
+ENTRY2(_energy_U_product)
+ENTRY2(_energy_Btree_sum)
+ENTRY2(_energy_gamma1_direct)
+ENTRY7(_energy_kgroups_start)
+ENTRY5(_energy_kgroups_handle)
+ENTRY1(_energy_calc_dist)
+ENTRY4(energy_dcov)
+ENTRY4(energy_dcov_stream)
+ENTRY3(energy_indep)
+ENTRY4(energy_ksample)
+ENTRY1(energy_threads)
+ENTRY3(energy_dist_new)
+ENTRY1(energy_dist_info)
+ENTRY1(energy_dist_matrix)
+ENTRY3(energy_dist_dcov)
+ENTRY2(energy_dist_dcovU)
+ENTRY4(energy_dist_ksample)
+ENTRY5(energy_dist_disco)
+ENTRY3(energy_edist_file)
+ENTRY3(energy_hclust)
+ENTRY2(energy_mvnorm)
+ENTRY1(energy_storage)
+ENTRY2(energy_sequential)
+ENTRY1(energy_profile)
+ENTRY1(energy_stats)
+ENTRY2(energy_window_new)
+ENTRY3(energy_window_push)
+ENTRY2(energy_window_pop)
+ENTRY1(energy_window_stats)
+ENTRY3(energy_bcdcor)
 
 static const R_CallMethodDef CallEntries[] = {
-  {"_energy_D_center",       (DL_FUNC) &_energy_D_center,      1},
-  {"_energy_dcovU_stats",    (DL_FUNC) &_energy_dcovU_stats,   2},
-  {"_energy_partial_dcor",   (DL_FUNC) &_energy_partial_dcor,  3},
-  {"_energy_partial_dcov",   (DL_FUNC) &_energy_partial_dcov,  3},
-  {"_energy_poisMstat",      (DL_FUNC) &_energy_poisMstat,     1},
-  {"_energy_projection",     (DL_FUNC) &_energy_projection,    2},
-  {"_energy_U_center",       (DL_FUNC) &_energy_U_center,      1},
-  {"_energy_U_product",      (DL_FUNC) &_energy_U_product,     2},
-  {"_energy_Btree_sum",      (DL_FUNC) &_energy_Btree_sum,     2},
-  {"_energy_kgroups_start",  (DL_FUNC) &_energy_kgroups_start, 5},
-  {"_energy_calc_dist",      (DL_FUNC) &_energy_calc_dist,     1},
+  {"_energy_D_center",         (DL_FUNC) &_energy_D_center_entry,       1},
+  {"_energy_dcor_matrix",      (DL_FUNC) &_energy_dcor_matrix_entry,    3},
+  {"_energy_dcor_screen2d",    (DL_FUNC) &_energy_dcor_screen2d_entry,  3},
+  {"_energy_dcor_screen",      (DL_FUNC) &_energy_dcor_screen_entry,    3},
+  {"_energy_dcov2d_sums",      (DL_FUNC) &_energy_dcov2d_sums_entry,    3},
+  {"_energy_dcov2d_test",      (DL_FUNC) &_energy_dcov2d_test_entry,    4},
+  {"_energy_dcovU_stats",      (DL_FUNC) &_energy_dcovU_stats_entry,    2},
+  {"_energy_partial_dcor",     (DL_FUNC) &_energy_partial_dcor_entry,   3},
+  {"_energy_partial_dcov",     (DL_FUNC) &_energy_partial_dcov_entry,   3},
+  {"_energy_pdcov_test",       (DL_FUNC) &_energy_pdcov_test_entry,     4},
+  {"_energy_poisMstat",        (DL_FUNC) &_energy_poisMstat_entry,      1},
+  {"_energy_projection",       (DL_FUNC) &_energy_projection_entry,     2},
+  {"_energy_dcov_projections", (DL_FUNC) &_energy_dcov_projections_entry, 4},
+  {"_energy_edist_projections", (DL_FUNC) &_energy_edist_projections_entry, 3},
+  {"_energy_poisson_stats",    (DL_FUNC) &_energy_poisson_stats_entry,  2},
+  {"_energy_U_center",         (DL_FUNC) &_energy_U_center_entry,       1},
+  {"_energy_U_product",        (DL_FUNC) &_energy_U_product_entry,      2},
+  {"_energy_Btree_sum",        (DL_FUNC) &_energy_Btree_sum_entry,      2},
+  {"_energy_gamma1_direct",    (DL_FUNC) &_energy_gamma1_direct_entry,  2},
+  {"_energy_kgroups_start",    (DL_FUNC) &_energy_kgroups_start_entry,  7},
+  {"_energy_kgroups_handle",   (DL_FUNC) &_energy_kgroups_handle_entry, 5},
+  {"_energy_calc_dist",        (DL_FUNC) &_energy_calc_dist_entry,      1},
+  {"energy_dcov",              (DL_FUNC) &energy_dcov_entry,            4},
+  {"energy_dcov_stream",       (DL_FUNC) &energy_dcov_stream_entry,     4},
+  {"energy_indep",             (DL_FUNC) &energy_indep_entry,           3},
+  {"energy_ksample",           (DL_FUNC) &energy_ksample_entry,         4},
+  {"energy_threads",           (DL_FUNC) &energy_threads_entry,         1},
+  {"energy_dist_new",          (DL_FUNC) &energy_dist_new_entry,        3},
+  {"energy_dist_info",         (DL_FUNC) &energy_dist_info_entry,       1},
+  {"energy_dist_matrix",       (DL_FUNC) &energy_dist_matrix_entry,     1},
+  {"energy_dist_dcov",         (DL_FUNC) &energy_dist_dcov_entry,       3},
+  {"energy_dist_dcovU",        (DL_FUNC) &energy_dist_dcovU_entry,      2},
+  {"energy_dist_ksample",      (DL_FUNC) &energy_dist_ksample_entry,    4},
+  {"energy_dist_disco",        (DL_FUNC) &energy_dist_disco_entry,      5},
+  {"energy_edist_file",        (DL_FUNC) &energy_edist_file_entry,      3},
+  {"energy_hclust",            (DL_FUNC) &energy_hclust_entry,          3},
+  {"energy_mvnorm",            (DL_FUNC) &energy_mvnorm_entry,          2},
+  {"energy_storage",           (DL_FUNC) &energy_storage_entry,         1},
+  {"energy_sequential",        (DL_FUNC) &energy_sequential_entry,      2},
+  {"energy_profile",           (DL_FUNC) &energy_profile_entry,         1},
+  {"energy_stats",             (DL_FUNC) &energy_stats_entry,           1},
+  {"energy_window_new",        (DL_FUNC) &energy_window_new_entry,      2},
+  {"energy_window_push",       (DL_FUNC) &energy_window_push_entry,     3},
+  {"energy_window_pop",        (DL_FUNC) &energy_window_pop_entry,      2},
+  {"energy_window_stats",      (DL_FUNC) &energy_window_stats_entry,    1},
+  {"energy_bcdcor",            (DL_FUNC) &energy_bcdcor_entry,          3},
   {NULL, NULL, 0}
 };
 
 void R_init_energy(DllInfo *dll)
 {
-  R_registerRoutines(dll, CEntries, CallEntries, NULL, NULL);
+  R_registerRoutines(dll, NULL, CallEntries, NULL, NULL);
   R_useDynamicSymbols(dll, FALSE);
 }
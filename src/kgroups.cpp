@@ -1,126 +1,486 @@
-#include <Rcpp.h>
-using namespace Rcpp;
-
-int kgroups_update(NumericMatrix x, int k, IntegerVector clus,
-                   IntegerVector sizes, NumericVector within, bool distance);
-List kgroups_start(NumericMatrix x, int k, IntegerVector clus,
-                   int iter_max, bool distance);
-
-int kgroups_update(NumericMatrix x, int k, IntegerVector clus,
-                      IntegerVector sizes, NumericVector w, bool distance) {
-  /*
-   * k-groups one pass through sample moving one point at a time
-   * x: data matrix or distance
-   * k: number of clusters
-   * clus: clustering vector clus(i)==j ==> x_i is in cluster j
-   * sizes: cluster sizes
-   * within: vector of within cluster dispersions
-   * distance: true if x is distance matrix
-   * update clus, sizes, and withins
-   * return count = number of points moved
-   */
-
-  int n = x.nrow(), d = x.ncol();
-  int i, j, I, J, ix, nI, nJ;
-  NumericVector rowdst(k), e(k);
-  int best, count = 0;
-  double dsum, dif;
-
-  for (ix = 0; ix < n; ix++) {
-    I = clus(ix);
-    nI = sizes(I);
-    if (nI > 1) {
-      // calculate the E-distances of this point to each cluster
-      rowdst.fill(0.0);
-      for (i = 0; i < n; i++) {
-        J = clus(i);
-        if (distance == true) {
-          rowdst(J) += x(ix, i);
-        } else {
-          dsum = 0.0;
-          for (j = 0; j < d; j++) {
-            dif = x(ix, j) - x(i, j);
-            dsum += dif * dif;
-          }
-          rowdst(J) += sqrt(dsum);
-        }
-      }
-
-      for (J = 0; J < k; J++) {
-        nJ = sizes(J);
-        e(J) = (2.0 / (double) nJ) * (rowdst(J) - w(J));
-      }
-
-      best = Rcpp::which_min(e);
-      if (best != I) {
-        // move this point and update
-        nI = sizes(I);
-        nJ = sizes(best);
-        w(best) = (((double) nJ) * w(best) + rowdst(best)) / ((double) (nJ + 1));
-        w(I) = (((double) nI) * w(I) - rowdst(I)) / ((double) (nI - 1));
-        clus(ix) = best;
-        sizes(I) = nI - 1;
-        sizes(best) = nJ + 1;
-        count ++;  // number of moves
-        }
-      }
-    }
-
-  return count;
-}
-
-
-
-// [[Rcpp::export]]
-List kgroups_start(NumericMatrix x, int k, IntegerVector clus,
-                   int iter_max, bool distance) {
-  // k-groups clustering with initial clustering vector clus
-  // up to iter_max iterations of n possible moves each
-  // distance: true if x is distance matrix
-    NumericVector within(k, 0.0);
-  IntegerVector sizes(k, 0);
-  double dif, dsum;
-  int I, J, h, i, j;
-  int n = x.nrow(), d = x.ncol();
-
-  for (i = 0; i < n; i++) {
-    I = clus(i);
-    sizes(I)++;
-    for (j = 0; j < i; j++) {
-      J = clus(j);
-      if (I == J) {
-        if (distance == true) {
-          within(I) += x(i, j);
-        } else {
-          dsum = 0.0;
-          for (h = 0; h < d; h++) {
-            dif = x(i, h) - x(j, h);
-            dsum += dif * dif;
-          }
-          within(I) += sqrt(dsum);
-        }
-      }
-    }
-  }
-  for (I = 0; I < k; I++)
-    within(I) /= ((double) sizes(I));
-
-  int it = 1, count = 1;
-  count = kgroups_update(x, k, clus, sizes, within, distance);
-
-  while (it < iter_max && count > 0) {
-    count = kgroups_update(x, k, clus, sizes, within, distance);
-    it++;
-  }
-  double W = Rcpp::sum(within);
-
-  return List::create(
-        _["within"] = within,
-        _["W"] = W,
-        _["sizes"] = sizes,
-        _["cluster"] = clus,
-        _["iterations"] = it,
-        _["count"] = count);
-}
-
-
+#include <Rcpp.h>
+using namespace Rcpp;
+
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "distance.h"
+#include "utilities.h"
+#include "permutation.h"
+#include "disthandle.h"
+
+// k-groups clustering
+//
+// The distances from a point to all n points are needed for every point
+// on every pass.  If x is a distance matrix they are a column of x.
+// Otherwise they are read from a packed cache of the distance matrix
+// if it fits in cache_mb megabytes, or else recomputed from the data,
+// DIST_TILE points at a time, and summed by cluster in parallel
+// (num_threads, see energy.threads).
+// The per-tile sums are added in tile order, so the result does not
+// depend on the number of threads.
+// kgroups_handle clusters from the packed distances of an energy.dist
+// handle (disthandle.c).
+//
+// Multiple starts (the columns of clus) share the read-only distances.
+// If the distances are a matrix or packed (cached or a handle) the
+// starts run in parallel, one start per thread; otherwise the starts
+// run in turn, each pass in parallel as above.  Only the best clustering
+// is kept, with W and the iterations of each start.  If nrepeat > 0
+// the starts stop when the best clustering of the starts so far has
+// been found by nrepeat of them (the same partition, up to labels).
+// The starts are scanned in order for this rule, so that the starts
+// used, and the result, do not depend on the number of threads.
+
+struct kgroups_data {
+  int n, k, nthreads, distance;
+  const double *x;     // n by n distance matrix, or n by d data
+  const dist_data *X;  // the data in row order, for within_direct
+  packed_matrix *D;    // cached distances, or NULL
+  double *work;        // nthreads * dist_worksize(d)
+  double *tilesums;    // ntiles * k
+};
+
+struct kgroups_starts {
+  int n, k, nstart, iter_max;
+  int *clus, *sizes;   // n by nstart labels, k by nstart sizes
+  double *within;      // k by nstart
+  double *W;           // nstart
+  int *it, *count;     // nstart
+};
+
+int kgroups_update(int k, int *clus, int *sizes, double *w, double *e,
+                   kgroups_data *kd);
+List kgroups_start(NumericMatrix x, int k, IntegerMatrix clus,
+                   int iter_max, bool distance, double cache_mb,
+                   int nrepeat);
+List kgroups_handle(SEXP h, int k, IntegerMatrix clus, int iter_max,
+                    int nrepeat);
+
+static void point_rowdst(kgroups_data *kd, int ix, const int *clus,
+                         double *rowdst);
+static void within_direct(kgroups_data *kd, const int *clus, double *w);
+static void kgroups_init(kgroups_data *kd, const int *clus, int *sizes,
+                         double *within, double *G);
+static void kgroups_iterate(kgroups_data *kd, kgroups_starts *ks, int s,
+                            double *work);
+static int same_partition(const int *a, const int *b, int n, int k,
+                          int *map);
+static List kgroups_run(kgroups_data *kd, IntegerMatrix clus, int iter_max,
+                        int nrepeat);
+
+
+static void point_rowdst(kgroups_data *kd, int ix, const int *clus,
+                         double *rowdst) {
+  // rowdst[J] = sum of the distances from point ix to cluster J
+  int i, J, n = kd->n, k = kd->k;
+  for (J = 0; J < k; J++)
+    rowdst[J] = 0.0;
+
+  if (kd->distance) {
+    // column ix (contiguous) of the symmetric distance matrix
+    const double *xc = kd->x + (size_t) ix * n;
+    for (i = 0; i < n; i++)
+      rowdst[clus[i]] += xc[i];
+  } else if (kd->D != NULL) {
+    // row ix of the packed lower triangle, then column ix below it
+    const double *Di = kd->D->x + PACKED_OFFSET(ix);
+    for (i = 0; i < ix; i++)
+      rowdst[clus[i]] += Di[i];
+    for (i = ix + 1; i < n; i++)
+      rowdst[clus[i]] += kd->D->x[PACKED_OFFSET(i) + ix];
+  } else {
+    // distances from the column-major data, DIST_TILE points at a time
+    // (for one point the columns of x are the transposed tile)
+    int ntiles = (n + DIST_TILE - 1) / DIST_TILE;
+    int d = kd->X->d, ws = dist_worksize(d);
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(kd->nthreads) if (ntiles > 1)
+#endif
+    {
+      int t = 0, b, h, j, j0, m;
+      double xih, dif, *s, *tile;
+      const double *xh;
+#ifdef _OPENMP
+      t = omp_get_thread_num();
+#endif
+      tile = kd->work + (size_t) t * ws;
+#ifdef _OPENMP
+      #pragma omp for schedule(static)
+#endif
+      for (b = 0; b < ntiles; b++) {
+        j0 = b * DIST_TILE;
+        m = n - j0;
+        if (m > DIST_TILE) m = DIST_TILE;
+        for (j = 0; j < m; j++)
+          tile[j] = 0.0;
+        for (h = 0; h < d; h++) {
+          xh = kd->x + (size_t) h * n;
+          xih = xh[ix];
+          xh += j0;
+          for (j = 0; j < m; j++) {
+            dif = xih - xh[j];
+            tile[j] += dif * dif;
+          }
+        }
+        s = kd->tilesums + (size_t) b * k;
+        for (j = 0; j < k; j++)
+          s[j] = 0.0;
+        for (j = 0; j < m; j++)
+          s[clus[j0 + j]] += sqrt(tile[j]);
+      }
+    }
+    for (i = 0; i < ntiles; i++)
+      for (J = 0; J < k; J++)
+        rowdst[J] += kd->tilesums[(size_t) i * k + J];
+  }
+}
+
+
+static void within_direct(kgroups_data *kd, const int *clus, double *w) {
+  // w[J] = sum of the distances within cluster J (i > j)
+  // by row tiles of the lower triangle, in parallel
+  int i, J, n = kd->n, k = kd->k;
+  int ntiles = (n + DIST_TILE - 1) / DIST_TILE;
+  int ws = dist_worksize(kd->X->d);
+
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(kd->nthreads) if (ntiles > 1)
+#endif
+  {
+    int t = 0, b, i0, j0, m, nj, I, ii, jj;
+    double *s, *tile;
+#ifdef _OPENMP
+    t = omp_get_thread_num();
+#endif
+    tile = kd->work + (size_t) t * ws;
+#ifdef _OPENMP
+    #pragma omp for schedule(dynamic)
+#endif
+    for (b = 0; b < ntiles; b++) {
+      i0 = b * DIST_TILE;
+      m = n - i0;
+      if (m > DIST_TILE) m = DIST_TILE;
+      s = kd->tilesums + (size_t) b * k;
+      for (J = 0; J < k; J++)
+        s[J] = 0.0;
+      for (j0 = 0; j0 <= i0; j0 += DIST_TILE) {
+        nj = (j0 == i0) ? m : DIST_TILE;
+        dist_block(kd->X, kd->X, i0, j0, m, nj, FALSE, tile);
+        for (ii = 0; ii < m; ii++) {
+          I = clus[i0 + ii];
+          for (jj = 0; jj < nj && j0 + jj < i0 + ii; jj++)
+            if (clus[j0 + jj] == I)
+              s[I] += tile[(size_t) ii * DIST_TILE + jj];
+        }
+      }
+    }
+  }
+  for (J = 0; J < k; J++)
+    w[J] = 0.0;
+  for (i = 0; i < ntiles; i++)
+    for (J = 0; J < k; J++)
+      w[J] += kd->tilesums[(size_t) i * k + J];
+}
+
+
+int kgroups_update(int k, int *clus, int *sizes, double *w, double *e,
+                   kgroups_data *kd) {
+  /*
+   * k-groups one pass through sample moving one point at a time
+   * k: number of clusters
+   * clus: clustering vector clus(i)==j ==> x_i is in cluster j
+   * sizes: cluster sizes
+   * within: vector of within cluster dispersions
+   * e: scratch of length 2 k
+   * kd: the distances (see point_rowdst)
+   * update clus, sizes, and withins
+   * return count = number of points moved
+   */
+
+  int n = kd->n;
+  int I, J, ix, nI, nJ;
+  double *rowdst = e + k;
+  int best, count = 0;
+
+  for (ix = 0; ix < n; ix++) {
+    I = clus[ix];
+    nI = sizes[I];
+    if (nI > 1) {
+      // calculate the E-distances of this point to each cluster
+      point_rowdst(kd, ix, clus, rowdst);
+
+      best = 0;
+      for (J = 0; J < k; J++) {
+        nJ = sizes[J];
+        e[J] = (2.0 / (double) nJ) * (rowdst[J] - w[J]);
+        if (e[J] < e[best])
+          best = J;
+      }
+
+      if (best != I) {
+        // move this point and update
+        nI = sizes[I];
+        nJ = sizes[best];
+        w[best] = (((double) nJ) * w[best] + rowdst[best]) / ((double) (nJ + 1));
+        w[I] = (((double) nI) * w[I] - rowdst[I]) / ((double) (nI - 1));
+        clus[ix] = best;
+        sizes[I] = nI - 1;
+        sizes[best] = nJ + 1;
+        count ++;  // number of moves
+        }
+      }
+    }
+
+  return count;
+}
+
+
+static void kgroups_init(kgroups_data *kd, const int *clus, int *sizes,
+                         double *within, double *G) {
+  // sizes and within cluster sums of distances (i > j) of clus
+  // G: scratch of length k (k + 1)
+  int I, J, i, j, n = kd->n, k = kd->k;
+
+  for (I = 0; I < k; I++) {
+    sizes[I] = 0;
+    within[I] = 0.0;
+  }
+  for (i = 0; i < n; i++)
+    sizes[clus[i]]++;
+  if (kd->distance) {
+    for (j = 0; j < n; j++) {
+      J = clus[j];
+      const double *xj = kd->x + (size_t) j * n;
+      for (i = j + 1; i < n; i++)
+        if (clus[i] == J)
+          within[J] += xj[i];
+    }
+  } else if (kd->D != NULL) {
+    packed_group_sums(kd->D, clus, k, G, G + k * k);
+    for (I = 0; I < k; I++)
+      within[I] = G[(size_t) I * k + I];
+  } else {
+    within_direct(kd, clus, within);
+  }
+}
+
+
+static void kgroups_iterate(kgroups_data *kd, kgroups_starts *ks, int s,
+                            double *work) {
+  // start s: up to iter_max passes of kgroups_update
+  // work: scratch of length k (k + 3)
+  int I, it = 1, count, n = ks->n, k = ks->k;
+  int *clus = ks->clus + (size_t) s * n, *sizes = ks->sizes + (size_t) s * k;
+  double *within = ks->within + (size_t) s * k, W = 0.0;
+
+  kgroups_init(kd, clus, sizes, within, work);
+  for (I = 0; I < k; I++)
+    within[I] /= ((double) sizes[I]);
+  count = kgroups_update(k, clus, sizes, within, work, kd);
+
+  while (it < ks->iter_max && count > 0) {
+    count = kgroups_update(k, clus, sizes, within, work, kd);
+    it++;
+  }
+  for (I = 0; I < k; I++)
+    W += within[I];
+  ks->W[s] = W;
+  ks->it[s] = it;
+  ks->count[s] = count;
+}
+
+
+static int same_partition(const int *a, const int *b, int n, int k,
+                          int *map) {
+  // true if the labels a and b define the same partition
+  // map: scratch of length 2 k
+  int i, *inv = map + k;
+  for (i = 0; i < k; i++)
+    map[i] = inv[i] = -1;
+  for (i = 0; i < n; i++) {
+    if (map[a[i]] < 0 && inv[b[i]] < 0) {
+      map[a[i]] = b[i];
+      inv[b[i]] = a[i];
+    } else if (map[a[i]] != b[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+static List kgroups_run(kgroups_data *kd, IntegerMatrix clus, int iter_max,
+                        int nrepeat) {
+  // the starts from the columns of clus; returns the best clustering
+  int n = kd->n, k = kd->k, nstart = clus.ncol(), s;
+  int nthreads = 1;
+  // the starts [0, used) are scanned: best, and the starts that found it
+  int used = nstart, next = 0, best = 0, found = 0;
+  std::vector<int> sizes((size_t) k * nstart), it(nstart), count(nstart);
+  std::vector<int> done(nstart, 0), map(2 * (size_t) k);
+  std::vector<double> within((size_t) k * nstart), W(nstart);
+  IntegerMatrix labels = clone(clus);
+  kgroups_starts ks;
+
+  ks.n = n;
+  ks.k = k;
+  ks.nstart = nstart;
+  ks.iter_max = iter_max;
+  ks.clus = labels.begin();
+  ks.sizes = sizes.data();
+  ks.within = within.data();
+  ks.W = W.data();
+  ks.it = it.data();
+  ks.count = count.data();
+
+  // parallel starts if the distances are read from memory
+  if (nstart > 1 && (kd->distance || kd->D != NULL)) {
+    nthreads = num_threads();
+    if (nthreads > nstart) nthreads = nstart;
+    if (nthreads < 1) nthreads = 1;
+  }
+  size_t ws = (size_t) k * (k + 3);
+  std::vector<double> work((size_t) nthreads * ws);
+
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(nthreads) if (nthreads > 1)
+#endif
+  {
+    int t = 0, skip;
+#ifdef _OPENMP
+    t = omp_get_thread_num();
+    #pragma omp for schedule(dynamic)
+#endif
+    for (s = 0; s < nstart; s++) {
+#ifdef _OPENMP
+      #pragma omp critical (kgroups_scan)
+#endif
+      skip = (s >= used);
+      if (skip) continue;
+      kgroups_iterate(kd, &ks, s, work.data() + (size_t) t * ws);
+#ifdef _OPENMP
+      #pragma omp critical (kgroups_scan)
+#endif
+      {
+        done[s] = 1;
+        // extend the scan over the finished starts, in order
+        while (next < used && done[next]) {
+          if (next > 0 && same_partition(ks.clus + (size_t) next * n,
+                                         ks.clus + (size_t) best * n,
+                                         n, k, map.data())) {
+            found++;
+          } else if (next == 0 || W[next] < W[best]) {
+            best = next;
+            found = 1;
+          }
+          next++;
+          if (nrepeat > 0 && found >= nrepeat)
+            used = next;
+        }
+      }
+    }
+  }
+
+  IntegerVector cl(n), sz(k), iters(used);
+  NumericVector w(k), Ws(used);
+  for (s = 0; s < n; s++)
+    cl[s] = ks.clus[(size_t) best * n + s];
+  for (s = 0; s < k; s++) {
+    sz[s] = sizes[(size_t) best * k + s];
+    w[s] = within[(size_t) best * k + s];
+  }
+  for (s = 0; s < used; s++) {
+    iters[s] = it[s];
+    Ws[s] = W[s];
+  }
+
+  return List::create(
+        _["within"] = w,
+        _["W"] = W[best],
+        _["sizes"] = sz,
+        _["cluster"] = cl,
+        _["iterations"] = it[best],
+        _["count"] = count[best],
+        _["start_W"] = Ws,
+        _["start_iterations"] = iters);
+}
+
+
+// [[Rcpp::export]]
+List kgroups_start(NumericMatrix x, int k, IntegerMatrix clus,
+                   int iter_max, bool distance, double cache_mb,
+                   int nrepeat) {
+  // k-groups clustering from each initial clustering vector (column of
+  // clus), up to iter_max iterations of n possible moves each
+  // distance: true if x is distance matrix
+  // cache_mb: memory budget (megabytes) for caching the distances
+  // nrepeat: stop rule of the starts (see above), 0 to run all starts
+  int h, i;
+  int n = x.nrow(), d = x.ncol();
+  std::vector<double> xt, work, tilesums;
+  dist_data X;
+  kgroups_data kd;
+
+  kd.n = n;
+  kd.k = k;
+  kd.distance = distance;
+  kd.x = x.begin();
+  kd.X = NULL;
+  kd.D = NULL;
+  kd.work = NULL;
+  kd.tilesums = NULL;
+  kd.nthreads = num_threads();
+  if (kd.nthreads < 1) kd.nthreads = 1;
+
+  if (distance == false) {
+    // the distance kernel expects the data in row order
+    xt.resize((size_t) n * d);
+    for (h = 0; h < d; h++)
+      for (i = 0; i < n; i++)
+        xt[(size_t) i * d + h] = x(i, h);
+    dist_prepare(&X, xt.data(), n, d, NULL);
+    kd.X = &X;
+    if ((double) PACKED_OFFSET(n) * sizeof(double) <= cache_mb * 1048576.0) {
+      kd.D = alloc_packed(n);
+      packed_distance(xt.data(), kd.D, d);
+    } else {
+      work.resize((size_t) kd.nthreads * dist_worksize(d));
+      tilesums.resize((size_t) ((n + DIST_TILE - 1) / DIST_TILE) * k);
+      kd.work = work.data();
+      kd.tilesums = tilesums.data();
+    }
+  }
+
+  List L = kgroups_run(&kd, clus, iter_max, nrepeat);
+  if (distance == false) {
+    if (kd.D != NULL)
+      free_packed(kd.D);
+    dist_release(&X);
+  }
+  return L;
+}
+
+
+// [[Rcpp::export(.kgroups_handle)]]
+List kgroups_handle(SEXP h, int k, IntegerMatrix clus, int iter_max,
+                    int nrepeat) {
+  // k-groups clustering from the distances of an energy.dist handle
+  dist_handle *H = dist_handle_ptr(h);
+  kgroups_data kd;
+
+  if (H == NULL)
+    stop("not a valid energy.dist handle: create it again with energy.dist");
+
+  kd.n = H->D->n;
+  kd.k = k;
+  kd.distance = false;
+  kd.x = NULL;
+  kd.X = NULL;
+  kd.D = H->D;
+  kd.work = NULL;
+  kd.tilesums = NULL;
+  kd.nthreads = 1;
+  return kgroups_run(&kd, clus, iter_max, nrepeat);
+}
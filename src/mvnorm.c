@@ -0,0 +1,278 @@
+/*
+   mvnorm.c: energy test of multivariate normality
+
+   Szekely, G. J. and Rizzo, M. L. (2005) A New Test for Multivariate
+   Normality, Journal of Multivariate Analysis, 93/1, 58-80.
+
+   For the standardized sample y_1, ..., y_n in R^d the statistic is
+       E = n ((2/n) sum_i E|y_i - Z| - E|Z - Z'|
+              - (1/n^2) sum_{i,j} |y_i - y_j|)
+   where Z, Z' are iid N_d(0, I),
+       E|y - Z| = sqrt(2) G((d+1)/2) / G(d/2) 1F1(-1/2; d/2; -|y|^2/2)
+   and E|Z - Z'| = 2 G((d+1)/2) / G(d/2).
+
+   The sample is standardized by the Cholesky factor L of the sample
+   covariance matrix, y_i = L^{-1} (x_i - xbar).  This differs from the
+   symmetric standardization S^{-1/2} (x_i - xbar) of mvnorm.e in R by
+   an orthogonal transformation, which leaves all the norms and
+   distances, and so the statistic, unchanged.  The sum of distances is
+   computed by the distance kernel (distance.c) without storing the
+   distances, or by sorting if d = 1.
+
+   The statistic does not depend on the mean and covariance of the
+   normal distribution, so the parametric bootstrap replicates are the
+   statistics of samples from N_d(0, I).  They are generated and scored
+   in parallel by sim_replicates (permutation.c).
+
+   energy_mvnorm   .Call: statistic and bootstrap replicates
+*/
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rmath.h>
+#include <float.h>
+#include "distance.h"
+#include "permutation.h"
+
+SEXP energy_mvnorm(SEXP x, SEXP R);
+
+typedef struct {
+    int    n, d;
+    double g;      /* G(d/2) / G((d+1)/2) */
+} mvnorm_data;
+
+static double hyperg_half(double b, double t, double g);
+static int    standardize(double *y, int n, int d, double *S);
+static double mvnorm_stat(double *y, int n, int d, double g, double *work,
+                          int nthreads);
+static int    mvnorm_worksize(int n, int d);
+static void   mvnorm_replicate(rng_state *rng, void *data, double *work,
+                               double *stats);
+
+
+static double hyperg_half(double b, double t, double g)
+{
+    /*
+       1F1(-1/2; b; -t) for t >= 0, g = G(b) / G(b + 1/2)
+       t > 40: the asymptotic series
+           g t^(1/2) sum_k (-1/2)_k (1/2 - b)_k / k! t^(-k)
+       (the remainder is O(exp(-t))) if its terms become negligible
+       before they diverge; otherwise the Kummer transformation
+           exp(-t) 1F1(b + 1/2; b; t),
+       a series of positive terms, rescaled if they could overflow
+    */
+    int    k;
+    double sum, term, prev, scale = 0.0;
+
+    if (t > 40.0) {
+        sum = 1.0;
+        term = 1.0;
+        for (k=1; k<200; k++) {
+            prev = fabs(term);
+            term *= (k - 1.5) * (k - 0.5 - b) / (k * t);
+            if (fabs(term) < DBL_EPSILON * 0.125 * fabs(sum))
+                return g * sqrt(t) * (sum + term);
+            if (fabs(term) > prev)
+                break;
+            sum += term;
+        }
+    }
+
+    sum = 1.0;
+    term = 1.0;
+    for (k=1; ; k++) {
+        term *= (b + k - 0.5) / (b + k - 1.0) * t / k;
+        sum += term;
+        if (k > t && term < DBL_EPSILON * 0.125 * sum)
+            break;
+        if (sum > 1e300) {
+            sum *= 1e-300;
+            term *= 1e-300;
+            scale += 300.0 * M_LN10;
+        }
+    }
+    if (scale == 0.0 && t < 700.0)
+        return sum * exp(-t);
+    return exp(log(sum) + scale - t);
+}
+
+static int standardize(double *y, int n, int d, double *S)
+{
+    /*
+       y (n by d, row order) is replaced by L^{-1} (y_i - ybar), where
+       L L' is the sample covariance matrix
+       S: scratch of length d (d + 1)
+       returns FALSE if y is not finite or its covariance is singular
+    */
+    int    i, a, b;
+    double *m = S + (size_t) d * d, *yi, s;
+
+    for (a=0; a<d; a++)
+        m[a] = 0.0;
+    for (i=0; i<n; i++) {
+        yi = y + (size_t) i * d;
+        for (a=0; a<d; a++)
+            m[a] += yi[a];
+    }
+    for (a=0; a<d; a++) {
+        m[a] /= (double) n;
+        if (!R_FINITE(m[a]))
+            return FALSE;
+    }
+    /* lower triangle of the covariance, S[a*d + b], b <= a */
+    for (a=0; a<d*d; a++)
+        S[a] = 0.0;
+    for (i=0; i<n; i++) {
+        yi = y + (size_t) i * d;
+        for (a=0; a<d; a++)
+            yi[a] -= m[a];
+        for (a=0; a<d; a++)
+            for (b=0; b<=a; b++)
+                S[a*d + b] += yi[a] * yi[b];
+    }
+    /* Cholesky factor in place; m holds the diagonal of S */
+    for (a=0; a<d; a++)
+        m[a] = S[a*d + a];
+    for (a=0; a<d; a++) {
+        for (b=0; b<=a; b++) {
+            s = S[a*d + b];
+            for (i=0; i<b; i++)
+                s -= S[a*d + i] * S[b*d + i];
+            if (b < a) {
+                S[a*d + b] = s / S[b*d + b];
+            } else {
+                if (!(s > (double) d * DBL_EPSILON * m[a]))
+                    return FALSE;
+                S[a*d + a] = sqrt(s);
+            }
+        }
+    }
+    s = sqrt((double) (n - 1));
+    for (i=0; i<n; i++) {
+        yi = y + (size_t) i * d;
+        for (a=0; a<d; a++) {
+            for (b=0; b<a; b++)
+                yi[a] -= S[a*d + b] * yi[b];
+            yi[a] /= S[a*d + a];
+        }
+        for (a=0; a<d; a++)
+            yi[a] *= s;
+    }
+    return TRUE;
+}
+
+static int mvnorm_worksize(int n, int d)
+{
+    /* scratch of mvnorm_stat */
+    return d * (d + 1) + n + dist_worksize(d);
+}
+
+static double mvnorm_stat(double *y, int n, int d, double g, double *work,
+                          int nthreads)
+{
+    /*
+       E-statistic of the n by d sample y (row order), overwritten
+       g = G(d/2) / G((d+1)/2)
+       work: scratch of length mvnorm_worksize(n, d)
+       nthreads: threads for the sum of distances, or 0 to sum on the
+       calling thread without allocation (bootstrap replicates)
+       returns NA if y cannot be standardized
+    */
+    int    i, k;
+    double b = 0.5 * d, t, mean1 = 0.0, mean2, mean3, sum = 0.0, *yi;
+    dist_data Y;
+
+    if (!standardize(y, n, d, work))
+        return NA_REAL;
+    for (i=0; i<n; i++) {
+        yi = y + (size_t) i * d;
+        t = 0.0;
+        for (k=0; k<d; k++)
+            t += yi[k] * yi[k];
+        mean1 += hyperg_half(b, 0.5 * t, g);
+    }
+    mean1 *= M_SQRT2 / (g * (double) n);
+    mean2 = 2.0 / g;
+
+    if (d == 1) {
+        R_rsort(y, n);
+        for (i=0; i<n; i++)
+            sum += (2.0 * i - n + 1.0) * y[i];
+    } else if (nthreads > 0) {
+        dist_prepare(&Y, y, n, d, NULL);
+        sum = dist_psum(&Y, &Y, 1.0, nthreads);
+        dist_release(&Y);
+    } else {
+        dist_attach(&Y, y, n, d, work + d * (d + 1));
+        sum = dist_wsum(&Y, &Y, work + d * (d + 1) + n);
+    }
+    mean3 = 2.0 * sum / ((double) n * n);
+    return n * (2.0 * mean1 - mean2 - mean3);
+}
+
+static void mvnorm_replicate(rng_state *rng, void *data, double *work,
+                             double *stats)
+{
+    /* statistic of a N_d(0, I) sample; work: n d, then mvnorm_stat */
+    mvnorm_data *md = (mvnorm_data *) data;
+    int    n = md->n, d = md->d;
+
+    rng_norm(rng, work, n * d);
+    stats[0] = mvnorm_stat(work, n, d, md->g, work + (size_t) n * d, 0);
+}
+
+
+SEXP energy_mvnorm(SEXP x, SEXP R)
+{
+    /*
+       x  n by d data matrix (d = 1: a vector)
+       R  number of bootstrap replicates
+       returns list(statistic, replicates)
+    */
+    int    i, k, n, d, B = asInteger(R);
+    double *px = REAL(x), *y, *work;
+    mvnorm_data md;
+    perm_stop stop;
+    SEXP   ans, stat, reps, nms;
+
+    if (isMatrix(x)) {
+        n = nrows(x);
+        d = ncols(x);
+    } else {
+        n = LENGTH(x);
+        d = 1;
+    }
+    if (B == NA_INTEGER || B < 0) B = 0;
+    md.n = n;
+    md.d = d;
+    md.g = exp(lgammafn(0.5 * d) - lgammafn(0.5 * (d + 1)));
+
+    PROTECT(stat = allocVector(REALSXP, 1));
+    PROTECT(reps = allocVector(REALSXP, B));
+    y = Calloc((size_t) n * d, double);
+    work = Calloc(mvnorm_worksize(n, d), double);
+    for (i=0; i<n; i++)
+        for (k=0; k<d; k++)
+            y[(size_t) i*d + k] = px[(size_t) k*n + i];
+    REAL(stat)[0] = mvnorm_stat(y, n, d, md.g, work, num_threads());
+    Free(y);
+    Free(work);
+    if (B > 0) {
+        stop.observed = REAL(stat)[0];
+        stop.strict = FALSE;
+        stop.plus1 = FALSE;
+        sim_replicates_stop(B, 1, mvnorm_replicate, &md,
+                            (size_t) n * d + mvnorm_worksize(n, d),
+                            REAL(reps), &stop);
+    }
+
+    PROTECT(ans = allocVector(VECSXP, 2));
+    PROTECT(nms = allocVector(STRSXP, 2));
+    SET_VECTOR_ELT(ans, 0, stat);
+    SET_VECTOR_ELT(ans, 1, reps);
+    SET_STRING_ELT(nms, 0, mkChar("statistic"));
+    SET_STRING_ELT(nms, 1, mkChar("replicates"));
+    setAttrib(ans, R_NamesSymbol, nms);
+    UNPROTECT(4);
+    return ans;
+}
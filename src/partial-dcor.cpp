@@ -1,12 +1,55 @@
 #include <Rcpp.h>
 using namespace Rcpp;
 
+#include <vector>
+#include "permutation.h"
+#include "utilities.h"
+
+// pdcov_test: the pdcov statistic and its permutation replicates.
+// The projections Pxz, Pyz are computed once, as packed lower
+// triangles, from the distance matrices and their row means; a
+// replicate is the U_product (Pxz[perm, perm], Pyz), read through the
+// permutation by blocks of rows of Pxz (packed_perm_sum, utilities.c)
+// with no copy of the matrix, and the replicates are computed by
+// perm_replicates (permutation.c).
+
 NumericVector partial_dcor(NumericMatrix Dx, NumericMatrix Dy, NumericMatrix Dz);
 double        partial_dcov(NumericMatrix Dx, NumericMatrix Dy, NumericMatrix Dz);
+List          pdcov_test(NumericMatrix Dx, NumericMatrix Dy, NumericMatrix Dz,
+                         int R);
+static double projected_product(double AB, double AC, double BC, double CC);
+static void   projected_packed(const double *Dx, const double *Dz,
+                               const double *mx, const double *mz,
+                               double c, int n, packed_matrix *P);
+static double packed_U_product(packed_matrix *P, packed_matrix *Q);
+
+struct pdcov_perm_data {
+  packed_matrix *P, *Q;
+};
+
+extern "C" {
+static double pdcov_row(int i, const double *row, void *ctx);
+static double pdcov_replicate(const int *perm, void *data, double *work);
+}
 
-NumericMatrix U_center(NumericMatrix);
-double        U_product(NumericMatrix U, NumericMatrix V);
-NumericMatrix projection(NumericMatrix Dx, NumericMatrix Dz);
+void          U_center_means(const double *D, int n, double *m);
+void          U_gram(const double * const *D, int p, int n, double *G);
+
+static double projected_product(double AB, double AC, double BC, double CC) {
+  /*
+  (Pxz, Pyz), the U_product of the projections Pxz = A - c1 C and
+  Pyz = B - c2 C (see projection), from the products of A, B, C:
+  (Pxz, Pyz) = (A,B) - c2 (A,C) - c1 (B,C) + c1 c2 (C,C)
+  */
+  double c1 = 0.0, c2 = 0.0;
+  double eps = std::numeric_limits<double>::epsilon();  //machine epsilon
+  // if (C,C)==0 then C=0 and both (A,C)=0 and (B,C)=0
+  if (fabs(CC) > eps) {
+    c1 = AC / CC;
+    c2 = BC / CC;
+  }
+  return AB - c2 * AC - c1 * BC + c1 * c2 * CC;
+}
 
 // [[Rcpp::export]]
 NumericVector partial_dcor(NumericMatrix Dx, NumericMatrix Dy, NumericMatrix Dz) {
@@ -16,22 +59,21 @@ NumericVector partial_dcor(NumericMatrix Dx, NumericMatrix Dy, NumericMatrix Dz)
   partial_dcor returns vector [Rxyz, Rxy, Rxz, Ryz] starred versions
   */
   int    n = Dx.nrow();
-  NumericMatrix A(n, n), B(n, n), C(n, n);
+  const double *D[3] = {Dx.begin(), Dy.begin(), Dz.begin()};
+  double G[9];
   double Rxy=0.0, Rxz=0.0, Ryz=0.0, Rxyz=0.0, den;
   double AB, AC, BC, AA, BB, CC, pDCOV;
   double eps = std::numeric_limits<double>::epsilon();  //machine epsilon
 
-  A = U_center(Dx);           /* U-centering to get A^U etc. */
-  B = U_center(Dy);
-  C = U_center(Dz);
-
-  AB = U_product(A, B);
-  AC = U_product(A, C);
-  BC = U_product(B, C);
-  AA = U_product(A, A);
-  BB = U_product(B, B);
-  CC = U_product(C, C);
-  pDCOV = U_product(projection(Dx, Dz), projection(Dy, Dz));
+  /* U-centering to get A^U etc. and the six products in one pass */
+  U_gram(D, 3, n, G);
+  AA = G[0];
+  AB = G[1];
+  AC = G[2];
+  BB = G[4];
+  BC = G[5];
+  CC = G[8];
+  pDCOV = projected_product(AB, AC, BC, CC);
 
   den = sqrt(AA*BB);
   if (den > eps)
@@ -67,33 +109,129 @@ double partial_dcov(NumericMatrix Dx, NumericMatrix Dy, NumericMatrix Dz) {
   returns pdcov sample coefficient
   */
   int    n = Dx.nrow();
-  int    i, j;
-  NumericMatrix A(n, n), B(n, n), C(n, n), Pxz(n, n), Pyz(n, n);
-  double AC, BC, CC, c1, c2;
-  double eps = std::numeric_limits<double>::epsilon();  //machine epsilon
+  const double *D[3] = {Dx.begin(), Dy.begin(), Dz.begin()};
+  double G[9];
 
-  A = U_center(Dx);           /* U-centering to get A^U etc. */
-  B = U_center(Dy);
-  C = U_center(Dz);
+  U_gram(D, 3, n, G);
+  return projected_product(G[1], G[2], G[5], G[8]);
+}
 
-  AC = U_product(A, C);
-  BC = U_product(B, C);
-  CC = U_product(C, C);
 
-  c1 = c2 = 0.0;
-  // if (C,C)==0 then C=0 and both (A,C)=0 and (B,C)=0
-  if (fabs(CC) > eps) {
-    c1 = AC / CC;
-    c2 = BC / CC;
-  }
+static void projected_packed(const double *Dx, const double *Dz,
+                             const double *mx, const double *mz,
+                             double c, int n, packed_matrix *P) {
+  /*
+  P = A - c C, the projection of the U-centered A of Dx onto the
+  orthogonal complement of the U-centered C of Dz (see projection),
+  as a packed lower triangle with zero diagonal
+  mx, mz are the row means of Dx, Dz (U_center_means)
+  */
+  int i, j;
+  const double *Dxi, *Dzi;
+  double *Pi;
 
   for (i=0; i<n; i++) {
-    for (j=0; j<n; j++) {
-      Pxz(i, j) = A(i, j) - c1 * C(i, j);
-      Pyz(i, j) = B(i, j) - c2 * C(i, j);
-    }
+    // row i of the symmetric matrices is column i (contiguous)
+    Dxi = Dx + (size_t) i * n;
+    Dzi = Dz + (size_t) i * n;
+    Pi = P->x + PACKED_OFFSET(i);
+    for (j=0; j<i; j++)
+      Pi[j] = (Dxi[j] - mx[i] - mx[j] + mx[n])
+        - c * (Dzi[j] - mz[i] - mz[j] + mz[n]);
+    Pi[i] = 0.0;
+  }
+}
+
+static double packed_U_product(packed_matrix *P, packed_matrix *Q) {
+  // U_product of two packed U-centered matrices
+  int i, j, n = P->n;
+  double *Pi, *Qi, sums = 0.0;
+
+  for (i=1; i<n; i++) {
+    Pi = P->x + PACKED_OFFSET(i);
+    Qi = Q->x + PACKED_OFFSET(i);
+    for (j=0; j<i; j++)
+      sums += Pi[j] * Qi[j];
   }
+  return 2.0 * sums / ((double) n * (n-3));
+}
+
+extern "C" {
+static double pdcov_row(int i, const double *row, void *ctx) {
+  // row i of the sum of Pyz(i, j) Pxz(perm[i], perm[j]), j < i
+  packed_matrix *Q = (packed_matrix *) ctx;
+  int j;
+  double *Qi = Q->x + PACKED_OFFSET(i), dsum = 0.0;
+
+  for (j=0; j<i; j++)
+    dsum += Qi[j] * row[j];
+  return dsum;
+}
 
-  return U_product(Pxz, Pyz);
+static double pdcov_replicate(const int *perm, void *data, double *work) {
+  // U_product (Pxz[perm, perm], Pyz); work: packed_perm_worksize(n)
+  pdcov_perm_data *pd = (pdcov_perm_data *) data;
+  int n = pd->P->n;
+  double sums;
+
+  sums = packed_perm_sum(pd->P, perm, pdcov_row, pd->Q, work);
+  return 2.0 * sums / ((double) n * (n-3));
+}
 }
 
+
+// [[Rcpp::export(.pdcov_test)]]
+List pdcov_test(NumericMatrix Dx, NumericMatrix Dy, NumericMatrix Dz, int R) {
+  /*
+  pdcov test of Dx, Dy given Dz (distance matrices)
+  returns the statistic n pdcov, the estimate pdcor and R
+  permutation replicates of the statistic
+  */
+  int    i, n = Dx.nrow();
+  const double *D[3] = {Dx.begin(), Dy.begin(), Dz.begin()};
+  double G[9], c1 = 0.0, c2 = 0.0, PQ, PP, QQ, den, pdcor = 0.0;
+  double eps = std::numeric_limits<double>::epsilon();  //machine epsilon
+  std::vector<double> mx(n + 1), my(n + 1), mz(n + 1);
+  NumericVector reps(R > 0 ? R : 0);
+  pdcov_perm_data pd;
+  perm_stop stop;
+
+  U_gram(D, 3, n, G);
+  // if (C,C)==0 then C==0 and the projections are A and B
+  if (fabs(G[8]) > eps) {
+    c1 = G[2] / G[8];
+    c2 = G[5] / G[8];
+  }
+  U_center_means(Dx.begin(), n, mx.data());
+  U_center_means(Dy.begin(), n, my.data());
+  U_center_means(Dz.begin(), n, mz.data());
+  pd.P = alloc_packed(n);
+  pd.Q = alloc_packed(n);
+  projected_packed(Dx.begin(), Dz.begin(), mx.data(), mz.data(), c1, n, pd.P);
+  projected_packed(Dy.begin(), Dz.begin(), my.data(), mz.data(), c2, n, pd.Q);
+
+  PQ = packed_U_product(pd.P, pd.Q);
+  PP = packed_U_product(pd.P, pd.P);
+  QQ = packed_U_product(pd.Q, pd.Q);
+  den = sqrt(PP * QQ);
+  if (den > 0.0)
+    pdcor = PQ / den;
+
+  if (R > 0) {
+    // the sequential rule counts replicates > PQ, as pdcov.test
+    stop.observed = PQ;
+    stop.strict = TRUE;
+    stop.plus1 = TRUE;
+    perm_replicates_stop(n, R, pdcov_replicate, &pd,
+                         (int) packed_perm_worksize(n), reps.begin(), &stop);
+    for (i=0; i<stop.used; i++)
+      reps[i] *= (double) n;
+  }
+  free_packed(pd.P);
+  free_packed(pd.Q);
+
+  return List::create(
+    _["statistic"] = n * PQ,
+    _["estimate"] = pdcor,
+    _["replicates"] = reps);
+}
@@ -0,0 +1,493 @@
+/*
+   permutation.c: parallel replicate engine for the permutation tests
+   in the energy package
+
+   The replicates of a permutation test are independent, so they are
+   scored in parallel (OpenMP) when the package is compiled with OpenMP
+   support and energy.threads() > 1.
+
+   R's RNG is not thread safe, so it is used only once per test, on the
+   main thread, to draw a 64-bit seed.  Replicate r then generates its
+   own permutation from a private xoshiro256** stream seeded by
+   splitmix64(seed, r).  The permutation used by replicate r depends only
+   on the seed and r, so the replicates (and p-values) are identical for
+   a given set.seed() no matter how many threads are used.
+
+   energy_threads     .Call entry point: get/set the number of threads
+   rng_seed           draw a 64-bit seed from R's RNG (main thread only)
+   rng_stream         initialize the private stream for replicate r
+   rng_unif           uniform (0,1) deviate from a private stream
+   rng_permute        permute the first n elements of an integer vector
+   rng_norm           standard normal deviates from a private stream
+   rng_pois           Poisson deviate from a private stream
+   perm_replicates    compute R permutation replicates of a statistic
+   sim_replicates     compute R simulated (parametric bootstrap)
+                      replicates of a statistic
+   energy_sequential  .Call entry point: get/set the sequential rule
+   perm_replicates_stop, sim_replicates_stop
+                      the same, stopping early by the sequential rule
+   perm_pvalue        p-value of replicates that may have stopped early
+
+   Sequential rule (energy.sequential): the replicates stop at the first
+   L at which h of them exceed the observed statistic (Besag and
+   Clifford 1991, Biometrika 78, 301-304), and the p-value is h / L.
+   With alpha, h = floor(alpha (R + 1)) is the number of exceedances
+   at which the p-value (1 + h) / (R + 1) of all R replicates would be
+   above alpha (h = floor(alpha R) + 1 for the p-value M / R), so the
+   decision at alpha is the same as with all R replicates; a stop by
+   this rule reports that p-value of h exceedances, a lower bound of
+   the p-value of all R replicates (h / L can be below alpha).  The replicates are computed in batches in parallel and
+   scanned in order, so L does not depend on the number of threads.
+
+   The time, scratch and number of replicates of perm_replicates and
+   sim_replicates are counted by profile.c when energy.profile is on.
+*/
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rmath.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "permutation.h"
+#include "profile.h"
+
+SEXP     energy_threads(SEXP nthreads);
+SEXP     energy_sequential(SEXP h, SEXP alpha);
+
+static int energy_nthreads = 1;
+static int    seq_h = 0;          /* stop after h exceedances, 0: off */
+static double seq_alpha = 0.0;    /* h from alpha and R, 0: off */
+
+#define PERM_SEQ_BATCH 32
+
+static int  sequential_h(int R, int plus1, int *bounded);
+static int  stop_scan(perm_stop *stop, const double *reps, int r0, int r1,
+                      int h);
+
+SEXP energy_threads(SEXP nthreads)
+{
+    /*
+       set the number of threads used by the permutation tests
+       nthreads : NULL to query, 0 for all available processors,
+                  otherwise the number of threads
+       returns the previous setting
+    */
+    int old = energy_nthreads, n;
+
+    if (!isNull(nthreads)) {
+        n = asInteger(nthreads);
+        if (n == NA_INTEGER || n < 0)
+            error("number of threads must be a non-negative integer");
+#ifdef _OPENMP
+        if (n == 0)
+            n = omp_get_num_procs();
+#else
+        n = 1;
+#endif
+        energy_nthreads = n;
+    }
+    return ScalarInteger(old);
+}
+
+int num_threads(void)
+{
+    return energy_nthreads;
+}
+
+SEXP energy_sequential(SEXP h, SEXP alpha)
+{
+    /*
+       set the sequential rule of the permutation tests
+       h     : NULL to query, otherwise the number of exceedances at
+               which the replicates stop (0: off)
+       alpha : NULL to query, otherwise the level at which the decision
+               is settled (0: off)
+       returns the previous setting c(h, alpha)
+    */
+    int    k;
+    double a;
+    SEXP   old;
+
+    PROTECT(old = allocVector(REALSXP, 2));
+    REAL(old)[0] = (double) seq_h;
+    REAL(old)[1] = seq_alpha;
+    if (!isNull(h)) {
+        k = asInteger(h);
+        if (k == NA_INTEGER || k < 0)
+            error("h must be a non-negative integer");
+        seq_h = k;
+    }
+    if (!isNull(alpha)) {
+        a = asReal(alpha);
+        if (ISNAN(a) || a < 0.0 || a >= 1.0)
+            error("alpha must be in [0, 1)");
+        seq_alpha = a;
+    }
+    UNPROTECT(1);
+    return old;
+}
+
+static int sequential_h(int R, int plus1, int *bounded)
+{
+    /*
+       the number of exceedances at which R replicates stop, 0: never
+       plus1: the p-value is (1 + M) / (1 + R), else M / R
+       bounded: TRUE if it is set by the alpha rule
+    */
+    int h = seq_h, ha;
+    *bounded = FALSE;
+    if (seq_alpha > 0.0) {
+        if (plus1)
+            ha = (int) floor(seq_alpha * (R + 1.0));
+        else
+            ha = (int) floor(seq_alpha * R) + 1;
+        if (ha < 1) ha = 1;
+        if (h == 0 || ha <= h) {
+            h = ha;
+            *bounded = TRUE;
+        }
+    }
+    return h;
+}
+
+static int stop_scan(perm_stop *stop, const double *reps, int r0, int r1,
+                     int h)
+{
+    /*
+       count the exceedances of reps[r0:(r1-1)] in order: TRUE and
+       stop->used = r + 1 at the replicate r at which h are reached,
+       otherwise stop->used = r1
+    */
+    int r;
+    for (r=r0; r<r1; r++) {
+        if (stop->strict ? reps[r] > stop->observed :
+                           reps[r] >= stop->observed)
+            stop->count++;
+        if (h > 0 && stop->count >= h) {
+            stop->used = r + 1;
+            return TRUE;
+        }
+    }
+    stop->used = r1;
+    return FALSE;
+}
+
+double perm_pvalue(const perm_stop *stop, int R)
+{
+    /*
+       h / L if the replicates stopped early by the h rule, otherwise
+       (1 + M) / (R + 1), or M / R (a lower bound if stopped by the
+       alpha rule)
+    */
+    if (stop->used < R && !stop->bounded)
+        return (double) stop->count / (double) stop->used;
+    if (!stop->plus1)
+        return (double) stop->count / (double) R;
+    return (double) (stop->count + 1) / (double) (R + 1);
+}
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl(const uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+uint64_t rng_seed(void)
+{
+    /*
+       draw a 64-bit seed from R's RNG
+       must be called on the main thread, inside GetRNGstate/PutRNGstate
+    */
+    uint64_t hi, lo;
+    hi = (uint64_t) floor(unif_rand() * 4294967296.0);
+    lo = (uint64_t) floor(unif_rand() * 4294967296.0);
+    return (hi << 32) ^ lo;
+}
+
+void rng_stream(rng_state *rng, uint64_t seed, uint64_t stream)
+{
+    /* xoshiro256** state for stream number 'stream' of the given seed */
+    uint64_t x = seed ^ splitmix64(&stream);
+    int i;
+    for (i = 0; i < 4; i++)
+        rng->s[i] = splitmix64(&x);
+}
+
+double rng_unif(rng_state *rng)
+{
+    /* xoshiro256**, top 53 bits as a deviate in (0,1) */
+    uint64_t *s = rng->s;
+    const uint64_t result = rotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return ((double) (result >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+void rng_permute(rng_state *rng, int *J, int n)
+{
+    /* same algorithm as permute() in utilities.c, private stream */
+    int i, j, j0, m=n;
+    for (i=0; i<n-1; i++) {
+        j = (int) floor(rng_unif(rng) * m);
+        m--;
+        j0 = J[j];
+        J[j] = J[m];
+        J[m] = j0;
+    }
+}
+
+void rng_norm(rng_state *rng, double *z, int n)
+{
+    /* z[0:(n-1)] iid N(0,1), Box-Muller transform of pairs of deviates */
+    int i;
+    double r, u;
+    for (i=0; i<n; i+=2) {
+        r = sqrt(-2.0 * log(rng_unif(rng)));
+        u = 2.0 * M_PI * rng_unif(rng);
+        z[i] = r * cos(u);
+        if (i + 1 < n)
+            z[i + 1] = r * sin(u);
+    }
+}
+
+static double log_factorial(double k)
+{
+    /* log(k!) for integer k >= 0: Stirling series, exact below 10 */
+    static const double lf[10] = {
+        0.0, 0.0, 0.69314718055994531, 1.7917594692280550,
+        3.1780538303479458, 4.7874917427820458, 6.5792512120101012,
+        8.5251613610654147, 10.604602902745251, 12.801827480081469};
+    double x, x2;
+    if (k < 10.0)
+        return lf[(int) k];
+    x = k + 1.0;
+    x2 = 1.0 / (x * x);
+    return (x - 0.5) * log(x) - x + 0.91893853320467274 +
+        (1.0/12.0 - x2 * (1.0/360.0 - x2 * (1.0/1260.0 - x2 / 1680.0))) / x;
+}
+
+int rng_pois(rng_state *rng, double lambda)
+{
+    /*
+       Poisson(lambda) deviate: multiplication of uniforms if
+       lambda < 10, otherwise the transformed rejection method PTRS of
+       Hormann (1993), Insurance: Mathematics and Economics 12, 39-45
+    */
+    int    k;
+    double p, e, U, V, us, a, b, vr, invalpha, loglam;
+
+    if (lambda < 10.0) {
+        e = exp(-lambda);
+        p = rng_unif(rng);
+        for (k=0; p > e; k++)
+            p *= rng_unif(rng);
+        return k;
+    }
+    loglam = log(lambda);
+    b = 0.931 + 2.53 * sqrt(lambda);
+    a = -0.059 + 0.02483 * b;
+    invalpha = 1.1239 + 1.1328 / (b - 3.4);
+    vr = 0.9277 - 3.6224 / (b - 2.0);
+    for (;;) {
+        U = rng_unif(rng) - 0.5;
+        V = rng_unif(rng);
+        us = 0.5 - fabs(U);
+        k = (int) floor((2.0 * a / us + b) * U + lambda + 0.43);
+        if (us >= 0.07 && V <= vr)
+            return k;
+        if (k < 0 || (us < 0.013 && V > us))
+            continue;
+        if (log(V) + log(invalpha) - log(a / (us * us) + b) <=
+            -lambda + k * loglam - log_factorial((double) k))
+            return k;
+    }
+}
+
+void perm_replicates(int n, int R, perm_statistic statistic, void *data,
+                     int worksize, double *reps)
+{
+    /*
+       reps[r] = statistic(perm_r, data, work), r = 0, ..., R-1
+       perm_r is a random permutation of 0:(n-1) generated from
+       stream r of a seed drawn from R's RNG, so reps does not depend
+       on the number of threads
+       statistic must be thread safe: no R API calls, no allocation
+    */
+    perm_replicates_stop(n, R, statistic, data, worksize, reps, NULL);
+}
+
+void perm_replicates_stop(int n, int R, perm_statistic statistic,
+                          void *data, int worksize, double *reps,
+                          perm_stop *stop)
+{
+    /*
+       perm_replicates; if stop is not NULL the exceedances of
+       stop->observed are counted and the replicates stop by the
+       sequential rule: stop->used replicates are computed and the
+       others are NA
+    */
+    int nthreads = energy_nthreads, h, r0, r1, batch, done = FALSE, r;
+    int *perms;
+    double *works = NULL, t0;
+    uint64_t seed;
+
+    if (R < 1) return;
+    if (nthreads > R) nthreads = R;
+    if (nthreads < 1) nthreads = 1;
+    h = (stop != NULL) ? sequential_h(R, stop->plus1, &stop->bounded) : 0;
+    batch = (h > 0) ? PERM_SEQ_BATCH * nthreads : R;
+    if (stop != NULL) {
+        stop->count = 0;
+        stop->used = 0;
+    }
+    t0 = prof_start();
+
+    /* per-thread scratch is allocated here, on the main thread */
+    perms = Calloc((size_t) nthreads * n, int);
+    if (worksize > 0)
+        works = Calloc((size_t) nthreads * worksize, double);
+    prof_alloc((size_t) nthreads * n * sizeof(int) +
+               (size_t) nthreads * (worksize > 0 ? worksize : 0) *
+               sizeof(double));
+
+    GetRNGstate();
+    seed = rng_seed();
+    PutRNGstate();
+
+    for (r0 = 0; r0 < R && !done; r0 = r1) {
+        r1 = (R - r0 > batch) ? r0 + batch : R;
+#ifdef _OPENMP
+        #pragma omp parallel num_threads(nthreads)
+#endif
+        {
+            int       i, r, t = 0;
+            int       *perm;
+            double    *work = NULL;
+            rng_state rng;
+
+#ifdef _OPENMP
+            t = omp_get_thread_num();
+#endif
+            perm = perms + (size_t) t * n;
+            if (worksize > 0)
+                work = works + (size_t) t * worksize;
+#ifdef _OPENMP
+            #pragma omp for schedule(dynamic)
+#endif
+            for (r = r0; r < r1; r++) {
+                rng_stream(&rng, seed, (uint64_t) r);
+                for (i = 0; i < n; i++) perm[i] = i;
+                rng_permute(&rng, perm, n);
+                reps[r] = statistic(perm, data, work);
+            }
+        }
+        if (stop != NULL)
+            done = stop_scan(stop, reps, r0, r1, h);
+    }
+    r1 = (stop != NULL) ? stop->used : R;
+    for (r = r1; r < R; r++)
+        reps[r] = NA_REAL;
+
+    Free(perms);
+    if (works != NULL) Free(works);
+    prof_replicates(r1);
+    prof_stop(PROF_REPLICATES, t0);
+}
+
+void sim_replicates(int R, int nstats, sim_statistic statistic,
+                    void *data, size_t worksize, double *reps)
+{
+    /*
+       statistic(rng_r, data, work, stats) for r = 0, ..., R-1, with
+       reps[r + j*R] = stats[j], j < nstats (R by nstats)
+       rng_r is stream r of a seed drawn from R's RNG, as in
+       perm_replicates, so reps does not depend on the number of threads
+       statistic must be thread safe: no R API calls, no allocation
+    */
+    sim_replicates_stop(R, nstats, statistic, data, worksize, reps, NULL);
+}
+
+void sim_replicates_stop(int R, int nstats, sim_statistic statistic,
+                         void *data, size_t worksize, double *reps,
+                         perm_stop *stop)
+{
+    /*
+       sim_replicates; if stop is not NULL the replicates of the first
+       statistic stop by the sequential rule, as perm_replicates_stop
+    */
+    int nthreads = energy_nthreads, h, r0, r1, batch, done = FALSE, r, j;
+    double *works, *stats, t0;
+    uint64_t seed;
+
+    if (R < 1) return;
+    if (nthreads > R) nthreads = R;
+    if (nthreads < 1) nthreads = 1;
+    h = (stop != NULL) ? sequential_h(R, stop->plus1, &stop->bounded) : 0;
+    batch = (h > 0) ? PERM_SEQ_BATCH * nthreads : R;
+    if (stop != NULL) {
+        stop->count = 0;
+        stop->used = 0;
+    }
+    t0 = prof_start();
+
+    works = Calloc((size_t) nthreads * worksize + 1, double);
+    stats = Calloc((size_t) nthreads * nstats, double);
+    prof_alloc(((size_t) nthreads * (worksize + nstats) + 1) *
+               sizeof(double));
+
+    GetRNGstate();
+    seed = rng_seed();
+    PutRNGstate();
+
+    for (r0 = 0; r0 < R && !done; r0 = r1) {
+        r1 = (R - r0 > batch) ? r0 + batch : R;
+#ifdef _OPENMP
+        #pragma omp parallel num_threads(nthreads)
+#endif
+        {
+            int       j, r, t = 0;
+            double    *work, *st;
+            rng_state rng;
+
+#ifdef _OPENMP
+            t = omp_get_thread_num();
+#endif
+            work = works + (size_t) t * worksize;
+            st = stats + (size_t) t * nstats;
+#ifdef _OPENMP
+            #pragma omp for schedule(dynamic)
+#endif
+            for (r = r0; r < r1; r++) {
+                rng_stream(&rng, seed, (uint64_t) r);
+                statistic(&rng, data, work, st);
+                for (j = 0; j < nstats; j++)
+                    reps[r + (size_t) j * R] = st[j];
+            }
+        }
+        if (stop != NULL)
+            done = stop_scan(stop, reps, r0, r1, h);
+    }
+    r1 = (stop != NULL) ? stop->used : R;
+    for (j = 0; j < nstats; j++)
+        for (r = r1; r < R; r++)
+            reps[r + (size_t) j * R] = NA_REAL;
+
+    Free(works);
+    Free(stats);
+    prof_replicates(r1);
+    prof_stop(PROF_REPLICATES, t0);
+}
@@ -0,0 +1,64 @@
+/*
+   permutation.h: replicate engine for the permutation tests
+   (see permutation.c)
+*/
+
+#ifndef ENERGY_PERMUTATION_H
+#define ENERGY_PERMUTATION_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+    uint64_t s[4];
+} rng_state;
+
+/* statistic for one replicate: perm is a permutation of 0:(n-1),
+   work is a private scratch vector of the size requested by the caller */
+typedef double (*perm_statistic)(const int *perm, void *data, double *work);
+
+/* statistics for one simulated (parametric bootstrap) replicate:
+   the sample is generated from the private stream rng and the
+   statistics are stored in stats */
+typedef void (*sim_statistic)(rng_state *rng, void *data, double *work,
+                              double *stats);
+
+/* sequential stopping of the replicates (energy.sequential):
+   the replicates that exceed the observed statistic are counted */
+typedef struct {
+    double observed;   /* the statistic of the sample */
+    int    strict;     /* TRUE: exceedance is rep > observed, else >= */
+    int    plus1;      /* TRUE: p-value (1 + M) / (1 + R), else M / R */
+    int    count;      /* exceedances (set by the engine) */
+    int    used;       /* replicates computed (set by the engine) */
+    int    bounded;    /* TRUE if the alpha rule sets the stop (engine) */
+} perm_stop;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int      num_threads(void);
+uint64_t rng_seed(void);
+void     rng_stream(rng_state *rng, uint64_t seed, uint64_t stream);
+double   rng_unif(rng_state *rng);
+void     rng_permute(rng_state *rng, int *J, int n);
+void     rng_norm(rng_state *rng, double *z, int n);
+int      rng_pois(rng_state *rng, double lambda);
+void     perm_replicates(int n, int R, perm_statistic statistic, void *data,
+                         int worksize, double *reps);
+void     sim_replicates(int R, int nstats, sim_statistic statistic,
+                        void *data, size_t worksize, double *reps);
+void     perm_replicates_stop(int n, int R, perm_statistic statistic,
+                              void *data, int worksize, double *reps,
+                              perm_stop *stop);
+void     sim_replicates_stop(int R, int nstats, sim_statistic statistic,
+                             void *data, size_t worksize, double *reps,
+                             perm_stop *stop);
+double   perm_pvalue(const perm_stop *stop, int R);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
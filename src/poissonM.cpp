@@ -1,53 +1,245 @@
 #include <Rcpp.h>
 using namespace Rcpp;
 
+#include <vector>
+#include <algorithm>
+#include "permutation.h"
+
+// Poisson goodness-of-fit statistics from the histogram of the counts
+//
+// The M statistics (M-CvM, M-AD) need the mean distances
+//   m_k = (1/n) sum_j |x_j - k|,  k = 1, ..., q + 1,
+// q = qpois(1 - 1e-10, lambda).  With c_k = #{x_j < k} and
+// s_k = sum_{x_j < k} x_j,
+//   n m_k = k c_k - s_k + (S - s_k) - k (n - c_k),
+// so all of them come from one pass over the histogram (prefix sums
+// c_k, s_k) in O(n + q) instead of O(n q).  The energy statistic E is
+// computed from the same histogram: sum_{i,j} |x_i - x_j| by prefix
+// sums, and E|X - X'| = 2 sum_k F(k) (1 - F(k)) for integer X.
+// The Poisson cdf F is computed by the recursion of the probabilities
+// (rescaled against underflow), not by ppois, so that the statistics
+// can be computed on any thread.
+//
+// Counts beyond the histogram (size H, above the upper tail where F is
+// 1 in double precision) are kept in a sorted list; they contribute
+// x - lambda to the first mean of E.
+//
+// poisson_stats computes the statistics of x and R parametric
+// bootstrap replicates, generated from Poisson(mean(x)) and scored in
+// parallel by sim_replicates (permutation.c).
+
+NumericVector poisMstat(IntegerVector x);
+NumericMatrix poisson_stats(IntegerVector x, int R);
+
+struct pois_data {
+  int n, H;
+  double lambda;
+};
+
+static void pois_cdf(double lambda, int H, double *F);
+static void pois_hist_stats(const int *h, int H, int *out, int m, int n,
+                            double *F, double *stats);
+static void pois_replicate(rng_state *rng, void *data, double *work,
+                           double *stats);
+static int pois_hsize(const int *x, int n);
+
+
+static void pois_cdf(double lambda, int H, double *F) {
+  // F[k] = P(X <= k), k < H, for X Poisson(lambda), set to 1 beyond
+  // the point where the upper tail is negligible
+  int k;
+  double p = 1.0, lsc = -lambda, s = 0.0, f;
+
+  for (k = 0; k < H; k++) {
+    if (k > 0)
+      p *= lambda / k;
+    if (p > 1e100) {
+      p *= 1e-100;
+      lsc += 100.0 * M_LN10;
+    }
+    f = p * exp(lsc);
+    s += f;
+    if (s >= 1.0 || (k > lambda && f < 1e-17 * s)) {
+      for (; k < H; k++)
+        F[k] = 1.0;
+      return;
+    }
+    F[k] = s;
+  }
+}
+
+static void pois_hist_stats(const int *h, int H, int *out, int m, int n,
+                            double *F, double *stats) {
+  // h: histogram of the counts < H; out: the m counts >= H (sorted
+  // here); F: scratch of length H
+  // stats = c(M-CvM, M-AD, E)
+  int i, j, k, q;
+  double N = (double) n, S = 0.0, lambda, c, s, mk, d, ad, cvm, cnt, v;
+  double Mcdf0, Mcdf1, Mpdf1, cdf0, cdf1, EXX, mean1, P, eps = 1.0e-10;
+
+  std::sort(out, out + m);
+  for (k = 0; k < H; k++)
+    S += (double) k * h[k];
+  for (j = 0; j < m; j++)
+    S += (double) out[j];
+  lambda = S / N;
+  pois_cdf(lambda, H, F);
+
+  // M statistics: c_k and s_k as k increases, out is above all k < H
+  c = s = 0.0;
+  j = 0;
+#define POIS_ADVANCE(k)                         \
+  if ((k) < H) {                                \
+    c += h[k];                                  \
+    s += (double) (k) * h[k];                   \
+  } else {                                      \
+    for (; j < m && out[j] == (k); j++) {       \
+      c += 1.0;                                 \
+      s += (double) (k);                        \
+    }                                           \
+  }
+  POIS_ADVANCE(0);
+  mk = (1.0 * c - s + (S - s) - 1.0 * (N - c)) / N;   // m_1 = E|1 - X|
+  Mcdf0 = (mk + 1.0 - lambda) / 2.0;                  // M-est of F(0)
+  cdf0 = exp(-lambda);                                // MLE of F(0)
+  d = Mcdf0 - cdf0;
+  cvm = d * d * cdf0;
+  ad = d * d * cdf0 / (cdf0 * (1 - cdf0));
+
+  // q = qpois(1 - eps, lambda): i = 1, ..., q
+  q = (cdf0 >= 1.0 - eps) ? 0 : -1;
+  for (i = 1; q < 0 || i <= q; i++) {
+    k = i + 1;
+    POIS_ADVANCE(i);
+    mk = (k * c - s + (S - s) - k * (N - c)) / N;     // E|i+1 - X|
+    Mpdf1 = (mk - (k - lambda) * (2.0 * Mcdf0 - 1.0)) / (2.0 * k);
+    if (Mpdf1 < 0.0) Mpdf1 = 0.0;
+    Mcdf1 = Mcdf0 + Mpdf1;
+    if (Mcdf1 > 1) Mcdf1 = 1.0;
+    cdf1 = (i < H) ? F[i] : 1.0;                      // MLE of F(i)
+    d = Mcdf1 - cdf1;
+    cvm += d * d * (cdf1 - cdf0);
+    ad += d * d * (cdf1 - cdf0) / (cdf1 * (1 - cdf1));
+    if (q < 0 && cdf1 >= 1.0 - eps)
+      q = i;
+    cdf0 = cdf1;
+    Mcdf0 = Mcdf1;
+  }
+#undef POIS_ADVANCE
+
+  // E: E|x - X| = 2 x F(x) - 2 lambda F(x - 1) + lambda - x, the sum of
+  // distances of the sample in increasing order, and E|X - X'|
+  mean1 = P = c = s = EXX = 0.0;
+  for (k = 0; k < H; k++) {
+    EXX += F[k] * (1.0 - F[k]);
+    if (h[k] == 0) continue;
+    cnt = (double) h[k];
+    mean1 += cnt * (2.0 * k * F[k] - 2.0 * lambda * (k > 0 ? F[k - 1] : 0.0) +
+                    lambda - k);
+    P += cnt * (k * c - s);
+    c += cnt;
+    s += cnt * k;
+  }
+  for (j = 0; j < m; j++) {
+    v = (double) out[j];
+    mean1 += v - lambda;
+    P += v * c - s;
+    c += 1.0;
+    s += v;
+  }
+  EXX *= 2.0;
+  stats[0] = N * cvm;
+  stats[1] = N * ad;
+  stats[2] = N * (2.0 * mean1 / N - EXX - 2.0 * P / (N * N));
+}
+
+static void pois_replicate(rng_state *rng, void *data, double *work,
+                           double *stats) {
+  // statistics of a Poisson(lambda) sample; work: F (H), then the
+  // histogram (H ints) and the large counts (n ints) stored in doubles
+  pois_data *pd = (pois_data *) data;
+  int i, v, m = 0, n = pd->n, H = pd->H;
+  int *h = (int *) (work + H), *out = (int *) (work + 2 * (size_t) H);
+
+  for (i = 0; i < H; i++)
+    h[i] = 0;
+  for (i = 0; i < n; i++) {
+    v = rng_pois(rng, pd->lambda);
+    if (v < H)
+      h[v]++;
+    else
+      out[m++] = v;
+  }
+  pois_hist_stats(h, H, out, m, n, work, stats);
+}
+
+static int pois_hsize(const int *x, int n) {
+  // histogram size: beyond the upper tail of Poisson(mean(x)) and of
+  // its bootstrap replicates
+  int i;
+  double lambda = 0.0;
+  for (i = 0; i < n; i++)
+    lambda += x[i];
+  lambda /= (double) n;
+  return (int) ceil(lambda + 30.0 * sqrt(lambda) + 100.0);
+}
+
 
 // [[Rcpp::export(.poisMstat)]]
 NumericVector poisMstat(IntegerVector x)
 {
   /* computes the Poisson mean distance statistic */
-  int i, j, k, n=x.size();
-  double eps=1.0e-10;
-  double ad, cvm, d, lambda, m, q;
-  double Mcdf1, Mcdf0, Mpdf1, cdf1, cdf0;
-  NumericVector stats(2);
+  int i, m = 0, n = x.size(), H = pois_hsize(x.begin(), n);
+  std::vector<int> h(H), out(n);
+  std::vector<double> F(H);
+  double stats[3];
+  NumericVector M(2);
 
-  lambda = mean(x);
-  q = R::qpois(1.0-eps, lambda, TRUE, FALSE) + 1;
+  for (i = 0; i < n; i++) {
+    if (x[i] < H)
+      h[x[i]]++;
+    else
+      out[m++] = x[i];
+  }
+  pois_hist_stats(h.data(), H, out.data(), m, n, F.data(), stats);
+  M(0) = stats[0];
+  M(1) = stats[1];
+  return M;
+}
 
-  m = 0.0;
-  for (j=0; j<n; j++) m += abs(x(j) - 1);
-  m /= ((double) n);                   /* est of m_1 = E|1 - X| */
-  Mcdf0 = (m + 1.0 - lambda) / 2.0;    /* M-est of F(0) */
+// [[Rcpp::export(.poisson_stats)]]
+NumericMatrix poisson_stats(IntegerVector x, int R) {
+  // (R + 1) by 3: M-CvM, M-AD and E of x (row 1) and of R parametric
+  // bootstrap replicates from Poisson(mean(x))
+  int i, j, m = 0, n = x.size(), H = pois_hsize(x.begin(), n);
+  std::vector<int> h(H), out(n);
+  std::vector<double> F(H), reps(3 * (size_t) (R > 0 ? R : 0));
+  double stats[3];
+  NumericMatrix T(R + 1, 3);
+  pois_data pd;
 
-  cdf0 = exp(-lambda);                 /* MLE of F(0) */
-  d = Mcdf0 - cdf0;
-  cvm = d * d * cdf0;   /* von Mises type of distance */
-  ad = d * d * cdf0 / (cdf0 * (1-cdf0));  /* A-D weight */
-    
-  for (i=1; i<q; i++) {
-    m = 0;
-    k = i + 1;
-    for (j=0; j<n; j++) m += abs(x(j)-k);
-    m /= ((double) n);  /* est of m_{i+1} = E|i+1 - X| */
-
-  /* compute M-estimate of f(i) and F(i) */
-  Mpdf1 = (m-(k-lambda)*(2.0*Mcdf0-1.0))/((double) 2.0*k);
-  if (Mpdf1 < 0.0) Mpdf1 = 0.0;
-  Mcdf1 = Mcdf0 + Mpdf1;
-  if (Mcdf1 > 1) Mcdf1 = 1.0;
-
-  cdf1 = R::ppois(i, lambda, TRUE, FALSE); /* MLE of F(i) */
-  d = Mcdf1 - cdf1;
-  cvm += d * d * (cdf1 - cdf0);
-  ad += d * d * (cdf1 - cdf0) / (cdf1 * (1-cdf1));
-  
-  cdf0 = cdf1;
-  Mcdf0 = Mcdf1;
-  }
-  cvm *= n;
-  ad *= n;
-  stats(0) = cvm;
-  stats(1) = ad;
-  return stats;
+  for (i = 0; i < n; i++) {
+    if (x[i] < H)
+      h[x[i]]++;
+    else
+      out[m++] = x[i];
+  }
+  pois_hist_stats(h.data(), H, out.data(), m, n, F.data(), stats);
+  for (j = 0; j < 3; j++)
+    T(0, j) = stats[j];
+
+  if (R > 0) {
+    pd.n = n;
+    pd.H = H;
+    pd.lambda = 0.0;
+    for (i = 0; i < n; i++)
+      pd.lambda += x[i];
+    pd.lambda /= (double) n;
+    sim_replicates(R, 3, pois_replicate, &pd, 2 * (size_t) H + n,
+                   reps.data());
+    for (j = 0; j < 3; j++)
+      for (i = 0; i < R; i++)
+        T(i + 1, j) = reps[i + (size_t) j * R];
+  }
+  return T;
 }
@@ -0,0 +1,182 @@
+/*
+   profile.c: optional phase timing and counters for the native code
+
+   energy.profile(TRUE) turns on the instrumentation of the phases that
+   the .C and .Call entry points share: transposition to row order,
+   distances from data, distances to a power, centering and the
+   replicates of the tests (see profile.h), and counts the bytes
+   allocated for the distance matrices, the data copies and the
+   scratch of the replicates, and the number of replicates.
+   energy.stats() returns the counters accumulated since the last
+   reset.
+
+   A phase is timed (wall time) on the main thread only, and only at
+   the outermost level: a phase that starts while another is timed,
+   such as the distances computed within the replicates, is part of
+   the enclosing phase, so the times of the phases add up to at most
+   the elapsed time.  When the instrumentation is off, prof_start
+   returns after one test, and prof_stop, prof_alloc and
+   prof_replicates do nothing.
+
+   A phase left by an error or an interrupt is never stopped; every
+   .Call entry point calls prof_enter first (energy_init.c), which
+   closes it, so that it does not keep the later phases from being
+   timed.
+
+   energy_profile   .Call: get/set the instrumentation
+   energy_stats     .Call: the counters, optionally reset
+   prof_enter       clear a phase left open (at each .Call entry)
+   prof_start       start timing a phase
+   prof_stop        stop timing a phase
+   prof_alloc       count bytes allocated
+   prof_replicates  count replicates
+*/
+
+#include <R.h>
+#include <Rinternals.h>
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#include <sys/time.h>
+#endif
+#include "profile.h"
+
+SEXP   energy_profile(SEXP enable);
+SEXP   energy_stats(SEXP reset);
+
+static int    prof_on = FALSE, prof_active = FALSE;
+static double prof_seconds[PROF_NPHASES], prof_calls[PROF_NPHASES];
+static double prof_bytes = 0.0, prof_reps = 0.0;
+
+static const char *prof_names[PROF_NPHASES] = {
+    "roworder", "distance", "index", "center", "replicates"
+};
+
+static double prof_clock(void);
+static void   prof_reset(void);
+
+
+static double prof_clock(void)
+{
+    /* wall time in seconds */
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double) tv.tv_sec + 1.0e-6 * (double) tv.tv_usec;
+#endif
+}
+
+static void prof_reset(void)
+{
+    int k;
+    for (k=0; k<PROF_NPHASES; k++)
+        prof_seconds[k] = prof_calls[k] = 0.0;
+    prof_bytes = prof_reps = 0.0;
+    prof_active = FALSE;
+}
+
+void prof_enter(void)
+{
+    /* at the entry of a .Call: no phase is being timed */
+    prof_active = FALSE;
+}
+
+double prof_start(void)
+{
+    /* start time of a phase, or -1 if the phase is not timed */
+    if (!prof_on || prof_active)
+        return -1.0;
+#ifdef _OPENMP
+    if (omp_in_parallel())
+        return -1.0;
+#endif
+    prof_active = TRUE;
+    return prof_clock();
+}
+
+void prof_stop(int phase, double t0)
+{
+    /* t0 is the value returned by prof_start */
+    if (t0 < 0.0)
+        return;
+    prof_seconds[phase] += prof_clock() - t0;
+    prof_calls[phase] += 1.0;
+    prof_active = FALSE;
+}
+
+void prof_alloc(size_t bytes)
+{
+    /* counted on the main thread, which does all the allocation */
+    if (!prof_on)
+        return;
+#ifdef _OPENMP
+    if (omp_in_parallel())
+        return;
+#endif
+    prof_bytes += (double) bytes;
+}
+
+void prof_replicates(int R)
+{
+    if (prof_on && R > 0)
+        prof_reps += (double) R;
+}
+
+
+SEXP energy_profile(SEXP enable)
+{
+    /*
+       enable : NULL to query, otherwise TRUE to turn the
+                instrumentation on (the counters are reset) or FALSE
+       returns the previous setting
+    */
+    int old = prof_on, on;
+
+    if (!isNull(enable)) {
+        on = asLogical(enable);
+        if (on == NA_LOGICAL)
+            error("enable must be TRUE or FALSE");
+        if (on && !prof_on)
+            prof_reset();
+        prof_on = on;
+    }
+    return ScalarLogical(old);
+}
+
+SEXP energy_stats(SEXP reset)
+{
+    /*
+       returns list(phase, calls, seconds, bytes, replicates)
+       the counters are reset if reset is TRUE
+    */
+    int  k;
+    SEXP ans, nms, phase, calls, seconds;
+
+    PROTECT(ans = allocVector(VECSXP, 5));
+    PROTECT(nms = allocVector(STRSXP, 5));
+    PROTECT(phase = allocVector(STRSXP, PROF_NPHASES));
+    PROTECT(calls = allocVector(REALSXP, PROF_NPHASES));
+    PROTECT(seconds = allocVector(REALSXP, PROF_NPHASES));
+    for (k=0; k<PROF_NPHASES; k++) {
+        SET_STRING_ELT(phase, k, mkChar(prof_names[k]));
+        REAL(calls)[k] = prof_calls[k];
+        REAL(seconds)[k] = prof_seconds[k];
+    }
+    SET_VECTOR_ELT(ans, 0, phase);
+    SET_VECTOR_ELT(ans, 1, calls);
+    SET_VECTOR_ELT(ans, 2, seconds);
+    SET_VECTOR_ELT(ans, 3, ScalarReal(prof_bytes));
+    SET_VECTOR_ELT(ans, 4, ScalarReal(prof_reps));
+    SET_STRING_ELT(nms, 0, mkChar("phase"));
+    SET_STRING_ELT(nms, 1, mkChar("calls"));
+    SET_STRING_ELT(nms, 2, mkChar("seconds"));
+    SET_STRING_ELT(nms, 3, mkChar("bytes"));
+    SET_STRING_ELT(nms, 4, mkChar("replicates"));
+    setAttrib(ans, R_NamesSymbol, nms);
+    if (asLogical(reset) == TRUE)
+        prof_reset();
+    UNPROTECT(5);
+    return ans;
+}
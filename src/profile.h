@@ -0,0 +1,34 @@
+/*
+   profile.h: optional phase timing and counters for the native code
+   (see profile.c)
+*/
+
+#ifndef ENERGY_PROFILE_H
+#define ENERGY_PROFILE_H
+
+#include <stddef.h>
+
+enum {
+    PROF_ROWORDER,      /* transposition to row order (roworder) */
+    PROF_DISTANCE,      /* distances from data (distance.c) */
+    PROF_INDEX,         /* distances to a power index */
+    PROF_CENTER,        /* double and U-centering */
+    PROF_REPLICATES,    /* permutation and bootstrap replicates */
+    PROF_NPHASES
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void   prof_enter(void);
+double prof_start(void);
+void   prof_stop(int phase, double t0);
+void   prof_alloc(size_t bytes);
+void   prof_replicates(int R);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,8 +1,11 @@
 #include <Rcpp.h>
 using namespace Rcpp;
 
-NumericMatrix U_center(NumericMatrix);
-double        U_product(NumericMatrix, NumericMatrix);
+#include <vector>
+
+void          U_center_means(const double *D, int n, double *m);
+void          U_center_inplace(double *D, int n);
+void          U_gram(const double * const *D, int p, int n, double *G);
 
 // [[Rcpp::export]]
 NumericMatrix projection(NumericMatrix Dx, NumericMatrix Dz) {
@@ -14,21 +17,32 @@ NumericMatrix projection(NumericMatrix Dx, NumericMatrix Dz) {
   */
   int    n = Dx.nrow();
   int    i, j;
-  NumericMatrix A(n, n), C(n, n), P(n, n);
-  double AC, CC, c1;
+  const double *D[2] = {Dx.begin(), Dz.begin()};
+  const double *Dzj;
+  double G[4], AC, CC, c1, *Pj;
   double eps = std::numeric_limits<double>::epsilon();  //machine epsilon
+  std::vector<double> m(n + 1);
 
-  A = U_center(Dx);        // U-centering to get A^U etc.
-  C = U_center(Dz);
-  AC = U_product(A, C);    // (A,C) = dcov^U
-  CC = U_product(C, C);
+  U_gram(D, 2, n, G);      // (A,C) = dcov^U, without storing A and C
+  AC = G[1];
+  CC = G[3];
   c1 = 0.0;
   // if (C,C)==0 then C==0 so c1=(A,C)=0
   if (fabs(CC) > eps)
     c1 = AC / CC;
-  for (i=0; i<n; i++) {
+
+  // P = A - c1 C: U-center a copy of Dx in place, subtract c1 C
+  // with the entries of C computed from the row means of Dz
+  NumericMatrix P = clone(Dx);
+  U_center_inplace(P.begin(), n);
+  if (c1 != 0.0) {
+    U_center_means(Dz.begin(), n, m.data());
     for (j=0; j<n; j++) {
-      P(i, j) = A(i, j) - c1 * C(i, j);
+      Pj = P.begin() + (size_t) j * n;
+      Dzj = Dz.begin() + (size_t) j * n;
+      for (i=0; i<n; i++)
+        if (i != j)
+          Pj[i] -= c1 * (Dzj[i] - m[i] - m[j] + m[n]);
     }
   }
   return P;
@@ -0,0 +1,247 @@
+#include <Rcpp.h>
+using namespace Rcpp;
+
+#include <vector>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "permutation.h"
+
+// approximate dCov and e-distance by random projections
+//
+// For u uniform on the unit sphere of R^p,
+//   |z| = C_p E|u'z|,  C_p = sqrt(pi) Gamma((p+1)/2) / Gamma(p/2),
+// and dCov^2 (V) and the e-distance are linear in the distances of each
+// sample, so that they are the expected values of the statistics of the
+// projected samples (Huang and Huo 2017), scaled by the constants.
+// Each projection is scored by the O(n log n) univariate kernels:
+// dcov2d (dcov2d.cpp) for dCov, and sorted sums for e-distances.
+// The constants and the average over the projections are applied in R
+// (random-projection.R), where the directions are generated.
+//
+// The projections are computed in parallel (num_threads, see
+// energy.threads) with O(n) workspace per thread; each projection
+// writes its own row of the result.
+//
+// dcov_projections: for each k the V statistics dCov^2(xu, yv),
+//   dCov^2(xu, xu') and dCov^2(yv, yv') of the projections on the
+//   directions u = u[, 2k], u' = u[, 2k+1] (and v, v'), so that the
+//   distance variances are estimated from independent directions.
+// edist_projections: for each k the e-distances of all pairs of
+//   samples projected on u[, k], in the order of a dist object.
+
+NumericMatrix dcov_projections(NumericMatrix x, NumericMatrix y,
+                               NumericMatrix u, NumericMatrix v);
+NumericMatrix edist_projections(NumericMatrix x, IntegerVector sizes,
+                                NumericMatrix u);
+
+struct rp_sample {
+  double *z, *a;    // the projection and its row sums of distances
+  int *ix, *r;      // order and ranks of z
+  double suma;
+};
+
+static void rp_prepare(const double *x, int n, int p, const double *u,
+                       rp_sample *P);
+static double rp_dcov(const rp_sample *P, const rp_sample *Q, int n,
+                      double *x1, double *y1, int *ry1, double *g);
+
+// dcov2d.cpp
+void sort_rank(const double *x, int n, int *ix, int *r);
+void rowsums_dist1(const double *x, int n, const int *ix, const int *r,
+                   double *rowsums);
+double gamma_S1(const double *x1, const double *y1, const int *ry1, int n,
+                double *work);
+
+
+static void rp_prepare(const double *x, int n, int p, const double *u,
+                       rp_sample *P) {
+  // z = x u for the n by p data x, sorted and summed for rp_dcov
+  int i, h;
+  double uh;
+  const double *xh;
+
+  for (i = 0; i < n; i++)
+    P->z[i] = 0.0;
+  for (h = 0; h < p; h++) {
+    xh = x + (size_t) h * n;
+    uh = u[h];
+    for (i = 0; i < n; i++)
+      P->z[i] += uh * xh[i];
+  }
+  sort_rank(P->z, n, P->ix, P->r);
+  rowsums_dist1(P->z, n, P->ix, P->r, P->a);
+  P->suma = 0.0;
+  for (i = 0; i < n; i++)
+    P->suma += P->a[i];
+}
+
+static double rp_dcov(const rp_sample *P, const rp_sample *Q, int n,
+                      double *x1, double *y1, int *ry1, double *g) {
+  // dCov^2 (V) of two prepared univariate samples, as dcov2d
+  int i;
+  double N = (double) n, S1, S2 = 0.0;
+
+  for (i = 0; i < n; i++) {
+    S2 += P->a[i] * Q->a[i];
+    x1[i] = P->z[P->ix[i]];
+    y1[i] = Q->z[P->ix[i]];
+    ry1[i] = Q->r[P->ix[i]];
+  }
+  S1 = gamma_S1(x1, y1, ry1, n, g);
+  return S1 / (N * N) - 2.0 * S2 / (N * N * N) +
+    P->suma * Q->suma / (N * N * N * N);
+}
+
+
+// [[Rcpp::export(.dcov_projections)]]
+NumericMatrix dcov_projections(NumericMatrix x, NumericMatrix y,
+                               NumericMatrix u, NumericMatrix v) {
+  // x n by p, y n by q; u p by 2K, v q by 2K unit directions
+  // returns K by 3: dCov^2(xu, yv), dCov^2(xu, xu'), dCov^2(yv, yv')
+  int n = x.nrow(), p = x.ncol(), q = y.ncol(), K = u.ncol() / 2;
+  int nthreads = num_threads();
+  // per thread: four samples (z, a; ix, r) and x1, y1, ry1, gamma_S1
+  size_t wsd = 10 * (size_t) n + 8 * ((size_t) n + 1), wsi = 9 * (size_t) n;
+  std::vector<double> work((size_t) nthreads * wsd);
+  std::vector<int> iwork((size_t) nthreads * wsi);
+  NumericMatrix V(K, 3);
+  const double *px = x.begin(), *py = y.begin();
+  const double *pu = u.begin(), *pv = v.begin();
+  double *pV = V.begin();
+
+  if (y.nrow() != n)
+    stop("sample sizes must agree");
+
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(nthreads) if (K > 1)
+#endif
+  {
+    int t = 0, k, s;
+    rp_sample S[4];
+    double *w, *x1, *y1, *g;
+    int *iw, *ry1;
+#ifdef _OPENMP
+    t = omp_get_thread_num();
+#endif
+    w = work.data() + (size_t) t * wsd;
+    iw = iwork.data() + (size_t) t * wsi;
+    for (s = 0; s < 4; s++) {
+      S[s].z = w + (size_t) 2 * s * n;
+      S[s].a = S[s].z + n;
+      S[s].ix = iw + (size_t) 2 * s * n;
+      S[s].r = S[s].ix + n;
+    }
+    x1 = w + (size_t) 8 * n;
+    y1 = x1 + n;
+    g = y1 + n;
+    ry1 = iw + (size_t) 8 * n;
+#ifdef _OPENMP
+    #pragma omp for schedule(dynamic)
+#endif
+    for (k = 0; k < K; k++) {
+      rp_prepare(px, n, p, pu + (size_t) 2 * k * p, &S[0]);
+      rp_prepare(px, n, p, pu + (size_t) (2 * k + 1) * p, &S[1]);
+      rp_prepare(py, n, q, pv + (size_t) 2 * k * q, &S[2]);
+      rp_prepare(py, n, q, pv + (size_t) (2 * k + 1) * q, &S[3]);
+      pV[k] = rp_dcov(&S[0], &S[2], n, x1, y1, ry1, g);
+      pV[k + K] = rp_dcov(&S[0], &S[1], n, x1, y1, ry1, g);
+      pV[k + 2 * K] = rp_dcov(&S[2], &S[3], n, x1, y1, ry1, g);
+    }
+  }
+  return V;
+}
+
+
+// [[Rcpp::export(.edist_projections)]]
+NumericMatrix edist_projections(NumericMatrix x, IntegerVector sizes,
+                                NumericMatrix u) {
+  // x: the pooled sample (n by p), the samples in consecutive rows;
+  // u: p by K unit directions
+  // returns K by G(G-1)/2: the e-distances (edist, method "cluster")
+  // of the projected samples i < j, in the order of a dist object
+  int n = x.nrow(), p = x.ncol(), K = u.ncol(), G = sizes.length();
+  int npairs = G * (G - 1) / 2, nthreads = num_threads(), i;
+  std::vector<int> start(G + 1);
+  // per thread: the projection (sorted by sample) and its prefix sums
+  size_t wsd = 2 * (size_t) n;
+  std::vector<double> work((size_t) nthreads * wsd);
+  std::vector<double> wsums((size_t) nthreads * G);
+  NumericMatrix E(K, npairs);
+  const double *px = x.begin(), *pu = u.begin();
+  double *pE = E.begin();
+
+  for (i = 0, start[0] = 0; i < G; i++)
+    start[i + 1] = start[i] + sizes[i];
+  if (start[G] != n)
+    stop("the sample sizes must add to the number of rows of x");
+
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(nthreads) if (K > 1)
+#endif
+  {
+    int t = 0, k, h, g, l, a, b, c, mg, ml, pair;
+    double *z, *ps, *W, uh, s, S, mgd, mld, w;
+    const double *xh, *zg, *zl, *pl;
+#ifdef _OPENMP
+    t = omp_get_thread_num();
+#endif
+    z = work.data() + (size_t) t * wsd;
+    ps = z + n;
+    W = wsums.data() + (size_t) t * G;
+#ifdef _OPENMP
+    #pragma omp for schedule(dynamic)
+#endif
+    for (k = 0; k < K; k++) {
+      for (a = 0; a < n; a++)
+        z[a] = 0.0;
+      for (h = 0; h < p; h++) {
+        xh = px + (size_t) h * n;
+        uh = pu[(size_t) k * p + h];
+        for (a = 0; a < n; a++)
+          z[a] += uh * xh[a];
+      }
+      // sort each sample; within sums sum_{a > b} |z_a - z_b|
+      // and prefix sums ps[start + c] = sum of the c smallest
+      for (g = 0; g < G; g++) {
+        zg = z + start[g];
+        mg = sizes[g];
+        std::sort(z + start[g], z + start[g + 1]);
+        s = W[g] = 0.0;
+        for (a = 0; a < mg; a++) {
+          ps[start[g] + a] = s;
+          W[g] += (2.0 * a - mg + 1.0) * zg[a];
+          s += zg[a];
+        }
+      }
+      // between sums by merging the sorted samples
+      pair = 0;
+      for (g = 0; g < G - 1; g++)
+        for (l = g + 1; l < G; l++) {
+          zg = z + start[g];
+          zl = z + start[l];
+          pl = ps + start[l];
+          mg = sizes[g];
+          ml = sizes[l];
+          S = 0.0;
+          c = 0;   // the number of z_l smaller than z_g[a]
+          for (a = 0; a < mg; a++) {
+            while (c < ml && zl[c] < zg[a])
+              c++;
+            s = (c < ml) ? pl[c] : pl[ml - 1] + zl[ml - 1];
+            b = ml - c;
+            S += (c * zg[a] - s) +
+              ((pl[ml - 1] + zl[ml - 1]) - s - b * zg[a]);
+          }
+          mgd = (double) mg;
+          mld = (double) ml;
+          w = mgd * mld / (mgd + mld);
+          pE[k + (size_t) K * pair] = 2.0 * w * (S / (mgd * mld) - W[g] / (mgd * mgd) -
+                       W[l] / (mld * mld));
+          pair++;
+        }
+    }
+  }
+  return E;
+}
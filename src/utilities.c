@@ -16,13 +16,60 @@
    index_distance     computes Euclidean distance matrix D then D^index
    sumdist            sums the distance matrix without creating the matrix
 
+   packed_matrix utilities (see utilities.h):
+   alloc_packed, free_packed   allocate and free a packed symmetric matrix
+   packed_distance             Euclidean distance matrix from double*
+   packed_power_distance       D^index from double*, in one pass
+   packed_squared_distance     squared Euclidean distance matrix from double*
+   packed_copy_square          copy an n by n matrix into packed storage
+   packed_copy_dist            copy a dist object into packed storage
+   packed_sample_distance      D^index of a sample passed by .Call:
+                               data in column order (an R matrix, read
+                               in place), a dist object or a matrix
+   sample_finite               FALSE if a sample has NA or Inf
+   packed_index_distance       D^index for packed D
+   packed_getrow               copy row i of packed D into a vector
+   packed_rowsums              row sums of packed D
+   packed_group_sums           sums of D(i, j), i > j, by group labels
+   packed_perm_worksize        scratch length of packed_perm_sum
+   packed_perm_sum             sum of a function of the rows of the
+                               permuted B(perm[k], perm[j]), reading B
+                               in order (permutation replicates)
+
+   single precision storage (packed_float, see utilities.h):
+   energy_storage              .Call: get/set the storage mode
+   float_storage               TRUE if energy.storage("single") is set
+   packed_to_float             convert a packed matrix in place
+   free_packed_float           free a packed_float
+   packed_float_group_sums     packed_group_sums for packed_float
+   packed_float_perm_sum       packed_perm_sum for packed_float
+
    Notes:
    1. index_distance (declaration and body of the function) revised in
       energy 1.3-0, 2/2011.
+   2. packed_matrix added in energy 1.7-9: a symmetric matrix needs about
+      half the memory of double** storage, in one allocation.
+   3. energy 1.7-9: distance, Euclidean_distance, sumdist, packed_distance
+      and packed_squared_distance use the blocked kernel in distance.c.
+      The exponents of index_distance, packed_index_distance and
+      packed_power_distance are computed by dist_power (closed forms
+      for index 1/2, 3/2 and 2) instead of R_pow for each entry.
+   4. energy 1.7-9: packed_float halves the memory of the matrices
+      read by the replicates of dcov.test and eqdist.etest, which are
+      limited by memory bandwidth for large n.
+   5. energy 1.7-9: the .Call entry points of dcov.test, eqdist.etest,
+      mvI.test and energy.dist pass R's vectors and matrices to
+      packed_sample_distance as they are: no .C copy of the arguments,
+      no as.double(t(x)) in R and no roworder transposition in C.
 */
 
 #include <R.h>
+#include <Rinternals.h>
 #include <Rmath.h>
+#include <string.h>
+#include "utilities.h"
+#include "distance.h"
+#include "profile.h"
 
 double **alloc_matrix(int r, int c);
 int    **alloc_int_matrix(int r, int c);
@@ -39,6 +86,44 @@ void   Euclidean_distance(double *x, double **Dx, int n, int d);
 void   index_distance(double **Dx, int n, double index);
 void   sumdist(double *x, int *byrow, int *nrow, int *ncol, double *lowersum);
 
+SEXP   energy_storage(SEXP single);
+
+static int energy_single = FALSE;
+
+
+
+static void rows_sink(int i0, int j0, int m, int n, const double *tile,
+                      int ld, void *ctx)
+{
+    /* store a tile of distances in a symmetric double** matrix */
+    double **D = (double **) ctx;
+    int i, j, I, J;
+    for (i=0; i<m; i++) {
+        I = i0 + i;
+        for (j=0; j<n; j++) {
+            J = j0 + j;
+            if (J > I) break;
+            D[I][J] = D[J][I] = (I == J) ? 0.0 : tile[(size_t) i*ld + j];
+        }
+    }
+}
+
+static void packed_sink(int i0, int j0, int m, int n, const double *tile,
+                        int ld, void *ctx)
+{
+    /* store a tile of distances in a packed symmetric matrix */
+    packed_matrix *D = (packed_matrix *) ctx;
+    int i, j, I;
+    double *Di;
+    for (i=0; i<m; i++) {
+        I = i0 + i;
+        Di = D->x + PACKED_OFFSET(I);
+        for (j=0; j<n && j0+j<I; j++)
+            Di[j0 + j] = tile[(size_t) i*ld + j];
+        if (I < j0 + n)
+            Di[I] = 0.0;
+    }
+}
 
 
 double **alloc_matrix(int r, int c)
@@ -49,6 +134,7 @@ double **alloc_matrix(int r, int c)
     matrix = Calloc(r, double *);
     for (i = 0; i < r; i++)
     matrix[i] = Calloc(c, double);
+    prof_alloc((size_t) r * c * sizeof(double));
     return matrix;
 }
 
@@ -130,9 +216,11 @@ void roworder(double *x, int *byrow, int r, int c) {
       assume that x is r by c matrix as a vector in column order
     */
     int    i, j, k, n=r*c;
-    double *y;
+    double *y, t0;
     if (*byrow == TRUE) return;
+    t0 = prof_start();
     y = Calloc(n, double);
+    prof_alloc((size_t) n * sizeof(double));
     i = 0;
     for (j=0; j<r; j++) {
         for (k=0; k<n; k+=r) {
@@ -144,6 +232,7 @@ void roworder(double *x, int *byrow, int r, int c) {
         x[i] = y[i];
     Free(y);
     *byrow = TRUE;
+    prof_stop(PROF_ROWORDER, t0);
     return;
 }
 
@@ -153,20 +242,17 @@ void distance(double **data, double **D, int N, int d) {
        compute the distance matrix of sample in N by d matrix data
        equivalent R code is:  D <- as.matrix(dist(data))
     */
-    int    i, j, k;
-    double dif;
-    for (i=0; i<N; i++) {
-        D[i][i] = 0.0;
-        for (j=i+1; j<N; j++) {
-            D[i][j] = 0.0;
-            for (k=0; k<d; k++) {
-                dif = data[i][k] - data[j][k];
-                D[i][j] += dif*dif;
-            }
-            D[i][j] = sqrt(D[i][j]);
-            D[j][i] = D[i][j];
-        }
-    }
+    int    i, k;
+    double *x;
+    dist_data X;
+    x = Calloc((size_t) N*d, double);
+    for (i=0; i<N; i++)
+        for (k=0; k<d; k++)
+            x[(size_t) i*d + k] = data[i][k];
+    dist_prepare(&X, x, N, d, NULL);
+    dist_tiles(&X, &X, FALSE, rows_sink, D, NULL);
+    dist_release(&X);
+    Free(x);
     return;
 }
 
@@ -177,21 +263,10 @@ void Euclidean_distance(double *x, double **Dx, int n, int d)
         interpret x as an n by d matrix, in row order (n vectors in R^d)
         compute the Euclidean distance matrix Dx
     */
-    int i, j, k, p, q;
-    double dsum, dif;
-    for (i=1; i<n; i++) {
-        Dx[i][i] = 0.0;
-        p = i*d;
-        for (j=0; j<i; j++) {
-            dsum = 0.0;
-            q = j*d;
-            for (k=0; k<d; k++) {
-                dif = *(x+p+k) - *(x+q+k);
-                dsum += dif*dif;
-            }
-            Dx[i][j] = Dx[j][i] = sqrt(dsum);
-        }
-    }
+    dist_data X;
+    dist_prepare(&X, x, n, d, NULL);
+    dist_tiles(&X, &X, FALSE, rows_sink, Dx, NULL);
+    dist_release(&X);
 }
 
 
@@ -202,13 +277,16 @@ void index_distance(double **Dx, int n, double index)
         if index NEQ 1, compute D^index
     */
     int i, j;
+    double t0;
 
     if (fabs(index - 1) > DBL_EPSILON) {
-        for (i=0; i<n; i++)
-            for (j=i+1; j<n; j++) {
-                Dx[i][j] = R_pow(Dx[i][j], index);
+        t0 = prof_start();
+        for (i=0; i<n; i++) {
+            dist_power(Dx[i] + i + 1, (size_t) (n - i - 1), index, FALSE);
+            for (j=i+1; j<n; j++)
                 Dx[j][i] = Dx[i][j];
-            }
+        }
+        prof_stop(PROF_INDEX, t0);
     }
 }
 
@@ -221,23 +299,361 @@ void sumdist(double *x, int *byrow, int *nrow, int *ncol, double *lowersum)
        x must be in row order: x=as.double(t(x))
     */
 
-    int i, j, k, p, q, n=(*nrow), d=(*ncol);
-    double sum, dsum, dif;
+    int n=(*nrow), d=(*ncol);
+    dist_data X;
     if (*byrow == FALSE)
         roworder(x, byrow, n, d);
-    sum = 0.0;
-    for (i=1; i<n; i++) {
-        p = i*d;
+    dist_prepare(&X, x, n, d, NULL);
+    (*lowersum) = dist_sum(&X, &X);
+    dist_release(&X);
+}
+
+
+
+packed_matrix *alloc_packed(int n)
+{
+    /* allocate a packed symmetric n by n matrix (lower triangle) */
+    packed_matrix *D;
+    D = Calloc(1, packed_matrix);
+    D->n = n;
+    D->x = Calloc(PACKED_OFFSET(n), double);
+    prof_alloc(PACKED_OFFSET(n) * sizeof(double));
+    return D;
+}
+
+void free_packed(packed_matrix *D)
+{
+    Free(D->x);
+    Free(D);
+}
+
+void packed_distance(double *x, packed_matrix *D, int d)
+{
+    /*
+        interpret x as an n by d matrix, in row order (n vectors in R^d)
+        compute the Euclidean distance matrix D
+    */
+    dist_data X;
+    dist_prepare(&X, x, D->n, d, NULL);
+    dist_tiles(&X, &X, FALSE, packed_sink, D, NULL);
+    dist_release(&X);
+}
+
+void packed_power_distance(double *x, packed_matrix *D, int d, double index)
+{
+    /*
+        interpret x as an n by d matrix, in row order (n vectors in R^d)
+        compute D^index for the Euclidean distance matrix D, the exponent
+        applied by the kernel to each tile
+    */
+    dist_data X;
+    if (fabs(index - 1) <= DBL_EPSILON)
+        index = 1.0;
+    dist_prepare(&X, x, D->n, d, NULL);
+    dist_ptiles(&X, &X, index, packed_sink, D, NULL);
+    dist_release(&X);
+}
+
+void packed_squared_distance(double *x, packed_matrix *D, int d)
+{
+    /*
+        interpret x as an n by d matrix, in row order (n vectors in R^d)
+        compute the squared Euclidean distance matrix D
+    */
+    dist_data X;
+    dist_prepare(&X, x, D->n, d, NULL);
+    dist_tiles(&X, &X, TRUE, packed_sink, D, NULL);
+    dist_release(&X);
+}
+
+void packed_copy_square(double *x, packed_matrix *D)
+{
+    /* copy the lower triangle of the symmetric n by n matrix x */
+    int i, j, n = D->n;
+    double *Di;
+    for (i=0; i<n; i++) {
+        Di = D->x + PACKED_OFFSET(i);
+        for (j=0; j<=i; j++)
+            Di[j] = x[(size_t) i*n + j];
+    }
+}
+
+void packed_copy_dist(double *x, packed_matrix *D)
+{
+    /* copy a dist object (the lower triangle by columns) */
+    int i, j, n = D->n;
+    double *Di;
+    for (i=0; i<n; i++) {
+        Di = D->x + PACKED_OFFSET(i);
+        for (j=0; j<i; j++)
+            Di[j] = x[(size_t) n*j - (size_t) j*(j+1)/2 + i - j - 1];
+        Di[i] = 0.0;
+    }
+}
+
+void packed_sample_distance(double *x, int d, int type, double index,
+                            packed_matrix *D)
+{
+    /*
+        D^index for the sample x of D->n observations
+        type 0: x is the n by d data in column order (an R matrix or
+                vector), read in place; index 2: squared distances
+        type 1: x is a dist object
+        type 2: x is an n by n distance matrix
+    */
+    dist_data X;
+
+    if (fabs(index - 1) <= DBL_EPSILON)
+        index = 1.0;
+    if (type == 0) {
+        dist_prepare_cols(&X, x, D->n, d, NULL);
+        dist_ptiles(&X, &X, index, packed_sink, D, NULL);
+        dist_release(&X);
+        return;
+    }
+    if (type == 1)
+        packed_copy_dist(x, D);
+    else
+        packed_copy_square(x, D);
+    packed_index_distance(D, index);
+}
+
+int sample_finite(const double *x, size_t len)
+{
+    /* TRUE if x[0], ..., x[len-1] are finite */
+    size_t i;
+    for (i=0; i<len; i++)
+        if (!R_FINITE(x[i])) return FALSE;
+    return TRUE;
+}
+
+void packed_index_distance(packed_matrix *D, double index)
+{
+    /*
+        D is a packed Euclidean distance matrix
+        if index NEQ 1, compute D^index
+    */
+    int i, n = D->n;
+    double t0;
+    if (fabs(index - 1) > DBL_EPSILON) {
+        t0 = prof_start();
+        for (i=1; i<n; i++)
+            dist_power(D->x + PACKED_OFFSET(i), (size_t) i, index, FALSE);
+        prof_stop(PROF_INDEX, t0);
+    }
+}
+
+void packed_getrow(packed_matrix *D, int i, double *row)
+{
+    /* row[j] = D(i, j), j = 0, ..., n-1 */
+    int j, n = D->n;
+    double *Di = D->x + PACKED_OFFSET(i);
+    for (j=0; j<=i; j++)
+        row[j] = Di[j];
+    for (j=i+1; j<n; j++)
+        row[j] = D->x[PACKED_OFFSET(j) + i];
+}
+
+void packed_rowsums(packed_matrix *D, double *rowsums)
+{
+    /* row sums of symmetric D in one pass over the lower triangle */
+    int i, j, n = D->n;
+    double *Di, s;
+    for (i=0; i<n; i++)
+        rowsums[i] = 0.0;
+    for (i=0; i<n; i++) {
+        Di = D->x + PACKED_OFFSET(i);
+        s = 0.0;
         for (j=0; j<i; j++) {
-            dsum = 0.0;
-            q = j*d;
-            for (k=0; k<d; k++) {
-                dif = *(x+p+k) - *(x+q+k);
-                dsum += dif*dif;
-            }
-            sum += sqrt(dsum);
+            s += Di[j];
+            rowsums[j] += Di[j];
+        }
+        rowsums[i] += s + Di[i];
+    }
+}
+
+void packed_group_sums(packed_matrix *D, const int *group, int K,
+                       double *G, double *acc)
+{
+    /*
+       G[k*K + l] = sum of D(i, j) over i > j, group[i] = k, group[j] = l
+       group[i] in 0:(K-1); G is K by K (not symmetric)
+       acc is scratch of length K
+       one pass over the rows of the lower triangle: the row sums by
+       group are accumulated in acc and added to row group[i] of G
+    */
+    int i, j, k, n = D->n;
+    double *Di, *Gi;
+    for (k=0; k<K*K; k++)
+        G[k] = 0.0;
+    for (i=1; i<n; i++) {
+        Di = D->x + PACKED_OFFSET(i);
+        for (k=0; k<K; k++)
+            acc[k] = 0.0;
+        for (j=0; j<i; j++)
+            acc[group[j]] += Di[j];
+        Gi = G + (size_t) group[i] * K;
+        for (k=0; k<K; k++)
+            Gi[k] += acc[k];
+    }
+}
+
+
+size_t packed_perm_worksize(int n)
+{
+    /* PACKED_PERM_BLOCK rows and the inverse permutation (as int) */
+    return (size_t) (PACKED_PERM_BLOCK + 1) * n;
+}
+
+double packed_perm_sum(packed_matrix *B, const int *perm, packed_row_fn f,
+                       void *ctx, double *work)
+{
+    /*
+       sum over k of f(k, row_k, ctx), row_k[j] = B(perm[k], perm[j])
+       The rows K of B are taken in order, in blocks of
+       PACKED_PERM_BLOCK: the lower triangle of row K is read forward,
+       and the rest of the rows of a block is one short segment of each
+       row J below, so that B is read sequentially.  Row K is row k =
+       q[K] of the permuted matrix, q the inverse of perm, and B(K, J)
+       is its element q[J]: the writes are at random in the block of
+       rows (in cache), not the reads from memory.
+       work: scratch of length packed_perm_worksize(n)
+    */
+    int    i, k, m, mj, J, K, K0, n = B->n;
+    int    *q = (int *) (work + (size_t) PACKED_PERM_BLOCK * n);
+    double *r, *BK, *BJ, sum = 0.0;
+
+    for (k=0; k<n; k++)
+        q[perm[k]] = k;
+    for (K0=0; K0<n; K0+=PACKED_PERM_BLOCK) {
+        m = (n - K0 < PACKED_PERM_BLOCK) ? n - K0 : PACKED_PERM_BLOCK;
+        for (i=0; i<m; i++) {
+            K = K0 + i;
+            BK = B->x + PACKED_OFFSET(K);
+            r = work + (size_t) i * n;
+            for (J=0; J<=K; J++)
+                r[q[J]] = BK[J];
+        }
+        for (J=K0+1; J<n; J++) {
+            BJ = B->x + PACKED_OFFSET(J) + K0;
+            mj = (J - K0 < m) ? J - K0 : m;
+            for (i=0; i<mj; i++)
+                work[(size_t) i * n + q[J]] = BJ[i];
         }
+        for (i=0; i<m; i++)
+            sum += f(q[K0 + i], work + (size_t) i * n, ctx);
     }
-    (*lowersum) = sum;
+    return sum;
 }
 
+SEXP energy_storage(SEXP single)
+{
+    /*
+       set the storage mode of the matrices of the permutation tests
+       single : NULL to query, otherwise TRUE for single precision
+       returns the previous setting (TRUE if single precision)
+    */
+    int old = energy_single, s;
+
+    if (!isNull(single)) {
+        s = asLogical(single);
+        if (s == NA_LOGICAL)
+            error("storage mode must be TRUE or FALSE");
+        energy_single = s;
+    }
+    return ScalarLogical(old);
+}
+
+int float_storage(void)
+{
+    return energy_single;
+}
+
+packed_float *packed_to_float(packed_matrix *D)
+{
+    /*
+       convert D to single precision in place and free D
+       blocks of elements are rounded into buf and copied to the
+       start of the vector: single elements i to i+m (4 bytes each)
+       lie below double element i+m (8 bytes), so the elements not
+       yet read are not overwritten; the vector is then shrunk to
+       half its size
+    */
+    size_t i, k, m, len = PACKED_OFFSET(D->n);
+    float  buf[256], *f = (float *) D->x;
+    packed_float *F;
+
+    for (i=0; i<len; i+=m) {
+        m = (len - i < 256) ? len - i : 256;
+        for (k=0; k<m; k++)
+            buf[k] = (float) D->x[i + k];
+        memcpy(f + i, buf, m * sizeof(float));
+    }
+    F = Calloc(1, packed_float);
+    F->n = D->n;
+    F->x = Realloc(f, len > 0 ? len : 1, float);
+    Free(D);
+    return F;
+}
+
+void free_packed_float(packed_float *F)
+{
+    Free(F->x);
+    Free(F);
+}
+
+void packed_float_group_sums(packed_float *D, const int *group, int K,
+                             double *G, double *acc)
+{
+    /*
+       packed_group_sums for single precision D: the elements are
+       read in single and added in double precision
+    */
+    int i, j, k, n = D->n;
+    float  *Di;
+    double *Gi;
+    for (k=0; k<K*K; k++)
+        G[k] = 0.0;
+    for (i=1; i<n; i++) {
+        Di = D->x + PACKED_OFFSET(i);
+        for (k=0; k<K; k++)
+            acc[k] = 0.0;
+        for (j=0; j<i; j++)
+            acc[group[j]] += (double) Di[j];
+        Gi = G + (size_t) group[i] * K;
+        for (k=0; k<K; k++)
+            Gi[k] += acc[k];
+    }
+}
+
+double packed_float_perm_sum(packed_float *B, const int *perm,
+                             packed_row_fn f, void *ctx, double *work)
+{
+    /* packed_perm_sum for single precision B; the rows are double */
+    int    i, k, m, mj, J, K, K0, n = B->n;
+    int    *q = (int *) (work + (size_t) PACKED_PERM_BLOCK * n);
+    float  *BK, *BJ;
+    double *r, sum = 0.0;
+
+    for (k=0; k<n; k++)
+        q[perm[k]] = k;
+    for (K0=0; K0<n; K0+=PACKED_PERM_BLOCK) {
+        m = (n - K0 < PACKED_PERM_BLOCK) ? n - K0 : PACKED_PERM_BLOCK;
+        for (i=0; i<m; i++) {
+            K = K0 + i;
+            BK = B->x + PACKED_OFFSET(K);
+            r = work + (size_t) i * n;
+            for (J=0; J<=K; J++)
+                r[q[J]] = (double) BK[J];
+        }
+        for (J=K0+1; J<n; J++) {
+            BJ = B->x + PACKED_OFFSET(J) + K0;
+            mj = (J - K0 < m) ? J - K0 : m;
+            for (i=0; i<mj; i++)
+                work[(size_t) i * n + q[J]] = (double) BJ[i];
+        }
+        for (i=0; i<m; i++)
+            sum += f(q[K0 + i], work + (size_t) i * n, ctx);
+    }
+    return sum;
+}
@@ -0,0 +1,81 @@
+/*
+   utilities.h: packed storage for symmetric n by n matrices
+   (distance and double centered distance matrices), see utilities.c
+
+   The lower triangle, including the diagonal, is stored by rows in one
+   contiguous vector of length n(n+1)/2:  element (i, j), j <= i, is
+   x[i(i+1)/2 + j], so row i of the lower triangle is contiguous.
+
+   packed_perm_sum traverses B(perm[k], perm[j]) for the permutation
+   replicates: the rows of B are read in order, PACKED_PERM_BLOCK rows
+   at a time (one cache line of the rows below), and scattered into
+   contiguous rows permuted by the inverse of perm, so that no element
+   of B is read at random.
+
+   packed_float is the same layout in single precision, for the
+   permutation tests when energy.storage("single") is set: the matrix
+   is converted in place once computed in double, and sums over its
+   elements are accumulated in double.
+*/
+
+#ifndef ENERGY_UTILITIES_H
+#define ENERGY_UTILITIES_H
+
+#include <stddef.h>
+
+typedef struct {
+    int    n;
+    double *x;
+} packed_matrix;
+
+typedef struct {
+    int    n;
+    float  *x;
+} packed_float;
+
+#define PACKED_OFFSET(i) (((size_t) (i) * ((size_t) (i) + 1)) / 2)
+#define PACKED_ELT(D, i, j) ((i) >= (j) ? \
+    (D)->x[PACKED_OFFSET(i) + (j)] : (D)->x[PACKED_OFFSET(j) + (i)])
+
+#define PACKED_PERM_BLOCK 8
+
+/* row[j] = B(perm[k], perm[j]), j = 0, ..., n-1, for packed_perm_sum */
+typedef double (*packed_row_fn)(int k, const double *row, void *ctx);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+packed_matrix *alloc_packed(int n);
+void   free_packed(packed_matrix *D);
+void   packed_distance(double *x, packed_matrix *D, int d);
+void   packed_power_distance(double *x, packed_matrix *D, int d, double index);
+void   packed_squared_distance(double *x, packed_matrix *D, int d);
+void   packed_copy_square(double *x, packed_matrix *D);
+void   packed_copy_dist(double *x, packed_matrix *D);
+void   packed_sample_distance(double *x, int d, int type, double index,
+                              packed_matrix *D);
+int    sample_finite(const double *x, size_t len);
+void   packed_index_distance(packed_matrix *D, double index);
+void   packed_getrow(packed_matrix *D, int i, double *row);
+void   packed_rowsums(packed_matrix *D, double *rowsums);
+void   packed_group_sums(packed_matrix *D, const int *group, int K,
+                         double *G, double *acc);
+
+size_t packed_perm_worksize(int n);
+double packed_perm_sum(packed_matrix *B, const int *perm, packed_row_fn f,
+                       void *ctx, double *work);
+
+int    float_storage(void);
+packed_float *packed_to_float(packed_matrix *D);
+void   free_packed_float(packed_float *F);
+void   packed_float_group_sums(packed_float *D, const int *group, int K,
+                               double *G, double *acc);
+double packed_float_perm_sum(packed_float *B, const int *perm,
+                             packed_row_fn f, void *ctx, double *work);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif